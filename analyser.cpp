@@ -6,8 +6,69 @@
 #include <cstring>
 #include <algorithm>
 #include <unordered_map>
+#include <string_view>
+#include <thread>
+#include <exception>
 #include "commons.h"
 
+// sequence of `n` instructions starting at `first`, the number of its
+// occurencies and of their executions
+struct Occurency
+{
+    int32_t first;
+    int32_t n;
+    int32_t count;
+    uint64_t executions;
+};
+
+// n-grams are keyed by the bytes of their instructions in the code
+using NGramTable = std::unordered_map<std::string_view, Occurency>;
+
+// LAMA_THREADS threads or one per core, as in the interpreter
+size_t analyser_threads()
+{
+    const char *threads = getenv("LAMA_THREADS");
+    if (threads != nullptr && atoi(threads) > 0)
+    {
+        return atoi(threads);
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// runs body(0), ..., body(count - 1) on threads of their own and rethrows the first error
+template <typename F>
+void parallel_for(size_t count, F body)
+{
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        threads.emplace_back(
+            [&, k]
+            {
+                try
+                {
+                    body(k);
+                }
+                catch (...)
+                {
+                    errors[k] = std::current_exception();
+                }
+            });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    for (auto &error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
 struct Analyser
 {
     Result result;
@@ -15,10 +76,17 @@ struct Analyser
     // Bitvectors
     std::vector<bool> visited, boundary;
 
-    std::vector<int32_t> occurencies;
-    std::vector<int32_t> double_occurencies;
-    std::vector<std::tuple<int32_t, int32_t>> occurencies_u;
-    std::vector<std::tuple<int32_t, int32_t>> double_occurencies_u;
+    // first instructions of public symbols, called functions and closures, sorted
+    std::vector<int32_t> entries;
+
+    // longest sequences counted and threads counting them
+    size_t n = 2;
+    size_t threads = analyser_threads();
+
+    std::vector<Occurency> occurencies;
+
+    // executions of every instruction site from `interpreter -p`, empty without a profile
+    std::unordered_map<int32_t, uint64_t> executions;
 
     Analyser(Result res) : result(res), code(Code(res.code, res.code_size))
     {
@@ -26,100 +94,39 @@ struct Analyser
         boundary.resize(res.code_size, false);
     }
 
-    void sort_occurencies()
+    uint64_t executions_of(int32_t id) const
     {
-        std::sort(occurencies.begin(), occurencies.end(),
-                  [this](const auto &a, const auto &b)
-                  {
-                      return code.get_by_id(b)->cmp(code.get_by_id(a)) < 0;
-                  });
-
-        std::sort(double_occurencies.begin(), double_occurencies.end(),
-                  [this](const auto &a, const auto &b)
-                  {
-                      auto a_ = code.get_by_id(a);
-                      auto b_ = code.get_by_id(b);
-                      auto res = b_->cmp(a_);
-                      if (res == 0)
-                      {
-                          return code.get_next(b_)->cmp(code.get_next(a_)) < 0;
-                      }
-                      return res < 0;
-                  });
-
-        int32_t uniq1 = 1;
-        int32_t uniq2 = 1;
-
-        for (int32_t i = 1; i < occurencies.size(); i++)
-        {
-            if (code.get_by_id(occurencies[i - 1])->cmp(code.get_by_id(occurencies[i])) != 0)
-            {
-                uniq1 += 1;
-            }
-        }
-
-        for (int32_t i = 1; i < double_occurencies.size(); i++)
-        {
-            auto a_ = code.get_by_id(double_occurencies[i - 1]);
-            auto b_ = code.get_by_id(double_occurencies[i]);
-            if (a_->cmp(b_) != 0 || code.get_next(a_)->cmp(code.get_next(b_)) != 0)
-            {
-                uniq2 += 1;
-            }
-        }
-
-        occurencies_u.reserve(uniq1);
-        double_occurencies_u.reserve(uniq2);
-
-        if (occurencies.size() > 0)
-        {
-            occurencies_u.emplace_back(occurencies[0], 1);
+        auto it = executions.find(id);
+        return it != executions.end() ? it->second : 0;
+    }
 
-            for (int32_t i = 1; i < occurencies.size(); i++)
-            {
-                if (code.get_by_id(occurencies[i - 1])->cmp(code.get_by_id(occurencies[i])) != 0)
-                {
-                    occurencies_u.emplace_back(occurencies[i], 1);
-                }
-                else
-                {
-                    auto c = occurencies_u[occurencies_u.size() - 1];
-                    occurencies_u[occurencies_u.size() - 1] = std::tuple(std::get<0>(c), std::get<1>(c) + 1);
-                }
-            }
-        }
+    // occurencies are ordered by executions if there is a profile
+    uint64_t weight(const Occurency &occ) const
+    {
+        return executions.empty() ? occ.count : occ.executions;
+    }
 
-        if (double_occurencies.size() > 0)
+    // reads `site IP EXECUTIONS CYCLES ...` lines of a profile written by `interpreter -p`,
+    // sites are offsets in the bytecode file, 'lines' moves them to the stripped code
+    void load_profile(const std::string &fname, const LineTable &lines)
+    {
+        std::ifstream in(fname);
+        assert(in.good(), "Failed to read profile " + fname);
+        std::string line;
+        while (std::getline(in, line))
         {
-            double_occurencies_u.emplace_back(double_occurencies[0], 1);
-
-            for (int32_t i = 1; i < double_occurencies.size(); i++)
+            std::istringstream fields(line);
+            std::string kind, ip;
+            uint64_t count;
+            if (fields >> kind >> ip >> count && kind == "site")
             {
-                auto a_ = code.get_by_id(double_occurencies[i - 1]);
-                auto b_ = code.get_by_id(double_occurencies[i]);
-                if (a_->cmp(b_) != 0 || code.get_next(a_)->cmp(code.get_next(b_)) != 0)
-                {
-                    double_occurencies_u.emplace_back(double_occurencies[i], 1);
-                }
-                else
-                {
-                    auto c = double_occurencies_u[double_occurencies_u.size() - 1];
-                    double_occurencies_u[double_occurencies_u.size() - 1] = std::tuple(std::get<0>(c), std::get<1>(c) + 1);
-                }
+                int32_t id = std::stoi(ip, nullptr, 16);
+                assert(id >= 0, "Profile doesn't match the bytecode");
+                id = lines.stripped(id);
+                assert(id < result.code_size, "Profile doesn't match the bytecode");
+                executions[id] = count;
             }
         }
-
-        std::sort(occurencies_u.begin(), occurencies_u.end(),
-                  [](const auto &a, const auto &b)
-                  {
-                      return std::get<1>(a) > std::get<1>(b);
-                  });
-
-        std::sort(double_occurencies_u.begin(), double_occurencies_u.end(),
-                  [](const auto &a, const auto &b)
-                  {
-                      return std::get<1>(a) > std::get<1>(b);
-                  });
     }
 
     void mark_instructions()
@@ -129,11 +136,12 @@ struct Analyser
         for (int i = 0; i < result.header.pubs_length; i++)
         {
             assert(result.pubs[i].b >= 0 && result.pubs[i].b < result.code_size, "Public symbol points outside of code");
+            entries.push_back(result.pubs[i].b);
             if (visited[result.pubs[i].b])
             {
                 continue;
             }
-            stack.push_back(i);
+            stack.push_back(result.pubs[i].b);
             visited[result.pubs[i].b] = true;
             boundary[result.pubs[i].b] = true;
         }
@@ -164,6 +172,7 @@ struct Analyser
                     assert(cur->args[0] >= 0 && cur->args[0] < code.code_size, "Tried to call outside of code");
                     boundary[cur_id] = true;
                     auto jmp = cur->args[0];
+                    entries.push_back(jmp);
                     if (!visited[jmp])
                     {
                         stack.push_back(jmp);
@@ -192,6 +201,7 @@ struct Analyser
                 {
                     assert(cur->args[0] >= 0 && cur->args[0] < code.code_size, "Tried to create closure outside of code");
                     auto jmp = cur->args[0];
+                    entries.push_back(jmp);
                     if (!visited[jmp])
                     {
                         stack.push_back(jmp);
@@ -217,66 +227,144 @@ struct Analyser
                 }
             }
         }
-    }
-
-    void add_instr(Instruction *_inst)
-    {
-        occurencies.push_back(code.to_id(_inst));
-    }
 
-    void add_double_instr(Instruction *_inst)
-    {
-        double_occurencies.push_back(code.to_id(_inst));
+        std::sort(entries.begin(), entries.end());
+        entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
     }
 
-    void count_occurencies()
+    // counts n-grams of 1 to `n` instructions ending at every reachable instruction
+    // of [lo, hi) within its basic block, if any of their instructions has arguments
+    void count_range(int32_t lo, int32_t hi, std::vector<NGramTable> &shards) const
     {
-        Instruction *prev = nullptr;
-        for (auto cur = code.get_by_id(0); cur != nullptr;)
+        // the last instructions of the block and their executions
+        std::vector<int32_t> window;
+        std::vector<uint64_t> window_executions;
+        for (int32_t cur_id = lo; cur_id < hi;)
         {
-            auto cur_id = code.to_id(cur);
-            // std::cout << (reachable[cur_id] ? "* " : "  ") << *cur << "\n";
             if (!visited[cur_id])
             {
-                prev = nullptr;
-                cur = code.get_next_inc(cur);
+                window.clear();
+                window_executions.clear();
+                cur_id++;
                 continue;
             }
 
-            if (cur->get_args_length() > 0)
+            auto cur = code.get_by_id(cur_id);
+            if (window.size() == n)
             {
-                add_instr(cur);
+                window.erase(window.begin());
+                window_executions.erase(window_executions.begin());
             }
-            if (prev != nullptr && prev->get_args_length() + cur->get_args_length() > 0)
+            window.push_back(cur_id);
+            window_executions.push_back(executions_of(cur_id));
+
+            int32_t end = cur_id + cur->size();
+            size_t args = 0;
+            // an n-gram runs at most as often as each of its instructions
+            uint64_t runs = UINT64_MAX;
+            for (size_t k = window.size(); k-- > 0;)
             {
-                add_double_instr(prev);
+                args += code.get_by_id(window[k])->get_args_length();
+                runs = std::min(runs, window_executions[k]);
+                if (args == 0)
+                {
+                    continue;
+                }
+                std::string_view key(code.code + window[k], end - window[k]);
+                auto &table = shards[std::hash<std::string_view>()(key) % shards.size()];
+                auto [it, _] = table.try_emplace(key, Occurency{window[k], int32_t(window.size() - k), 0, 0});
+                it->second.count++;
+                it->second.executions += runs;
             }
 
             if (boundary[cur_id])
             {
-                prev = nullptr;
+                window.clear();
+                window_executions.clear();
             }
-            else
+            cur_id = end;
+        }
+    }
+
+    // Functions are scanned by `threads` threads in contiguous ranges of about
+    // the same size, every thread spreads its n-grams over `threads` shards by
+    // hash and then merges one shard of all threads
+    void count_occurencies()
+    {
+        std::vector<int32_t> cuts = {0};
+        for (size_t t = 1; t < threads; t++)
+        {
+            int32_t target = int64_t(result.code_size) * t / threads;
+            auto entry = std::lower_bound(entries.begin(), entries.end(), target);
+            if (entry != entries.end() && *entry > cuts.back())
             {
-                prev = cur;
+                cuts.push_back(*entry);
             }
-            cur = code.get_next(cur);
         }
+        cuts.push_back(result.code_size);
+        size_t ranges = cuts.size() - 1;
+
+        std::vector<std::vector<NGramTable>> tables(ranges, std::vector<NGramTable>(ranges));
+        parallel_for(ranges, [&](size_t t) { count_range(cuts[t], cuts[t + 1], tables[t]); });
+
+        parallel_for(ranges,
+                     [&](size_t s)
+                     {
+                         auto &merged = tables[0][s];
+                         for (size_t t = 1; t < ranges; t++)
+                         {
+                             for (auto &[key, occ] : tables[t][s])
+                             {
+                                 auto [it, inserted] = merged.try_emplace(key, occ);
+                                 if (!inserted)
+                                 {
+                                     // ranges are merged in the order of the code, the first occurency is already the earliest
+                                     it->second.count += occ.count;
+                                     it->second.executions += occ.executions;
+                                 }
+                             }
+                             tables[t][s] = NGramTable();
+                         }
+                     });
+
+        for (auto &shard : tables[0])
+        {
+            for (auto &[key, occ] : shard)
+            {
+                occurencies.push_back(occ);
+            }
+        }
+        std::sort(occurencies.begin(), occurencies.end(),
+                  [this](const Occurency &a, const Occurency &b)
+                  {
+                      if (weight(a) != weight(b))
+                      {
+                          return weight(a) > weight(b);
+                      }
+                      if (a.n != b.n)
+                      {
+                          return a.n > b.n;
+                      }
+                      return a.first < b.first;
+                  });
     }
 
     void analyse()
     {
         mark_instructions();
         count_occurencies();
-        sort_occurencies();
     }
 };
 
-void print_occurency(Code code, std::tuple<int32_t, int32_t> occ, int32_t size)
+void print_occurency(Code code, const Occurency &occ, bool profiled)
 {
-    std::cout << std::get<1>(occ) << " ";
-    auto cur = code.get_by_id(std::get<0>(occ));
-    for (int32_t i = 0; i < size - 1; i++)
+    std::cout << occ.count << " ";
+    if (profiled)
+    {
+        std::cout << occ.executions << " ";
+    }
+    auto cur = code.get_by_id(occ.first);
+    for (int32_t i = 0; i < occ.n - 1; i++)
     {
         std::cout << *cur << "; ";
         cur = code.get_next(cur);
@@ -285,48 +373,56 @@ void print_occurency(Code code, std::tuple<int32_t, int32_t> occ, int32_t size)
 }
 
 int main(int argc, char **argv)
+try
 {
-    assert(argc >= 2, "No input file");
+    // `analyser [-n N] BYTECODE [PROFILE]` counts sequences of up to N instructions, 2 by default
+    size_t n = 2;
+    int arg = 1;
+    if (arg + 1 < argc && std::string(argv[arg]) == "-n")
+    {
+        n = std::stoul(argv[arg + 1]);
+        assert(n > 0, "N must be positive");
+        arg += 2;
+    }
+    assert(arg < argc, "No input file");
 
-    std::string fname = argv[1];
+    std::string fname = argv[arg];
 
-    std::vector<char> bytes = read_file(fname);
+    FileView file = read_file(fname);
 
-    Result result = parse_and_validate(std::move(bytes));
+    Result result = parse_and_validate(file);
+    // LINE is never executed, sequences run across it
+    LineTable lines = strip_lines(result);
 
     Code code = Code(result.code, result.code_size);
     Analyser a = Analyser(result);
+    a.n = n;
+    // `analyser BYTECODE PROFILE` prints executions after occurencies and sorts by them
+    bool profiled = arg + 1 < argc;
+    if (profiled)
+    {
+        a.load_profile(argv[arg + 1], lines);
+    }
     a.analyse();
 
-    std::cout << "Instructions sorted by occurencies:\n";
+    if (profiled)
+    {
+        std::cout << "Instructions sorted by executions:\n";
+    }
+    else
+    {
+        std::cout << "Instructions sorted by occurencies:\n";
+    }
 
-    for (int32_t i = 0, j = 0; i < a.occurencies_u.size() || j < a.double_occurencies_u.size();)
+    for (auto &occ : a.occurencies)
     {
-        if (i >= a.occurencies_u.size())
-        {
-            auto occ = a.double_occurencies_u[j++];
-            print_occurency(code, occ, 2);
-            continue;
-        }
-        if (j >= a.double_occurencies_u.size())
-        {
-            auto occ = a.occurencies_u[i++];
-            print_occurency(code, occ, 1);
-            continue;
-        }
-        auto occ1 = a.occurencies_u[i];
-        auto occ2 = a.double_occurencies_u[j];
-        if (std::get<1>(occ1) > std::get<1>(occ2))
-        {
-            print_occurency(code, occ1, 1);
-            i++;
-        }
-        else
-        {
-            print_occurency(code, occ2, 2);
-            j++;
-        }
+        print_occurency(code, occ, profiled);
     }
 
     exit(0);
-}
\ No newline at end of file
+}
+catch (const VMError &e)
+{
+    std::cout << e.what() << "\n";
+    exit(1);
+}
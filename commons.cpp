@@ -6,14 +6,31 @@
 #include <cstring>
 #include <algorithm>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "commons.h"
 
+static std::string format_error(const std::string &msg, int32_t ip)
+{
+    if (ip < 0)
+    {
+        return msg;
+    }
+
+    std::ostringstream s;
+    s << "[ip=" << std::hex << ip << std::dec << "] " << msg;
+    return s.str();
+}
+
+VMError::VMError(const std::string &msg, int32_t ip_) : std::runtime_error(format_error(msg, ip_)), ip(ip_), message(msg) {}
+
 void assert(bool cond, std::string msg)
 {
     if (!cond)
     {
-        std::cout << msg << "\n";
-        exit(1);
+        throw VMError(msg);
     }
 }
 
@@ -21,27 +38,31 @@ void assert_with_ip(bool cond, int32_t ip, std::string msg)
 {
     if (!cond)
     {
-        std::cout << "[ip=" << std::hex << ip << std::dec << "] " << msg << "\n";
-        exit(1);
+        throw VMError(msg, ip);
     }
 }
 
-std::vector<char> read_file(std::string fname)
+FileView read_file(std::string fname)
 {
-    std::ifstream file;
-    file.open(fname, std::ios_base::binary);
+    int fd = open(fname.c_str(), O_RDONLY);
+    assert(fd >= 0, "File not exists or empty");
 
-    file.seekg(0, std::ios_base::end);
-    std::streampos length = file.tellg();
-    file.seekg(0, std::ios_base::beg);
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+    void *data = ok ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
 
-    assert(length > 0, "File not exists or empty");
+    assert(ok, "File not exists or empty");
+    assert(data != MAP_FAILED, "Failed to map file");
 
-    std::vector<char> buffer;
-    buffer.resize(length);
-    file.read(&buffer[0], length);
+    return FileView{static_cast<char *>(data), static_cast<size_t>(st.st_size)};
+}
 
-    return buffer;
+void unmap_file(FileView file)
+{
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(file.data) & ~(page - 1);
+    munmap(reinterpret_cast<void *>(begin), reinterpret_cast<uintptr_t>(file.data) - begin + file.size);
 }
 
 namespace instr
@@ -170,20 +191,34 @@ namespace instr
             return "CALL_Lstring";
         case CALL_Barray:
             return "CALL_Barray";
+        case CALL_Bspawn:
+            return "CALL_Bspawn";
+        case CALL_Byield:
+            return "CALL_Byield";
+        case CALL_Bjoin:
+            return "CALL_Bjoin";
+        case CALL_Bpmap:
+            return "CALL_Bpmap";
+        case CALL_Bpfold:
+            return "CALL_Bpfold";
+        case CALL_Bpfilter:
+            return "CALL_Bpfilter";
         default:
             return "UNK";
         }
     };
 }
 
-Result parse_and_validate(std::vector<char> bytes)
+Result parse_and_validate(FileView file)
 {
+    char *bytes = file.data;
+
     Result result = {};
     Header header = {};
 
     const size_t header_size = sizeof(Header);
 
-    assert(bytes.size() >= header_size, "File is too small");
+    assert(file.size >= header_size, "File is too small");
 
     std::memcpy(&header, &bytes[0], sizeof(header));
 
@@ -192,7 +227,7 @@ Result parse_and_validate(std::vector<char> bytes)
 
     const size_t file_size = header_size + header.pubs_length * sizeof(Pub) + header.st_length;
 
-    assert(bytes.size() > file_size, "File is too small or header is invalid");
+    assert(file.size > file_size, "File is too small or header is invalid");
 
     result.header = header;
 
@@ -209,15 +244,29 @@ Result parse_and_validate(std::vector<char> bytes)
     result.st = &bytes[st_offset];
 
     const size_t code_offset = st_offset + header.st_length;
-    result.code_size = bytes.size() - code_offset;
+    result.code_size = file.size - code_offset;
     assert(result.code_size > 0, "Empty code section");
     result.code = &bytes[code_offset];
 
-    result.bytes = std::move(bytes);
+    result.file = file;
 
     return result;
 }
 
+void copy_code(Result &result)
+{
+    if (result.copy != nullptr)
+    {
+        return;
+    }
+    const size_t pubs = result.header.pubs_length * sizeof(Pub);
+    result.copy.reset(new char[pubs + result.code_size]);
+    std::memcpy(result.copy.get(), result.pubs, pubs);
+    std::memcpy(result.copy.get() + pubs, result.code, result.code_size);
+    result.pubs = reinterpret_cast<Pub *>(result.copy.get());
+    result.code = result.copy.get() + pubs;
+}
+
 size_t Instruction::get_args_length() const
 {
     switch (tag)
@@ -324,6 +373,12 @@ size_t Instruction::get_args_length() const
     case instr::CALL_Lwrite:
     case instr::CALL_Llength:
     case instr::CALL_Lstring:
+    case instr::CALL_Bspawn:
+    case instr::CALL_Byield:
+    case instr::CALL_Bjoin:
+    case instr::CALL_Bpmap:
+    case instr::CALL_Bpfold:
+    case instr::CALL_Bpfilter:
     {
         return 0;
     }
@@ -473,11 +528,19 @@ int32_t Instruction::get_popped()
     case instr::PATT_is_fun:
         return 1;
     case instr::CALL_Lread:
+    case instr::CALL_Byield:
         return 0;
     case instr::CALL_Lwrite:
     case instr::CALL_Llength:
     case instr::CALL_Lstring:
+    case instr::CALL_Bspawn:
+    case instr::CALL_Bjoin:
         return 1;
+    case instr::CALL_Bpmap:
+    case instr::CALL_Bpfilter:
+        return 2;
+    case instr::CALL_Bpfold:
+        return 3;
     case instr::CALL_Barray:
         return args[0];
     default:
@@ -559,6 +622,12 @@ int32_t Instruction::get_pushed()
     case instr::CALL_Llength:
     case instr::CALL_Lstring:
     case instr::CALL_Barray:
+    case instr::CALL_Bspawn:
+    case instr::CALL_Byield:
+    case instr::CALL_Bjoin:
+    case instr::CALL_Bpmap:
+    case instr::CALL_Bpfold:
+    case instr::CALL_Bpfilter:
         return 1;
     default:
         return 0;
@@ -665,3 +734,75 @@ std::ostream &operator<<(std::ostream &os, const Instruction &_ins)
     }
     return os;
 }
+
+LineTable strip_lines(Result &result)
+{
+    copy_code(result);
+    LineTable lines;
+    char *code = result.code;
+    const int32_t size = result.code_size;
+    // new offset of every instruction start, -1 elsewhere
+    std::vector<int32_t> moved(size + 1, -1);
+
+    int32_t from = 0;
+    int32_t to = 0;
+    int32_t shift = 0;
+    while (from < size)
+    {
+        auto *cur = reinterpret_cast<Instruction *>(code + from);
+        size_t fixed = sizeof(char) + sizeof(int32_t) * cur->get_args_length();
+        if (from + fixed > static_cast<size_t>(size) ||
+            (cur->is_closure() && (cur->args[1] < 0 || from + cur->size() > static_cast<size_t>(size))))
+        {
+            break;
+        }
+
+        int32_t len = cur->size();
+        moved[from] = to;
+        if (cur->tag == instr::LINE)
+        {
+            shift += len;
+            lines.entries.push_back({to, cur->args[0], shift});
+        }
+        else
+        {
+            std::memmove(code + to, code + from, len);
+            to += len;
+        }
+        from += len;
+    }
+    const int32_t decoded = to;
+    for (int32_t i = from; i <= size; i++)
+    {
+        moved[i] = to + (i - from);
+    }
+    std::memmove(code + to, code + from, size - from);
+    result.code_size = to + (size - from);
+
+    auto relocate = [&](int32_t target)
+    {
+        return target >= 0 && target <= size && moved[target] >= 0 ? moved[target] : size;
+    };
+    for (int32_t ip = 0; ip < decoded;)
+    {
+        auto *cur = reinterpret_cast<Instruction *>(code + ip);
+        switch (cur->tag)
+        {
+        case instr::JMP:
+        case instr::CJMPZ:
+        case instr::CJMPNZ:
+        case instr::CALL:
+        case instr::CLOSURE:
+            cur->args[0] = relocate(cur->args[0]);
+            break;
+        default:
+            break;
+        }
+        ip += cur->size();
+    }
+    for (int32_t i = 0; i < result.header.pubs_length; i++)
+    {
+        result.pubs[i].b = relocate(result.pubs[i].b);
+    }
+    return lines;
+}
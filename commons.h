@@ -6,12 +6,61 @@
 #include <sstream>
 #include <cstring>
 #include <algorithm>
+#include <memory>
+#include <stdexcept>
 #include <stdint.h>
 
+// Error of loading, verification or execution of a program, thrown by assert and assert_with_ip
+struct VMError : std::runtime_error
+{
+    // -1 if the error is not bound to an instruction
+    int32_t ip;
+    // without the offset of the instruction
+    std::string message;
+
+    explicit VMError(const std::string &msg, int32_t ip_ = -1);
+};
+
 void assert(bool cond, std::string msg);
 void assert_with_ip(bool cond, int32_t ip, std::string msg);
 
-std::vector<char> read_file(std::string fname);
+// Whole file mapped read-only, pages are shared with the page cache. The loader
+// patches and strips a copy of the code (see copy_code). Stays mapped until exit
+// or unmap_file.
+struct FileView
+{
+    char *data;
+    size_t size;
+};
+
+FileView read_file(std::string fname);
+// Unmaps a view returned by read_file or one starting inside the first page of a mapping
+void unmap_file(FileView file);
+
+// Unmaps a view when it goes out of scope, unless it was released to a new owner
+struct MappedFile
+{
+    FileView file;
+
+    explicit MappedFile(FileView file_) : file(file_) {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (file.data != nullptr)
+        {
+            unmap_file(file);
+        }
+    }
+
+    FileView release()
+    {
+        FileView f = file;
+        file = FileView{nullptr, 0};
+        return f;
+    }
+};
 
 struct Header
 {
@@ -25,6 +74,17 @@ struct Pub
     int32_t a, b;
 };
 
+// Frame layout of a function found by the verifier, which replaces the number
+// of locals in the function's BEGIN with the index of its entry
+struct FunctionInfo
+{
+    // of the BEGIN in the bytecode file
+    int32_t offset;
+    int32_t locals;
+    // maximum depth of the operand stack
+    int32_t depth;
+};
+
 struct Result
 {
     Header header;
@@ -33,7 +93,11 @@ struct Result
     char *code;
 
     int32_t code_size;
-    std::vector<char> bytes;
+    FileView file;
+    // empty until the program is verified
+    std::vector<FunctionInfo> functions;
+    // public symbols and code once copied out of 'file', null before
+    std::shared_ptr<char[]> copy;
 };
 
 namespace instr
@@ -99,13 +163,24 @@ namespace instr
         CALL_Lwrite,
         CALL_Llength,
         CALL_Lstring,
-        CALL_Barray
+        CALL_Barray,
+        // fibers, see vm.cpp
+        CALL_Bspawn,
+        CALL_Byield,
+        CALL_Bjoin,
+        // parallel builtins, see vm.cpp
+        CALL_Bpmap,
+        CALL_Bpfold,
+        CALL_Bpfilter
     };
 
     const char *name(Instr _ins);
 }
 
-Result parse_and_validate(std::vector<char> bytes);
+Result parse_and_validate(FileView file);
+// Moves the public symbols and the code of the program to a buffer of its own,
+// which may be written, unless it is already there
+void copy_code(Result &result);
 
 #pragma pack(push, 1)
 struct Instruction
@@ -168,3 +243,58 @@ struct Code
 };
 
 std::ostream &operator<<(std::ostream &os, const Instruction &_ins);
+
+// LINE instructions only mark source lines, so the loader strips them from the
+// code instead of dispatching them, and the analyser does the same to count
+// the sequences that actually run. For every removed LINE the table keeps the
+// offset of its successor in the stripped code, the line and the number of
+// bytes removed up to it. Errors, the profiler and the sampler translate
+// offsets back to the bytecode file with it, so reports match `interpreter -d`,
+// and the analyser translates profiles forth.
+struct LineTable
+{
+    struct Entry
+    {
+        int32_t ip;
+        int32_t line;
+        int32_t shift;
+    };
+
+    // sorted by ip
+    std::vector<Entry> entries;
+
+    // the last LINE before the instruction at 'ip' of the stripped code
+    const Entry *find(size_t ip) const
+    {
+        auto it = std::upper_bound(entries.begin(), entries.end(), ip,
+                                   [](size_t ip, const Entry &e) { return ip < static_cast<size_t>(e.ip); });
+        return it == entries.begin() ? nullptr : &*(it - 1);
+    }
+
+    // offset in the bytecode file
+    size_t origin(size_t ip) const
+    {
+        const Entry *e = find(ip);
+        return e != nullptr ? ip + e->shift : ip;
+    }
+
+    // offset in the stripped code of the instruction at 'origin' of the bytecode file
+    size_t stripped(size_t origin) const
+    {
+        auto it = std::upper_bound(entries.begin(), entries.end(), origin,
+                                   [](size_t origin, const Entry &e) { return origin < static_cast<size_t>(e.ip + e.shift); });
+        return it == entries.begin() ? origin : origin - (it - 1)->shift;
+    }
+
+    // 0 if unknown
+    int32_t line(size_t ip) const
+    {
+        const Entry *e = find(ip);
+        return e != nullptr ? e->line : 0;
+    }
+};
+
+// Removes LINE instructions and relocates jump, call and closure targets and
+// public symbols, in the copy of the code. Code that can't be decoded is left as
+// is from that point on, targets inside instructions are moved out of the code.
+LineTable strip_lines(Result &result);
@@ -0,0 +1,345 @@
+#include <iostream>
+#include <vector>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "runtime/gc.h"
+#include "commons.h"
+
+extern "C" char *de_hash(aint n);
+
+// Object graph of a heap dump (see gc_dump_heap), objects are numbered in the
+// order of the file and references are resolved to the numbers
+struct HeapDump
+{
+    struct Object
+    {
+        uint64_t address;
+        uint64_t header;
+        uint64_t size;
+        uint64_t label;
+        // references are refs[first_ref, first_ref + refs_count)
+        size_t first_ref;
+        size_t refs_count;
+    };
+
+    std::vector<size_t> roots;
+    std::vector<Object> objects;
+    std::vector<size_t> refs;
+
+    explicit HeapDump(const std::string &fname)
+    {
+        std::ifstream in(fname, std::ios::binary);
+        assert(in.good(), "Failed to open heap dump " + fname);
+        std::vector<uint64_t> words;
+        uint64_t word;
+        while (in.read(reinterpret_cast<char *>(&word), sizeof(word)))
+        {
+            words.push_back(word);
+        }
+
+        size_t pos = 0;
+        auto next = [&]()
+        {
+            assert(pos < words.size(), "Unexpected end of heap dump");
+            return words[pos++];
+        };
+        assert(words.size() >= 4 && std::memcmp(&words[0], HEAP_DUMP_MAGIC, sizeof(uint64_t)) == 0,
+               "Not a heap dump: " + fname);
+        pos = 1;
+        assert(next() == HEAP_DUMP_VERSION, "Unsupported heap dump version");
+        uint64_t roots_count = next();
+        uint64_t objects_count = next();
+
+        std::vector<uint64_t> root_addresses;
+        for (uint64_t i = 0; i < roots_count; i++)
+        {
+            root_addresses.push_back(next());
+        }
+        std::vector<uint64_t> ref_addresses;
+        for (uint64_t i = 0; i < objects_count; i++)
+        {
+            Object o;
+            o.address = next();
+            o.header = next();
+            o.size = next();
+            o.label = next();
+            o.refs_count = next();
+            o.first_ref = ref_addresses.size();
+            for (size_t k = 0; k < o.refs_count; k++)
+            {
+                ref_addresses.push_back(next());
+            }
+            objects.push_back(o);
+        }
+
+        std::unordered_map<uint64_t, size_t> index;
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            index[objects[i].address] = i;
+        }
+        auto resolve = [&](uint64_t address)
+        {
+            auto it = index.find(address);
+            assert(it != index.end(), "Reference to an object missing from heap dump");
+            return it->second;
+        };
+        for (uint64_t address : root_addresses)
+        {
+            roots.push_back(resolve(address));
+        }
+        for (uint64_t address : ref_addresses)
+        {
+            refs.push_back(resolve(address));
+        }
+    }
+
+    std::string type_of(size_t i) const
+    {
+        const Object &o = objects[i];
+        switch (get_type_header_ptr(&o.header))
+        {
+        case SEXP:
+            return std::string("sexp ") + de_hash(static_cast<aint>(o.label));
+        case ARRAY:
+            return "array";
+        case STRING:
+            return "string";
+        case CLOSURE:
+        {
+            std::ostringstream s;
+            s << "closure 0x" << std::hex << o.label;
+            return s.str();
+        }
+        default:
+            return "unknown";
+        }
+    }
+};
+
+// Dominator tree of the object graph with a virtual root referencing all roots,
+// see "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy.
+// An object retains the objects it dominates: they would be freed with it.
+struct Dominators
+{
+    const HeapDump &dump;
+    // the virtual root is numbered after the objects
+    size_t root;
+    // objects reachable from the root in reverse postorder, and the position of each in it
+    std::vector<size_t> order, position;
+    std::vector<size_t> idom;
+    // size of an object and all objects it dominates
+    std::vector<uint64_t> retained;
+
+    explicit Dominators(const HeapDump &dump_) : dump(dump_), root(dump_.objects.size())
+    {
+        size_t n = root + 1;
+        auto successors = [&](size_t v)
+        {
+            if (v == root)
+            {
+                return std::make_pair(dump.roots.data(), dump.roots.data() + dump.roots.size());
+            }
+            const HeapDump::Object &o = dump.objects[v];
+            const size_t *first = dump.refs.data() + o.first_ref;
+            return std::make_pair(first, first + o.refs_count);
+        };
+
+        // postorder by an explicit depth-first search
+        std::vector<bool> seen(n, false);
+        std::vector<std::pair<size_t, size_t>> stack = {{root, 0}};
+        seen[root] = true;
+        while (!stack.empty())
+        {
+            auto &[v, k] = stack.back();
+            auto [first, last] = successors(v);
+            if (first + k < last)
+            {
+                size_t w = first[k++];
+                if (!seen[w])
+                {
+                    seen[w] = true;
+                    stack.push_back({w, 0});
+                }
+                continue;
+            }
+            order.push_back(v);
+            stack.pop_back();
+        }
+        std::reverse(order.begin(), order.end());
+        position.assign(n, n);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            position[order[i]] = i;
+        }
+
+        std::vector<std::vector<size_t>> predecessors(n);
+        for (size_t v : order)
+        {
+            auto [first, last] = successors(v);
+            for (auto p = first; p != last; p++)
+            {
+                predecessors[*p].push_back(v);
+            }
+        }
+
+        const size_t undefined = n;
+        idom.assign(n, undefined);
+        idom[root] = root;
+        auto intersect = [&](size_t a, size_t b)
+        {
+            while (a != b)
+            {
+                while (position[a] > position[b])
+                {
+                    a = idom[a];
+                }
+                while (position[b] > position[a])
+                {
+                    b = idom[b];
+                }
+            }
+            return a;
+        };
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (size_t i = 1; i < order.size(); i++)
+            {
+                size_t v = order[i];
+                size_t new_idom = undefined;
+                for (size_t p : predecessors[v])
+                {
+                    if (idom[p] == undefined)
+                    {
+                        continue;
+                    }
+                    new_idom = new_idom == undefined ? p : intersect(p, new_idom);
+                }
+                if (idom[v] != new_idom)
+                {
+                    idom[v] = new_idom;
+                    changed = true;
+                }
+            }
+        }
+
+        retained.assign(n, 0);
+        for (size_t i = order.size(); i-- > 1;)
+        {
+            size_t v = order[i];
+            retained[v] += dump.objects[v].size;
+            retained[idom[v]] += retained[v];
+        }
+    }
+};
+
+struct TypeStat
+{
+    uint64_t count = 0, shallow = 0, retained = 0;
+};
+
+// Sums sizes by type; retained sizes are counted for objects not dominated by
+// an object of the same type, so that a list doesn't count its tail again
+std::unordered_map<std::string, TypeStat> stats_by_type(const HeapDump &dump, const Dominators &d)
+{
+    size_t n = d.root + 1;
+    std::vector<std::string> types(dump.objects.size());
+    std::vector<std::vector<size_t>> children(n);
+    for (size_t i = 1; i < d.order.size(); i++)
+    {
+        size_t v = d.order[i];
+        types[v] = dump.type_of(v);
+        children[d.idom[v]].push_back(v);
+    }
+
+    std::unordered_map<std::string, TypeStat> stats;
+    // objects of every type on the path from the root to the current one
+    std::unordered_map<std::string, size_t> active;
+    std::vector<std::pair<size_t, size_t>> stack = {{d.root, 0}};
+    while (!stack.empty())
+    {
+        auto &[v, k] = stack.back();
+        if (k < children[v].size())
+        {
+            size_t w = children[v][k++];
+            TypeStat &s = stats[types[w]];
+            s.count++;
+            s.shallow += dump.objects[w].size;
+            if (active[types[w]]++ == 0)
+            {
+                s.retained += d.retained[w];
+            }
+            stack.push_back({w, 0});
+            continue;
+        }
+        if (v != d.root)
+        {
+            active[types[v]]--;
+        }
+        stack.pop_back();
+    }
+    return stats;
+}
+
+int main(int argc, char **argv)
+try
+{
+    assert(argc >= 2, "No input file");
+    // `heapanalyser DUMP [N]` prints N largest entries of every table
+    size_t top = argc >= 3 ? std::stoul(argv[2]) : 20;
+
+    HeapDump dump(argv[1]);
+    Dominators d(dump);
+
+    uint64_t bytes = 0;
+    for (auto &o : dump.objects)
+    {
+        bytes += o.size;
+    }
+    std::cout << "Objects: " << dump.objects.size() << ", bytes: " << bytes << ", roots: " << dump.roots.size() << "\n";
+
+    auto stats = stats_by_type(dump, d);
+    std::vector<std::pair<std::string, TypeStat>> types(stats.begin(), stats.end());
+    std::sort(types.begin(), types.end(),
+              [](const auto &a, const auto &b) { return a.second.retained > b.second.retained; });
+    std::cout << "\nTypes sorted by retained size:\n";
+    std::cout << std::setw(12) << "RETAINED" << std::setw(12) << "SHALLOW" << std::setw(10) << "COUNT" << "  TYPE\n";
+    for (size_t i = 0; i < types.size() && i < top; i++)
+    {
+        auto &[type, s] = types[i];
+        std::cout << std::setw(12) << s.retained << std::setw(12) << s.shallow << std::setw(10) << s.count << "  " << type
+                  << "\n";
+    }
+
+    std::vector<size_t> objects(dump.objects.size());
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        objects[i] = i;
+    }
+    size_t shown = std::min(top, objects.size());
+    std::partial_sort(objects.begin(), objects.begin() + shown, objects.end(),
+                      [&](size_t a, size_t b) { return d.retained[a] > d.retained[b]; });
+    std::cout << "\nObjects sorted by retained size, with their dominators:\n";
+    for (size_t i = 0; i < shown; i++)
+    {
+        size_t v = objects[i];
+        std::cout << std::setw(12) << d.retained[v] << "  0x" << std::hex << dump.objects[v].address << std::dec << " "
+                  << dump.type_of(v);
+        for (size_t u = d.idom[v], depth = 0; u != d.root && depth < 4; u = d.idom[u], depth++)
+        {
+            std::cout << " <- " << dump.type_of(u);
+        }
+        std::cout << (d.idom[v] == d.root ? " <- root" : "") << "\n";
+    }
+
+    exit(0);
+}
+catch (const VMError &e)
+{
+    std::cout << e.what() << "\n";
+    exit(1);
+}
@@ -4,10 +4,15 @@
 
 #include "gc.h"
 
+#include "immix.h"
 #include "runtime_common.h"
+#include "vm_context.h"
 
 #include <assert.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,9 +27,11 @@ static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
 size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+__thread lama_vm *__vm;
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+__thread alloc_region __gc_alloc_region;
+
+__thread size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 #ifdef __linux__
 extern const size_t __start_custom_data, __stop_custom_data;
@@ -34,12 +41,248 @@ extern const size_t __stop_custom_data __asm("section$end$__DATA$custom_data");
 #endif
 #endif
 
+#ifdef LAMA_GC_IMMIX
+static const gc_backend DEFAULT_BACKEND = GC_IMMIX;
+#else
+static const gc_backend DEFAULT_BACKEND = GC_LISP2;
+#endif
+
+// roots of the runtime function being executed by this thread
+static __thread extra_roots_pool extra_roots;
+
+/* GC statistics, see gc.h */
+
+// these take any context, so they come before the macros for the bound one
+
+uint64_t gc_clock_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// bytes mapped for objects of the context: heap chunk or immix blocks and large objects
+static size_t mapped_bytes (const lama_vm *vm) {
+  size_t heap_bytes = vm->backend == GC_IMMIX
+                          ? vm->immix.chunks_count * IMMIX_CHUNK_BLOCKS * IMMIX_BLOCK_SIZE
+                          : WORDS_TO_BYTES(vm->heap.size);
+  return heap_bytes + vm->los.live + vm->los.allocated;
+}
+
+// live contexts, their statistics are written at exit and on SIGUSR1
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static lama_vm        *contexts;
+static pthread_once_t  signals_once = PTHREAD_ONCE_INIT;
+// value of LAMA_GC_STATS, NULL if it is not set
+static const char     *stats_destination;
+// value of LAMA_HEAP_DUMP, NULL if it is not set
+static const char     *heap_dump_path;
+// set by SIGUSR1 and SIGUSR2 until a mutator takes the request at a safepoint
+static volatile int    stats_requested;
+static volatile int    heap_dump_requested;
+
+// writes statistics of the context as a line of JSON
+static void write_stats (const lama_vm *vm) {
+  const gc_stats *s       = &vm->stats;
+  uint64_t        elapsed = gc_clock_ns() - s->start_ns;
+  double throughput       = elapsed > s->pause_ns ? 1.0 - (double)s->pause_ns / elapsed : 0.0;
+  char   buf[2048];
+  int    n = snprintf(buf,
+                   sizeof(buf),
+                   "{\"backend\":\"%s\",\"collections\":%zu,\"elapsed_ns\":%" PRIu64
+                   ",\"pause_ns\":%" PRIu64 ",\"max_pause_ns\":%" PRIu64
+                   ",\"throughput\":%.4f,\"phases_ns\":{\"mark\":%" PRIu64
+                   ",\"compute_locations\":%" PRIu64 ",\"relocate\":%" PRIu64
+                   ",\"update_references\":%" PRIu64 ",\"sweep\":%" PRIu64 "},\"pauses_us\":{",
+                   vm->backend == GC_IMMIX ? "immix" : "lisp2",
+                   s->collections,
+                   elapsed,
+                   s->pause_ns,
+                   s->max_pause_ns,
+                   throughput,
+                   s->mark_ns,
+                   s->compute_locations_ns,
+                   s->relocate_ns,
+                   s->update_references_ns,
+                   s->sweep_ns);
+  bool first = true;
+  for (size_t i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+    if (s->pauses[i] == 0) { continue; }
+    if (i + 1 < GC_PAUSE_BUCKETS) {
+      n += snprintf(buf + n, sizeof(buf) - n, "%s\"%zu\":%zu", first ? "" : ",", (size_t)1 << i, s->pauses[i]);
+    } else {
+      n += snprintf(buf + n, sizeof(buf) - n, "%s\"inf\":%zu", first ? "" : ",", s->pauses[i]);
+    }
+    first = false;
+  }
+  n += snprintf(buf + n,
+                sizeof(buf) - n,
+                "},\"reclaimed_bytes\":%zu,\"live_bytes\":%zu,\"heap_bytes\":%zu,\"peak_heap_bytes\":%zu}\n",
+                s->reclaimed_bytes,
+                s->live_bytes,
+                mapped_bytes(vm),
+                MAX(s->peak_heap_bytes, mapped_bytes(vm)));
+
+  const char *dest = stats_destination;
+  bool to_stderr   = dest == NULL || strcmp(dest, "1") == 0 || strcmp(dest, "-") == 0;
+  int  fd          = to_stderr ? STDERR_FILENO : open(dest, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) { return; }
+  ssize_t written = write(fd, buf, MIN((size_t)n, sizeof(buf) - 1));
+  (void)written;
+  if (!to_stderr) { close(fd); }
+}
+
+static void write_all_stats (void) {
+  pthread_mutex_lock(&contexts_lock);
+  for (const lama_vm *vm = contexts; vm != NULL; vm = vm->next) { write_stats(vm); }
+  pthread_mutex_unlock(&contexts_lock);
+}
+
+// makes every mutator enter gc_safepoint, the first one writes the statistics
+static void stats_signal_handler (int sig) {
+  (void)sig;
+  if (__atomic_exchange_n(&stats_requested, 1, __ATOMIC_SEQ_CST) == 0) {
+    __atomic_add_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// makes every mutator enter gc_safepoint, the first one dumps its heap
+static void heap_dump_signal_handler (int sig) {
+  (void)sig;
+  if (__atomic_exchange_n(&heap_dump_requested, 1, __ATOMIC_SEQ_CST) == 0) {
+    __atomic_add_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void signals_init (void) {
+  // handlers replace the default action or one of an embedding host, only requested ones are installed
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  stats_destination = getenv("LAMA_GC_STATS");
+  if (stats_destination != NULL) {
+    atexit(write_all_stats);
+    sa.sa_handler = stats_signal_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+
+  heap_dump_path = getenv("LAMA_HEAP_DUMP");
+  if (heap_dump_path != NULL) {
+    sa.sa_handler = heap_dump_signal_handler;
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+}
+
+// state of the VM bound to the current thread
+#define heap (__vm->heap)
+#define los (__vm->los)
+#define backend (__vm->backend)
+#define marks (__vm->marks)
+#define gray (__vm->gray)
+#define stack_segments (__vm->stack_segments)
+#define stack_segments_count (__vm->stack_segments_count)
+#define world (__vm->world)
+
+// Roots and allocation buffer of a mutator parked at a safepoint
+typedef struct gc_mutator {
+  size_t             stack_top, stack_bottom;
+  extra_roots_pool  *extra_roots;
+  alloc_region      *tlab;
+  struct gc_mutator *next;
+} gc_mutator;
+
+struct gc_world {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  // mutators that are not parked
+  size_t          running;
+  bool            stop;
+  gc_mutator     *parked;
+  // allocation region shared by all mutators
+  alloc_region    region;
+};
+
+volatile int __gc_stop_requested = 0;
+
 #ifdef DEBUG_VERSION
-memory_chunk heap;
+// headers take two words here, a one-word tail can't hold a filler, so
+// allocation of parallel mutators stays serialised on the world lock
+static const size_t TLAB_WORDS = 0;
 #else
-static memory_chunk heap;
+static const size_t TLAB_WORDS = 4 * 1024;
 #endif
 
+static inline gc_mutator *parked_mutators (void) { return world != NULL ? world->parked : NULL; }
+
+static inline bool on_stack (const gc_mutator *m, void **p) {
+  return p >= (void **)m->stack_top && p < (void **)m->stack_bottom;
+}
+
+lama_vm *vm_bind (lama_vm *vm) {
+  lama_vm *prev = __vm;
+  if (prev != NULL) {
+    prev->stack_top    = __gc_stack_top;
+    prev->stack_bottom = __gc_stack_bottom;
+    prev->alloc_region = __gc_alloc_region;
+  }
+  __vm = vm;
+  if (vm != NULL) {
+    __gc_stack_top    = vm->stack_top;
+    __gc_stack_bottom = vm->stack_bottom;
+    __gc_alloc_region = vm->alloc_region;
+  } else {
+    __gc_stack_top    = 0;
+    __gc_stack_bottom = 0;
+    memset(&__gc_alloc_region, 0, sizeof(__gc_alloc_region));
+  }
+  return prev;
+}
+
+static inline bool is_heap_chunk_pointer (const size_t *p) {
+  return (size_t)heap.begin <= (size_t)p && (size_t)p < (size_t)heap.end;
+}
+
+static void mark_table_init (void) {
+  marks.blocks  = (__gc_alloc_region.current - heap.begin) / MARK_TABLE_BLOCK_WORDS + 1;
+  marks.bits    = calloc(marks.blocks, sizeof(size_t));
+  marks.offsets = malloc(marks.blocks * sizeof(size_t));
+  if (marks.bits == NULL || marks.offsets == NULL) {
+    perror("ERROR: mark_table_init: allocation failed\n");
+    exit(1);
+  }
+}
+
+static void mark_table_free (void) {
+  free(marks.bits);
+  free(marks.offsets);
+  memset(&marks, 0, sizeof(marks));
+}
+
+// word is an offset from the heap beginning
+static inline bool mark_table_is_live (size_t word) {
+  return (marks.bits[word / MARK_TABLE_BLOCK_WORDS] >> (word % MARK_TABLE_BLOCK_WORDS)) & 1;
+}
+
+// marks words [word, word + count) as live
+static inline void mark_table_set_live (size_t word, size_t count) {
+  while (count > 0) {
+    size_t bit  = word % MARK_TABLE_BLOCK_WORDS;
+    size_t n    = MIN(count, MARK_TABLE_BLOCK_WORDS - bit);
+    size_t mask = (n == MARK_TABLE_BLOCK_WORDS) ? ~(size_t)0 : (((size_t)1 << n) - 1) << bit;
+    marks.bits[word / MARK_TABLE_BLOCK_WORDS] |= mask;
+    word += n;
+    count -= n;
+  }
+}
+
+// precondition: offsets are computed (see compute_locations)
+static inline size_t mark_table_forward_offset (size_t word) {
+  size_t bit = word % MARK_TABLE_BLOCK_WORDS;
+  size_t below = bit == 0 ? 0 : marks.bits[word / MARK_TABLE_BLOCK_WORDS] << (MARK_TABLE_BLOCK_WORDS - bit);
+  return marks.offsets[word / MARK_TABLE_BLOCK_WORDS] + __builtin_popcountl(below);
+}
+
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
@@ -55,29 +298,7 @@ void handler (int sig) {
   exit(1);
 }
 
-void *alloc (size_t size) {
-#ifdef DEBUG_VERSION
-  ++cur_id;
-#endif
-  size_t obj_size = size;
-  size            = BYTES_TO_WORDS(size);
-  size_t padding  = size * sizeof(size_t) - obj_size;
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  // fprintf(stderr, "allocation of size %zu words (%zu bytes): ", size, bytes_sz);
-#endif
-  void *p = gc_alloc_on_existing_heap(size);
-  if (!p) {
-//    fprintf(stderr, "Garbage collection is not implemented yet.\n");
-//    exit(149);
-    // not enough place in the heap, need to perform GC cycle
-     p = gc_alloc(size);
-  }
-#ifdef DEBUG_PRINT
-  printf("Object allocated: content [%p, %p) padding [%p, %p)\n", p, p + obj_size, p + obj_size, p + size * sizeof(size_t));
-  fflush(stdout);
-#endif
-  return p;
-}
+void *alloc (size_t size) { return alloc_words(BYTES_TO_WORDS(size)); }
 
 #ifdef FULL_INVARIANT_CHECKS
 
@@ -111,14 +332,19 @@ static FILE *print_stack_content (char *filename) {
   return f;
 }
 
+// internal mark-bits for this dfs, one per heap word, allocated by the caller
+static size_t *dfs_visited;
+
 // precondition: obj_content is a valid address pointing to the content of an object
 static void objects_dfs (FILE *f, void *obj_content) {
   void *obj_header = get_obj_header_ptr(obj_content);
-  data *obj_data   = TO_DATA(obj_content);
-  // internal mark-bit for this dfs, should be recovered by the caller
-  if ((obj_data->forward_address & 2) != 0) { return; }
-  // set this bit as 1
-  obj_data->forward_address |= 2;
+  size_t word      = (size_t *)obj_header - heap.begin;
+  // objects outside of the heap chunk are not tracked
+  if (word < heap.size) {
+    size_t bit = (size_t)1 << (word % MARK_TABLE_BLOCK_WORDS);
+    if (dfs_visited[word / MARK_TABLE_BLOCK_WORDS] & bit) { return; }
+    dfs_visited[word / MARK_TABLE_BLOCK_WORDS] |= bit;
+  }
   fprintf(f, "object at addr %p: ", obj_content);
   print_object_info(f, obj_content);
   /*fprintf(f, "object id: %zu | ", obj_data->id);*/
@@ -146,22 +372,15 @@ static void objects_dfs (FILE *f, void *obj_content) {
 FILE *print_objects_traversal (char *filename, bool marked) {
   FILE *f = fopen(filename, "w+");
   ftruncate(fileno(f), 0);
+  dfs_visited = calloc(heap.size / MARK_TABLE_BLOCK_WORDS + 1, sizeof(size_t));
   for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
        heap_next_obj_iterator(&it)) {
     void *obj_header = it.current;
-    data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    if ((obj_data->forward_address & 1) == marked) {
+    if (is_marked(get_object_content_ptr(obj_header)) == marked) {
       objects_dfs(f, get_object_content_ptr(obj_header));
     }
   }
-
-  // resetting bit that represent mark-bit for this internal dfs-traversal
-  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
-       heap_next_obj_iterator(&it)) {
-    void *obj_header = it.current;
-    data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    obj_data->forward_address &= (~2);
-  }
+  free(dfs_visited);
   fflush(f);
 
   // print extra roots
@@ -186,17 +405,52 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
+// memory past the bump pointer is never used before, so it is already zeroed
 void *gc_alloc_on_existing_heap (size_t size) {
-  if (heap.current + size <= heap.end) {
-    void *p = (void *)heap.current;
-    heap.current += size;
-    memset(p, 0, size * sizeof(size_t));
+  if ((size_t)(__gc_alloc_region.limit - __gc_alloc_region.current) >= size) {
+    void *p = (void *)__gc_alloc_region.current;
+    __gc_alloc_region.current += size;
     return p;
   }
   return NULL;
 }
 
-void *gc_alloc (size_t size) {
+static large_object *find_large_object (const void *p);
+static void stop_mutators (void);
+static void resume_mutators (void);
+static void park (gc_world *w);
+
+// bytes taken by objects, live or not, the mutators have to be stopped
+static size_t used_bytes (void) {
+  size_t used = backend == GC_IMMIX ? immix_used_bytes()
+                                    : WORDS_TO_BYTES((size_t *)__gc_alloc_region.current - heap.begin);
+  return used + los.live + los.allocated;
+}
+
+// accounts a collection started at 'start' when 'used' bytes were taken
+static void count_collection (uint64_t start, size_t used) {
+  gc_stats *s     = &__vm->stats;
+  uint64_t  pause = gc_clock_ns() - start;
+  size_t    live  = used_bytes();
+  size_t    i     = 0;
+  while (i + 1 < GC_PAUSE_BUCKETS && pause > (uint64_t)1000 << i) { ++i; }
+  s->collections++;
+  s->pause_ns += pause;
+  s->max_pause_ns = MAX(s->max_pause_ns, pause);
+  s->pauses[i]++;
+  s->reclaimed_bytes += used > live ? used - live : 0;
+  s->live_bytes      = live;
+  s->peak_heap_bytes = MAX(s->peak_heap_bytes, mapped_bytes(__vm));
+}
+
+static void *alloc_slow (size_t size) {
+  if (backend == GC_IMMIX) {
+    return size > IMMIX_MAX_OBJECT_WORDS ? los_alloc(size) : immix_alloc_slow(size);
+  }
+  if (size >= LARGE_OBJECT_MIN_WORDS) { return los_alloc(size); }
+  void *p = gc_alloc_on_existing_heap(size);
+  if (p != NULL) { return p; }
+
 #ifdef DEBUG_PRINT
   printf("Reallocation!\n");
 #endif
@@ -209,12 +463,18 @@ void *gc_alloc (size_t size) {
   FILE *heap_before  = print_objects_traversal("before-mark", 0);
   fclose(heap_before);
 #endif
+  uint64_t start = gc_clock_ns();
+  stop_mutators();
+  size_t used = used_bytes();
   mark_phase();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
   compact_phase(size);
+  los_sweep();
+  count_collection(start, used);
+  resume_mutators();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -240,13 +500,96 @@ void *gc_alloc (size_t size) {
   return gc_alloc_on_existing_heap(size);
 }
 
+// Returns the unused rest of a thread-local allocation buffer to the shared region if it ends
+// where the region starts, fills it with a dead array otherwise; the world lock is held
+static void retire_tlab (alloc_region *shared, alloc_region *tlab) {
+  if (tlab->limit == shared->current) {
+    shared->current = tlab->current;
+  } else if (tlab->current < tlab->limit) {
+    // memory of the tail is zeroed, only the header has to be written
+    size_t len              = tlab->limit - tlab->current - BYTES_TO_WORDS(DATA_HEADER_SZ);
+    *(auint *)tlab->current = ARRAY_TAG | (len << 3);
+  }
+  memset(tlab, 0, sizeof(*tlab));
+}
+
+// Takes the object from the shared region and carves a new buffer right after it
+void *gc_alloc (size_t size) {
+  gc_world *w = world;
+  if (w == NULL) { return alloc_slow(size); }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->stop) { park(w); }
+  retire_tlab(&w->region, &__gc_alloc_region);
+  __gc_alloc_region = w->region;
+  void *p;
+  if (size <= INLINE_ALLOC_MAX_WORDS && (size_t)(__gc_alloc_region.limit - __gc_alloc_region.current) >= size) {
+    p = __gc_alloc_region.current;
+    __gc_alloc_region.current += size;
+  } else {
+    p = alloc_slow(size);
+  }
+  size_t words      = MIN(TLAB_WORDS, (size_t)(__gc_alloc_region.limit - __gc_alloc_region.current));
+  w->region.current = __gc_alloc_region.current + words;
+  w->region.limit   = __gc_alloc_region.limit;
+  __gc_alloc_region.limit = w->region.current;
+  pthread_mutex_unlock(&w->lock);
+  return p;
+}
+
+void gc_collect (size_t additional_size) {
+  uint64_t start = gc_clock_ns();
+  stop_mutators();
+  size_t used = used_bytes();
+  if (backend == GC_IMMIX) {
+    immix_collect();
+  } else {
+    mark_phase();
+    compact_phase(additional_size);
+  }
+  los_sweep();
+  count_collection(start, used);
+  resume_mutators();
+}
+
+void gc_visit_roots (void (*visit) (void **root)) {
+  for (size_t *p = (size_t *)__gc_stack_top; p < (size_t *)__gc_stack_bottom; ++p) {
+    visit((void **)p);
+  }
+  for (size_t i = 0; i < stack_segments_count; ++i) {
+    for (size_t *p = stack_segments[i].begin; p < stack_segments[i].end; ++p) { visit((void **)p); }
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) { visit(extra_roots.roots[i]); }
+  for (gc_mutator *m = parked_mutators(); m != NULL; m = m->next) {
+    for (size_t *p = (size_t *)m->stack_top; p < (size_t *)m->stack_bottom; ++p) { visit((void **)p); }
+    for (int i = 0; i < m->extra_roots->current_free; ++i) { visit(m->extra_roots->roots[i]); }
+  }
+#ifdef LAMA_ENV
+  for (size_t *ptr = (size_t *)&__start_custom_data; ptr < (size_t *)&__stop_custom_data; ++ptr) {
+    visit((void **)ptr);
+  }
+#endif
+}
+
 static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + sizeof(size_t)); p < (size_t *)__gc_stack_bottom; ++p) {
+  for (size_t *p = (size_t *)__gc_stack_top; p < (size_t *)__gc_stack_bottom; ++p) {
     gc_test_and_mark_root((size_t **)p);
   }
+  for (size_t i = 0; i < stack_segments_count; ++i) {
+    for (size_t *p = stack_segments[i].begin; p < stack_segments[i].end; ++p) {
+      gc_test_and_mark_root((size_t **)p);
+    }
+  }
+  for (gc_mutator *m = parked_mutators(); m != NULL; m = m->next) {
+    for (size_t *p = (size_t *)m->stack_top; p < (size_t *)m->stack_bottom; ++p) {
+      gc_test_and_mark_root((size_t **)p);
+    }
+  }
 }
 
 void mark_phase (void) {
+  uint64_t start = gc_clock_ns();
+  mark_table_init();
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
   fprintf(stderr,
@@ -271,60 +614,106 @@ void mark_phase (void) {
   fprintf(stderr, "scan_global_area has finished\n");
   fprintf(stderr, "marking has finished\n");
 #endif
+  __vm->stats.mark_ns += gc_clock_ns() - start;
 }
 
-void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
+// heap chunk being compacted while the survivors hook runs
+static __thread memory_chunk *forwarding_heap;
+
+// words of the large objects marked by the current cycle, before los_sweep frees the rest
+static size_t los_marked_words (void) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < los.count; ++i) {
+    if (los.objects[i].marked) { bytes += los.objects[i].size; }
+  }
+  return bytes / sizeof(size_t);
+}
 
-  // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
+void compact_phase (size_t additional_size) {
+  uint64_t start     = gc_clock_ns();
+  size_t   live_size = compute_locations();
+  uint64_t computed  = gc_clock_ns();
+  __vm->stats.compute_locations_ns += computed - start;
+
+  // all in words; every cycle marks and scans live large objects too, so they
+  // count towards the room left until the next one
+  size_t next_heap_size = MAX((live_size + los_marked_words()) * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size,
+                              MINIMUM_HEAP_CAPACITY);
   size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
 
   memory_chunk old_heap = heap;
+  old_heap.current      = __gc_alloc_region.current;
   heap.begin            = mmap(NULL, WORDS_TO_BYTES(next_heap_pseudo_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  memcpy(heap.begin, old_heap.begin, WORDS_TO_BYTES(old_heap.size));
   if (heap.begin == MAP_FAILED) {
     perror("ERROR: compact_phase: mmap failed\n");
     exit(1);
   }
-  heap.end     = heap.begin + next_heap_pseudo_size;
-  heap.size    = next_heap_pseudo_size;
-  heap.current = heap.begin + (old_heap.current - old_heap.begin);
+  heap.end                  = heap.begin + next_heap_pseudo_size;
+  heap.size                 = next_heap_pseudo_size;
+  __gc_alloc_region.current = heap.begin + live_size;
+  __gc_alloc_region.limit   = heap.end;
 
-  update_references(&old_heap);
   physically_relocate(&old_heap);
+  uint64_t relocated = gc_clock_ns();
+  __vm->stats.relocate_ns += relocated - computed;
+  update_references(&old_heap);
+  __vm->stats.update_references_ns += gc_clock_ns() - relocated;
+  forwarding_heap = &old_heap;
+  gc_report_survivors();
+  forwarding_heap = NULL;
 
-  heap.current = heap.begin + live_size;
-  if (munmap(old_heap.begin, old_heap.size) < 0) {
+  if (munmap(old_heap.begin, WORDS_TO_BYTES(old_heap.size)) < 0) {
       perror("ERROR: compact_phase: munmap failed\n");
       exit(1);
   }
+  mark_table_free();
 }
 
 size_t compute_locations () {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations started\n");
 #endif
-  size_t       *free_ptr  = heap.begin;
-  heap_iterator scan_iter = heap_begin_iterator();
-
-  for (; !heap_is_done_iterator(&scan_iter); heap_next_obj_iterator(&scan_iter)) {
-    void *header_ptr  = scan_iter.current;
-    void *obj_content = get_object_content_ptr(header_ptr);
-    if (is_marked(obj_content)) {
-      size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
-      // forward address is responsible for object header pointer
-      set_forward_address(obj_content, (size_t)free_ptr);
-      free_ptr += sz;
-    }
+  size_t live_words = 0;
+  for (size_t i = 0; i < marks.blocks; ++i) {
+    marks.offsets[i] = live_words;
+    live_words += __builtin_popcountl(marks.bits[i]);
   }
-
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations finished\n");
 #endif
   // it will return number of words
-  return free_ptr - heap.begin;
+  return live_words;
+}
+
+// takes pointer to a content of an object in the old heap chunk, returns pointer to its content after compaction
+static inline void *forward_pointer (memory_chunk *old_heap, void *ptr) {
+  size_t *header_ptr = (size_t *)(ptr - DATA_HEADER_SZ);
+  return (void *)(heap.begin + mark_table_forward_offset(header_ptr - old_heap->begin)) + DATA_HEADER_SZ;
+}
+
+static inline bool is_old_heap_pointer (memory_chunk *old_heap, size_t ptr_value) {
+  // this can't be expressed via is_valid_heap_pointer, because this pointer points area corresponding to the old heap
+  return is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
+         && ptr_value <= (size_t)old_heap->current;
+}
+
+void gc_set_survivors_hook (void (*hook) (void *data), void *data) {
+  __vm->survivors_hook = hook;
+  __vm->survivors_data = data;
+}
+
+void gc_report_survivors (void) {
+  if (__vm->survivors_hook != NULL) { __vm->survivors_hook(__vm->survivors_data); }
+}
+
+void *gc_forward (void *obj) {
+  if (backend == GC_IMMIX && is_immix_pointer(obj)) { return immix_forward(obj); }
+  if (forwarding_heap != NULL && is_old_heap_pointer(forwarding_heap, (size_t)obj)) {
+    size_t *header_ptr = (size_t *)get_obj_header_ptr(obj);
+    return mark_table_is_live(header_ptr - forwarding_heap->begin) ? forward_pointer(forwarding_heap, obj) : NULL;
+  }
+  large_object *lo = find_large_object(obj);
+  return lo != NULL && lo->marked ? obj : NULL;
 }
 
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
@@ -332,17 +721,7 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
   fprintf(stderr, "GC scan_and_fix_region started\n");
 #endif
   for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
-    size_t ptr_value = *ptr;
-    // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
-    // heap
-    if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
-        && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
-    }
+    if (is_old_heap_pointer(old_heap, *ptr)) { *(void **)ptr = forward_pointer(old_heap, *(void **)ptr); }
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region finished\n");
@@ -400,12 +779,8 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
       continue;
     }
-    if ((size_t)old_heap->begin <= ptr_value && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+    if (is_old_heap_pointer(old_heap, ptr_value)) {
+      *(void **)ptr = forward_pointer(old_heap, (void *)ptr_value);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr,
               "|\textra root (%p) %p -> %p\n",
@@ -420,47 +795,55 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
-void update_references (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC update_references started\n");
-#endif
-  heap_iterator it = heap_begin_iterator();
-  while (!heap_is_done_iterator(&it)) {
-    if (is_marked(get_object_content_ptr(it.current))) {
-      for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
-           !field_is_done_iterator(&field_iter);
-           obj_next_ptr_field_iterator(&field_iter)) {
-
-        size_t *field_value = *(size_t **)field_iter.cur_field;
-        if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+static void update_object_references (memory_chunk *old_heap, void *header_ptr) {
+  for (obj_field_iterator field_iter = ptr_field_begin_iterator(header_ptr);
+       !field_is_done_iterator(&field_iter);
+       obj_next_ptr_field_iterator(&field_iter)) {
+    size_t field_value = *(size_t *)field_iter.cur_field;
+    if (!is_old_heap_pointer(old_heap, field_value)) { continue; }
+    void *new_addr = forward_pointer(old_heap, (void *)field_value);
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+    if (!is_valid_heap_pointer(new_addr)) {
 #  ifdef DEBUG_PRINT
-          fprintf(stderr,
-                  "ur: incorrect pointer assignment: on object with id %d",
-                  TO_DATA(get_object_content_ptr(it.current))->id);
+      fprintf(stderr,
+              "ur: incorrect pointer assignment: on object with id %d",
+              TO_DATA(get_object_content_ptr(header_ptr))->id);
 #  endif
-          exit(1);
-        }
+      exit(1);
+    }
 #endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
+    *(void **)field_iter.cur_field = new_addr;
+  }
+}
+
+// precondition: live objects are already relocated to the new heap chunk
+void update_references (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC update_references started\n");
+#endif
+  // all objects in the new heap chunk are live
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it); heap_next_obj_iterator(&it)) {
+    update_object_references(old_heap, it.current);
+  }
+  // fix pointers from large objects, they are not moved themselves
+  for (size_t i = 0; i < los.count; ++i) {
+    if (los.objects[i].marked) { update_object_references(old_heap, los.objects[i].begin); }
+  }
+  // fix pointers from stack
+  scan_and_fix_region(old_heap, (void *)__gc_stack_top, (void *)__gc_stack_bottom);
+  for (size_t i = 0; i < stack_segments_count; ++i) {
+    scan_and_fix_region(old_heap, stack_segments[i].begin, stack_segments[i].end);
+  }
+  for (gc_mutator *m = parked_mutators(); m != NULL; m = m->next) {
+    scan_and_fix_region(old_heap, (void *)m->stack_top, (void *)m->stack_bottom);
+    for (int i = 0; i < m->extra_roots->current_free; ++i) {
+      void **root = m->extra_roots->roots[i];
+      // roots on the stack of the mutator are fixed already
+      if (!on_stack(m, root) && is_old_heap_pointer(old_heap, (size_t)*root)) {
+        *root = forward_pointer(old_heap, *root);
       }
     }
-    heap_next_obj_iterator(&it);
   }
-  // fix pointers from stack
-  scan_and_fix_region(old_heap, (void *)__gc_stack_top + sizeof(size_t), (void *)__gc_stack_bottom + sizeof(size_t));
 
   // fix pointers from extra_roots
   scan_and_fix_region_roots(old_heap);
@@ -474,24 +857,17 @@ void update_references (memory_chunk *old_heap) {
 #endif
 }
 
+// copies live objects of the old heap chunk to their places in the new one
 void physically_relocate (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate started\n");
 #endif
-  heap_iterator from_iter = heap_begin_iterator();
-
-  while (!heap_is_done_iterator(&from_iter)) {
-    void         *obj       = get_object_content_ptr(from_iter.current);
-    heap_iterator next_iter = from_iter;
-    heap_next_obj_iterator(&next_iter);
-    if (is_marked(obj)) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
-      memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
-      unmark_object(get_object_content_ptr(to));
+  for (size_t *header_ptr = old_heap->begin; header_ptr < old_heap->current;) {
+    size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+    if (mark_table_is_live(header_ptr - old_heap->begin)) {
+      memcpy(heap.begin + mark_table_forward_offset(header_ptr - old_heap->begin), header_ptr, WORDS_TO_BYTES(sz));
     }
-    from_iter = next_iter;
+    header_ptr += sz;
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate finished\n");
@@ -499,56 +875,41 @@ void physically_relocate (memory_chunk *old_heap) {
 }
 
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return !UNBOXED(p)
+         && (is_heap_chunk_pointer(p) || is_large_object_pointer(p)
+             || (backend == GC_IMMIX && is_immix_pointer(p)));
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
-static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
-  void *tail         = tail_iter->current;
-  void *tail_content = get_object_content_ptr(tail);
-  set_forward_address(tail_content, (size_t)obj);
-  make_enqueued(obj);
-  heap_next_obj_iterator(tail_iter);
-}
-
-static inline void *queue_dequeue (heap_iterator *head_iter) {
-  void *head         = head_iter->current;
-  void *head_content = get_object_content_ptr(head);
-  void *value        = (void *)get_forward_address(head_content);
-  make_dequeued(value);
-  heap_next_obj_iterator(head_iter);
-  return value;
+static void mark_stack_push (void *obj) {
+  if (gray.size == gray.capacity) {
+    gray.capacity = MAX(2 * gray.capacity, 256);
+    gray.objects  = realloc(gray.objects, gray.capacity * sizeof(void *));
+    if (gray.objects == NULL) {
+      perror("ERROR: mark_stack_push: realloc failed\n");
+      exit(1);
+    }
+  }
+  gray.objects[gray.size++] = obj;
 }
 
 void mark (void *obj) {
   if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
 
-  // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
-  // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
-  // iterator where we will write address of the element that is going to be enqueued
-  heap_iterator q_tail_iter = q_head_iter;
-  queue_enqueue(&q_tail_iter, obj);
-
-  // invariant: queue contains only objects that are valid heap pointers (each corresponding to content of unmarked
-  // object) also each object is in queue only once
-  while (q_head_iter.current != q_tail_iter.current) {
-    // while the queue is non-empty
-    void *cur_obj = queue_dequeue(&q_head_iter);
-    mark_object(cur_obj);
-    void *header_ptr = get_obj_header_ptr(cur_obj);
+  // invariant: stack contains only marked objects whose fields are not scanned yet,
+  // so each object gets there only once
+  mark_object(obj);
+  mark_stack_push(obj);
+  while (gray.size > 0) {
+    void *header_ptr = get_obj_header_ptr(gray.objects[--gray.size]);
     for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
-        continue;
-      }
-      // if we came to this point it must be true that field_value is unmarked and not currently in queue
-      // thus, we maintain the invariant
-      queue_enqueue(&q_tail_iter, field_value);
+      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)) { continue; }
+      mark_object(field_value);
+      mark_stack_push(field_value);
     }
   }
 }
@@ -558,6 +919,9 @@ void scan_extra_roots (void) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
     mark(*extra_roots.roots[i]);
   }
+  for (gc_mutator *m = parked_mutators(); m != NULL; m = m->next) {
+    for (int i = 0; i < m->extra_roots->current_free; ++i) { mark(*m->extra_roots->roots[i]); }
+  }
 }
 
 #ifdef LAMA_ENV
@@ -587,36 +951,306 @@ void __gc_init (void) {
 }
 
 void __init (void) {
+  if (__vm == NULL) {
+    lama_vm *vm = calloc(1, sizeof(lama_vm));
+    if (vm == NULL) {
+      perror("ERROR: __init: calloc failed\n");
+      exit(1);
+    }
+    // stack bounds may be set before the initialization
+    size_t top = __gc_stack_top, bottom = __gc_stack_bottom;
+    vm_bind(vm);
+    __gc_stack_top    = top;
+    __gc_stack_bottom = bottom;
+    backend           = DEFAULT_BACKEND;
+    vm->stats.start_ns = gc_clock_ns();
+    pthread_once(&signals_once, signals_init);
+    pthread_mutex_lock(&contexts_lock);
+    vm->next = contexts;
+    contexts = vm;
+    pthread_mutex_unlock(&contexts_lock);
+  }
   signal(SIGSEGV, handler);
   size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
 
   srandom(time(NULL));
 
+  const char *backend_name = getenv("LAMA_GC");
+  if (backend_name != NULL) {
+    if (strcmp(backend_name, "lisp2") == 0) {
+      backend = GC_LISP2;
+    } else if (strcmp(backend_name, "immix") == 0) {
+      backend = GC_IMMIX;
+    } else {
+      fprintf(stderr, "ERROR: __init: unknown LAMA_GC value '%s', expected lisp2 or immix\n", backend_name);
+      exit(1);
+    }
+  }
+  if (backend == GC_IMMIX) {
+    immix_init();
+    clear_extra_roots();
+    return;
+  }
+
   heap.begin = mmap(
       NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (heap.begin == MAP_FAILED) {
     perror("ERROR: __init: mmap failed\n");
     exit(1);
   }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
+  heap.end                  = heap.begin + INIT_HEAP_SIZE;
+  heap.size                 = INIT_HEAP_SIZE;
+  __gc_alloc_region.current = heap.begin;
+  __gc_alloc_region.limit   = heap.end;
   clear_extra_roots();
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
+  if (__vm == NULL) { return; }
+  pthread_mutex_lock(&contexts_lock);
+  for (lama_vm **p = &contexts; *p != NULL; p = &(*p)->next) {
+    if (*p == __vm) {
+      *p = __vm->next;
+      break;
+    }
+  }
+  if (stats_destination != NULL) { write_stats(__vm); }
+  pthread_mutex_unlock(&contexts_lock);
+  if (heap.begin != NULL) { munmap(heap.begin, WORDS_TO_BYTES(heap.size)); }
+  immix_shutdown();
+  for (size_t i = 0; i < los.count; ++i) { munmap(los.objects[i].begin, los.objects[i].size); }
+  free(los.objects);
+  memset(&los, 0, sizeof(los));
+  free(gray.objects);
+  memset(&gray, 0, sizeof(gray));
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
   heap.begin        = NULL;
   heap.end          = NULL;
   heap.size         = 0;
-  heap.current      = NULL;
+  __gc_alloc_region.current = NULL;
+  __gc_alloc_region.limit   = NULL;
+  __gc_stack_top    = 0;
+  __gc_stack_bottom = 0;
+  // interned tags can't outlive objects of the VM
+  free(__vm->tags.hashes);
+  free(__vm->tags.index);
+  free(vm_bind(NULL));
+}
+
+/* Large object space */
+
+static size_t page_size (void) {
+  static size_t size = 0;
+  if (size == 0) { size = sysconf(_SC_PAGESIZE); }
+  return size;
+}
+
+// returns index of the first large object with header address greater than p
+static size_t los_upper_bound (const void *p) {
+  size_t lo = 0, hi = los.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((const void *)los.objects[mid].begin <= p) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// looks for the large object containing p
+static large_object *find_large_object (const void *p) {
+  size_t i = los_upper_bound(p);
+  if (i == 0) { return NULL; }
+  large_object *obj = &los.objects[i - 1];
+  return p < (void *)obj->begin + obj->size ? obj : NULL;
+}
+
+bool is_large_object_pointer (const size_t *p) { return find_large_object(p) != NULL; }
+
+void *los_alloc (size_t size) {
+  // large objects are not accounted in the heap, so they trigger GC cycles on their own
+  size_t heap_size = backend == GC_IMMIX ? immix_heap_size() : heap.size;
+  if (los.allocated >= MAX(WORDS_TO_BYTES(heap_size), los.live)) { gc_collect(0); }
+
+  size_t bytes = (WORDS_TO_BYTES(size) + page_size() - 1) & ~(page_size() - 1);
+  size_t *p    = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("ERROR: los_alloc: mmap failed\n");
+    exit(1);
+  }
+
+  if (los.count == los.capacity) {
+    los.capacity = MAX(2 * los.capacity, 16);
+    los.objects  = realloc(los.objects, los.capacity * sizeof(large_object));
+    if (los.objects == NULL) {
+      perror("ERROR: los_alloc: realloc failed\n");
+      exit(1);
+    }
+  }
+  size_t i = los_upper_bound(p);
+  memmove(&los.objects[i + 1], &los.objects[i], (los.count - i) * sizeof(large_object));
+  los.objects[i].begin  = p;
+  los.objects[i].size   = bytes;
+  los.objects[i].marked = false;
+  los.count++;
+  los.allocated += bytes;
+  return p;
+}
+
+void los_sweep (void) {
+  uint64_t start = gc_clock_ns();
+  size_t   live = 0, j = 0;
+  for (size_t i = 0; i < los.count; ++i) {
+    if (los.objects[i].marked) {
+      los.objects[i].marked = false;
+      live += los.objects[i].size;
+      los.objects[j++] = los.objects[i];
+    } else if (munmap(los.objects[i].begin, los.objects[i].size) < 0) {
+      perror("ERROR: los_sweep: munmap failed\n");
+      exit(1);
+    }
+  }
+  los.count     = j;
+  los.live      = live;
+  los.allocated = 0;
+  __vm->stats.sweep_ns += gc_clock_ns() - start;
+}
+
+void gc_set_stack_segments (stack_segment *segments, size_t count) {
+  stack_segments       = segments;
+  stack_segments_count = count;
+}
+
+// adds the calling thread to the parked mutators, the world lock is held
+static void publish (gc_world *w, gc_mutator *self) {
+  self->stack_top    = __gc_stack_top;
+  self->stack_bottom = __gc_stack_bottom;
+  self->extra_roots  = &extra_roots;
+  self->tlab         = &__gc_alloc_region;
+  self->next         = w->parked;
+  w->parked          = self;
+  w->running--;
+  pthread_cond_broadcast(&w->changed);
+}
+
+// waits until the collection is over and removes the calling thread from the parked mutators
+static void unpublish (gc_world *w, gc_mutator *self) {
+  while (w->stop) { pthread_cond_wait(&w->changed, &w->lock); }
+  gc_mutator **p = &w->parked;
+  while (*p != self) { p = &(*p)->next; }
+  *p = self->next;
+  w->running++;
+}
+
+static void park (gc_world *w) {
+  gc_mutator self;
+  publish(w, &self);
+  unpublish(w, &self);
+}
+
+// called with the world lock held by the thread that is going to collect
+static void stop_mutators (void) {
+  gc_world *w = world;
+  if (w == NULL) { return; }
+  w->stop = true;
+  __atomic_add_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+  while (w->running > 1) { pthread_cond_wait(&w->changed, &w->lock); }
+  // the collector works on the shared region, it is the current one of this thread now
+  for (gc_mutator *m = w->parked; m != NULL; m = m->next) { retire_tlab(&__gc_alloc_region, m->tlab); }
+}
+
+static void resume_mutators (void) {
+  gc_world *w = world;
+  if (w == NULL) { return; }
+  w->stop = false;
+  __atomic_sub_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&w->changed);
+}
+
+void gc_world_start (void) {
+  gc_world *w = calloc(1, sizeof(gc_world));
+  if (w == NULL) {
+    perror("ERROR: gc_world_start: calloc failed\n");
+    exit(1);
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->changed, NULL);
+  w->running = 1;
+  w->region  = __gc_alloc_region;
+  memset(&__gc_alloc_region, 0, sizeof(__gc_alloc_region));
+  world = w;
+}
+
+void gc_world_finish (void) {
+  gc_world *w = world;
+  retire_tlab(&w->region, &__gc_alloc_region);
+  __gc_alloc_region = w->region;
+  world             = NULL;
+  pthread_cond_destroy(&w->changed);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+}
+
+void gc_world_join (lama_vm *vm) {
+  __vm = vm;
+  memset(&__gc_alloc_region, 0, sizeof(__gc_alloc_region));
+  gc_world *w = world;
+  pthread_mutex_lock(&w->lock);
+  while (w->stop) { pthread_cond_wait(&w->changed, &w->lock); }
+  w->running++;
+  pthread_mutex_unlock(&w->lock);
+}
+
+void gc_world_leave (void) {
+  gc_world *w = world;
+  pthread_mutex_lock(&w->lock);
+  retire_tlab(&w->region, &__gc_alloc_region);
+  w->running--;
+  pthread_cond_broadcast(&w->changed);
+  pthread_mutex_unlock(&w->lock);
+  __vm              = NULL;
   __gc_stack_top    = 0;
   __gc_stack_bottom = 0;
 }
 
+void gc_safepoint (void) {
+  if (stats_requested && __atomic_exchange_n(&stats_requested, 0, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+    write_all_stats();
+  }
+  if (heap_dump_requested && __atomic_exchange_n(&heap_dump_requested, 0, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&__gc_stop_requested, 1, __ATOMIC_SEQ_CST);
+    if (gc_dump_heap(heap_dump_path) != 0) { perror("ERROR: gc_safepoint: heap dump failed"); }
+  }
+  gc_world *w = world;
+  if (w == NULL) { return; }
+  pthread_mutex_lock(&w->lock);
+  if (w->stop) { park(w); }
+  pthread_mutex_unlock(&w->lock);
+}
+
+static __thread gc_mutator blocked;
+
+void gc_blocking_begin (void) {
+  gc_world *w = world;
+  if (w == NULL) { return; }
+  pthread_mutex_lock(&w->lock);
+  publish(w, &blocked);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void gc_blocking_end (void) {
+  gc_world *w = world;
+  if (w == NULL) { return; }
+  pthread_mutex_lock(&w->lock);
+  unpublish(w, &blocked);
+  pthread_mutex_unlock(&w->lock);
+}
+
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
 
 void push_extra_root (void **p) {
@@ -641,6 +1275,136 @@ void pop_extra_root (void **p) {
   }
 }
 
+/* Heap dump */
+
+extern aint get_sexp_tag (void *);
+
+// set of visited objects and the objects to visit, kept while a dump is written
+static __thread struct {
+  void **slots;
+  size_t capacity, count;
+  mark_stack pending;
+} dump;
+
+static void dump_push (void *obj) {
+  if (dump.pending.size == dump.pending.capacity) {
+    dump.pending.capacity = MAX(2 * dump.pending.capacity, 256);
+    dump.pending.objects  = realloc(dump.pending.objects, dump.pending.capacity * sizeof(void *));
+    if (dump.pending.objects == NULL) {
+      perror("ERROR: dump_push: realloc failed\n");
+      exit(1);
+    }
+  }
+  dump.pending.objects[dump.pending.size++] = obj;
+}
+
+// adds an object to the visited set, returns false if it is there already
+static bool dump_visit (void *obj) {
+  if (2 * (dump.count + 1) > dump.capacity) {
+    void **old      = dump.slots;
+    size_t capacity = dump.capacity;
+    dump.capacity   = MAX(2 * capacity, 1024);
+    dump.slots      = calloc(dump.capacity, sizeof(void *));
+    if (dump.slots == NULL) {
+      perror("ERROR: dump_visit: calloc failed\n");
+      exit(1);
+    }
+    dump.count = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+      if (old[i] != NULL) { dump_visit(old[i]); }
+    }
+    free(old);
+  }
+  size_t i = ((size_t)obj >> 3) * 0x9E3779B97F4A7C15ull & (dump.capacity - 1);
+  while (dump.slots[i] != NULL) {
+    if (dump.slots[i] == obj) { return false; }
+    i = (i + 1) & (dump.capacity - 1);
+  }
+  dump.slots[i] = obj;
+  dump.count++;
+  return true;
+}
+
+static void dump_root (void **root) {
+  if (is_valid_heap_pointer(*root) && dump_visit(*root)) { dump_push(*root); }
+}
+
+static bool write_words (FILE *f, const size_t *words, size_t count) {
+  return fwrite(words, sizeof(size_t), count, f) == count;
+}
+
+// writes the objects reachable from the roots, see gc.h for the format
+static bool write_heap_dump (FILE *f) {
+  gc_visit_roots(dump_root);
+  size_t header[4] = {0, HEAP_DUMP_VERSION, dump.pending.size, 0};
+  memcpy(header, HEAP_DUMP_MAGIC, sizeof(size_t));
+  bool ok = write_words(f, header, 4) && write_words(f, (size_t *)dump.pending.objects, dump.pending.size);
+
+  size_t objects = 0;
+  while (ok && dump.pending.size > 0) {
+    void  *obj        = dump.pending.objects[--dump.pending.size];
+    void  *header_ptr = get_obj_header_ptr(obj);
+    size_t refs       = 0;
+    for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr); !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      refs += is_valid_heap_pointer(*(size_t **)it.cur_field);
+    }
+    lama_type type   = get_type_header_ptr(header_ptr);
+    size_t    label  = type == SEXP ? (size_t)get_sexp_tag(obj) : type == CLOSURE ? *(size_t *)obj : 0;
+    size_t    record[5] = {(size_t)obj, *(size_t *)header_ptr, obj_size_header_ptr(header_ptr), label, refs};
+    ok = write_words(f, record, 5);
+    for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr); ok && !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      size_t *field = *(size_t **)it.cur_field;
+      if (!is_valid_heap_pointer(field)) { continue; }
+      ok = write_words(f, (size_t *)&field, 1);
+      if (dump_visit(field)) { dump_push(field); }
+    }
+    objects++;
+  }
+
+  header[3] = objects;
+  return ok && fseek(f, 0, SEEK_SET) == 0 && write_words(f, header, 4);
+}
+
+int gc_dump_heap (const char *path) {
+  gc_world *w = world;
+  if (w != NULL) {
+    // the dump is taken as a collection: by the only running mutator on the shared region
+    pthread_mutex_lock(&w->lock);
+    while (w->stop) { park(w); }
+    retire_tlab(&w->region, &__gc_alloc_region);
+    __gc_alloc_region = w->region;
+    stop_mutators();
+  }
+
+  size_t length = strlen(path);
+  char  *tmp    = malloc(length + 5);
+  if (tmp == NULL) {
+    perror("ERROR: gc_dump_heap: malloc failed\n");
+    exit(1);
+  }
+  memcpy(tmp, path, length);
+  memcpy(tmp + length, ".tmp", 5);
+  FILE *f  = fopen(tmp, "wb");
+  bool  ok = f != NULL && write_heap_dump(f);
+  if (f != NULL) { ok = fclose(f) == 0 && ok; }
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) { unlink(tmp); }
+  free(tmp);
+  free(dump.slots);
+  free(dump.pending.objects);
+  memset(&dump, 0, sizeof(dump));
+
+  if (w != NULL) {
+    resume_mutators();
+    w->region = __gc_alloc_region;
+    memset(&__gc_alloc_region, 0, sizeof(__gc_alloc_region));
+    pthread_mutex_unlock(&w->lock);
+  }
+  return ok ? 0 : -1;
+}
+
 /* Functions for tests */
 
 #if defined(DEBUG_VERSION)
@@ -659,7 +1423,8 @@ size_t objects_snapshot (int *object_ids_buf, size_t object_ids_buf_size) {
 #endif
 
 #ifdef DEBUG_VERSION
-extern char *de_hash (int);
+extern char *de_hash (aint);
+extern aint  get_sexp_tag (void *);
 
 void dump_heap () {
   size_t i = 0;
@@ -674,7 +1439,7 @@ void dump_heap () {
       case CLOSURE: fprintf(stderr, "of kind CLOSURE\n"); break;
       case STRING: fprintf(stderr, "of kind STRING\n"); break;
       case SEXP:
-        fprintf(stderr, "of kind SEXP with tag %s\n", de_hash(TO_SEXP(content_ptr)->tag));
+        fprintf(stderr, "of kind SEXP with tag %s\n", de_hash(get_sexp_tag(content_ptr)));
         break;
     }
   }
@@ -694,45 +1459,31 @@ void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr) {
 
 /* Utility functions */
 
-size_t get_forward_address (void *obj) {
-  data *d = TO_DATA(obj);
-  return GET_FORWARD_ADDRESS(d->forward_address);
-}
-
-void set_forward_address (void *obj, size_t addr) {
-  data *d = TO_DATA(obj);
-  SET_FORWARD_ADDRESS(d->forward_address, addr);
+size_t get_forward_offset (void *obj) {
+  return mark_table_forward_offset((size_t *)get_obj_header_ptr(obj) - heap.begin);
 }
 
 bool is_marked (void *obj) {
-  data *d        = TO_DATA(obj);
-  aint   mark_bit = GET_MARK_BIT(d->forward_address);
-  return mark_bit;
+  if (is_heap_chunk_pointer(obj)) {
+    return marks.bits != NULL && mark_table_is_live((size_t *)get_obj_header_ptr(obj) - heap.begin);
+  }
+  large_object *lo = find_large_object(obj);
+  return lo != NULL && lo->marked;
 }
 
 void mark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  SET_MARK_BIT(d->forward_address);
+  if (is_heap_chunk_pointer(obj)) {
+    void *header_ptr = get_obj_header_ptr(obj);
+    mark_table_set_live((size_t *)header_ptr - heap.begin, BYTES_TO_WORDS(obj_size_header_ptr(header_ptr)));
+  } else {
+    find_large_object(obj)->marked = true;
+  }
 }
 
+// objects in the heap chunk are unmarked all at once when mark table is dropped
 void unmark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  RESET_MARK_BIT(d->forward_address);
-}
-
-bool is_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  return IS_ENQUEUED(d->forward_address) != 0;
-}
-
-void make_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_ENQUEUED(d->forward_address);
-}
-
-void make_dequeued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_DEQUEUED(d->forward_address);
+  large_object *lo = find_large_object(obj);
+  if (lo != NULL) { lo->marked = false; }
 }
 
 heap_iterator heap_begin_iterator () {
@@ -748,82 +1499,34 @@ void heap_next_obj_iterator (heap_iterator *it) {
   it->current += obj_size;
 }
 
-bool heap_is_done_iterator (heap_iterator *it) { return it->current >= heap.current; }
-
-lama_type get_type_row_ptr (void *ptr) {
-  data *data_ptr = TO_DATA(ptr);
-  return get_type_header_ptr(data_ptr);
-}
+bool heap_is_done_iterator (heap_iterator *it) { return it->current >= __gc_alloc_region.current; }
 
-lama_type get_type_header_ptr (void *ptr) {
-  auint *header = (auint *)ptr;
-  switch (TAG(*header)) {
-    case ARRAY_TAG: return ARRAY;
-    case STRING_TAG: return STRING;
-    case CLOSURE_TAG: return CLOSURE;
-    case SEXP_TAG: return SEXP;
-    default: {
+size_t invalid_object_header (const void *header_ptr) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-      fprintf(stderr, "ERROR: get_type_header_ptr: unknown object header, cur_id=%d", cur_id);
-      raise(SIGINT);   // only for debug purposes
+  fprintf(stderr, "ERROR: invalid_object_header: unknown object header, cur_id=%zu", cur_id);
+  raise(SIGINT);   // only for debug purposes
 #else
 #  ifdef FULL_INVARIANT_CHECKS
 #    ifdef DEBUG_PRINT
-      fprintf(stderr,
-              "ERROR: get_type_header_ptr: unknown object header, ptr is %p, tag %i, heap size is "
-              "%d cur_id=%d stack_top=%p stack_bot=%p ",
-              ptr,
-              TAG(*header),
-              heap.size,
-              cur_id,
-              (void *)__gc_stack_top,
-              (void *)__gc_stack_bottom);
+  fprintf(stderr,
+          "ERROR: invalid_object_header: unknown object header, ptr is %p, tag %i, heap size is "
+          "%zu cur_id=%zu stack_top=%p stack_bot=%p ",
+          header_ptr,
+          (int)TAG(*(const auint *)header_ptr),
+          heap.size,
+          cur_id,
+          (void *)__gc_stack_top,
+          (void *)__gc_stack_bottom);
 #    endif
-      FILE *heap_before_compaction = print_objects_traversal("dump_kill", 1);
-      fclose(heap_before_compaction);
+  FILE *heap_before_compaction = print_objects_traversal("dump_kill", 1);
+  fclose(heap_before_compaction);
 #  endif
-      kill(getpid(), SIGSEGV);
-#endif
-      exit(1);
-    }
-  }
-}
-
-size_t obj_size_row_ptr (void *ptr) {
-  data *data_ptr = TO_DATA(ptr);
-  return obj_size_header_ptr(data_ptr);
-}
-
-size_t obj_size_header_ptr (void *ptr) {
-  ptrt len = LEN(*(ptrt *)ptr);
-  switch (get_type_header_ptr(ptr)) {
-    case ARRAY: return array_size(len);
-    case STRING: return string_size(len);
-    case CLOSURE: return closure_size(len);
-    case SEXP: return sexp_size(len);
-    default: {
-#ifdef DEBUG_VERSION
-      fprintf(stderr, "ERROR: obj_size_header_ptr: unknown object header, cur_id=%d", cur_id);
-      raise(SIGINT);   // only for debug purposes
-#else
-      perror("ERROR: obj_size_header_ptr: unknown object header\n");
+  (void)header_ptr;
+  kill(getpid(), SIGSEGV);
 #endif
-      exit(1);
-    }
-  }
-}
-
-size_t array_size (size_t sz) { return get_header_size(ARRAY) + MEMBER_SIZE * sz; }
-
-size_t string_size (size_t len) {
-  // string should be null terminated
-  return get_header_size(STRING) + len + 1;
+  exit(1);
 }
 
-size_t closure_size (size_t sz) { return get_header_size(CLOSURE) + MEMBER_SIZE * sz; }
-
-size_t sexp_size (size_t members) { return get_header_size(SEXP) + MEMBER_SIZE * (members + 1); }
-
 obj_field_iterator field_begin_iterator (void *obj) {
   lama_type          type = get_type_header_ptr(obj);
   obj_field_iterator it = {.type = type, .obj_ptr = obj, .cur_field = get_object_content_ptr(obj)};
@@ -832,8 +1535,8 @@ obj_field_iterator field_begin_iterator (void *obj) {
       it.cur_field = get_end_of_obj(it.obj_ptr);
       break;
     }
-    case CLOSURE:
-    case SEXP: {
+    case CLOSURE: {
+      // the first word of closure is a code offset
       it.cur_field += MEMBER_SIZE;
       break;
     }
@@ -862,95 +1565,3 @@ void obj_next_ptr_field_iterator (obj_field_iterator *it) {
 bool field_is_done_iterator (obj_field_iterator *it) {
   return it->cur_field >= get_end_of_obj(it->obj_ptr);
 }
-
-void *get_obj_header_ptr (void *ptr) {
-  lama_type type = get_type_row_ptr(ptr);
-  return ptr - get_header_size(type);
-}
-
-void *get_object_content_ptr (void *header_ptr) {
-  lama_type type = get_type_header_ptr(header_ptr);
-  return header_ptr + get_header_size(type);
-}
-
-void *get_end_of_obj (void *header_ptr) { return header_ptr + obj_size_header_ptr(header_ptr); }
-
-size_t get_header_size (lama_type type) {
-  switch (type) {
-    case STRING:
-    case CLOSURE:
-    case ARRAY:
-    case SEXP: return DATA_HEADER_SZ;
-    default: perror("ERROR: get_header_size: unknown object type\n");
-#ifdef DEBUG_VERSION
-      raise(SIGINT);   // only for debug purposes
-#endif
-      exit(1);
-  }
-}
-
-void *alloc_string (auint len) {
-  data *obj        = alloc(string_size(len));
-  obj->data_header = STRING_TAG | (len << 3);
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "%p, [STRING] tag=%zu\n", obj, TAG(obj->data_header));
-#endif
-#ifdef DEBUG_VERSION
-  obj->id = cur_id;
-#endif
-  obj->forward_address = 0;
-#ifdef DEBUG_PRINT
-  printf("Allocated string\n");
-#endif
-  return obj;
-}
-
-void *alloc_array (auint len) {
-  data *obj        = alloc(array_size(len));
-  obj->data_header = ARRAY_TAG | (len << 3);
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "%p, [ARRAY] tag=%zu\n", obj, TAG(obj->data_header));
-#endif
-#ifdef DEBUG_VERSION
-  obj->id = cur_id;
-#endif
-  obj->forward_address = 0;
-#ifdef DEBUG_PRINT
-  printf("Allocated array\n");
-#endif
-  return obj;
-}
-
-void *alloc_sexp (auint members) {
-  sexp *obj        = alloc(sexp_size(members));
-  obj->data_header = SEXP_TAG | (members << 3);
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "%p, SEXP tag=%zu\n", obj, TAG(obj->data_header));
-#endif
-#ifdef DEBUG_VERSION
-  obj->id = cur_id;
-#endif
-  obj->forward_address = 0;
-  obj->tag             = 0;
-#ifdef DEBUG_PRINT
-  printf("Allocated sexp\n");
-#endif
-  return obj;
-}
-
-void *alloc_closure (auint captured) {
-
-  data *obj        = alloc(closure_size(captured));
-  obj->data_header = CLOSURE_TAG | (captured << 3);
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "%p, [CLOSURE] tag=%zu\n", obj, TAG(obj->data_header));
-#endif
-#ifdef DEBUG_VERSION
-  obj->id = cur_id;
-#endif
-  obj->forward_address = 0;
-#ifdef DEBUG_PRINT
-  printf("Allocated closure\n");
-#endif
-  return obj;
-}
@@ -11,12 +11,21 @@
 //  - void *gc_alloc (size_t): this function is basically called whenever we are
 // not able to allocate memory on the existing heap via simple bump allocator.
 //  - mark_phase(): this function will tell you everything you need to know
-// about marking. I would also recommend to pay attention to the fact that
-// marking is implemented without usage of any additional memory. Already
-// allocated space is sufficient (for details see 'void mark (void *obj)').
+// about marking. Objects have a single header word, so marks are kept in a
+// side bitmap with a bit for every word of a live object (see 'mark_table').
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
-// functions used in there. It is basically an implementation of LISP2.
+// functions used in there. It is basically an implementation of LISP2, but
+// forwarding addresses are not stored: they are computed from the bitmap
+// and the number of live words before each bitmap block.
+//  - large object space: objects of at least LARGE_OBJECT_MIN_WORDS words are
+// not placed on the compacted heap. Each of them gets its own mapping, is
+// marked in place and is never moved; unreachable ones are unmapped after
+// compaction (see 'void los_sweep (void)').
+//  - collector backend: the compacting collector above is the default one,
+// mark-region collector from immix.h can be chosen instead at build time
+// (LAMA_GC_IMMIX macro, 'make GC=immix') or at run time with the environment
+// variable LAMA_GC=lisp2|immix. Both are hidden behind 'void *alloc (size_t)'.
 
 #ifndef __LAMA_GC__
 #define __LAMA_GC__
@@ -25,28 +34,23 @@
 extern "C" {
 #endif
 
+#include "object.h"
 #include "runtime_common.h"
 
-#define GET_MARK_BIT(x) (((ptrt)(x)) & 1)
-#define SET_MARK_BIT(x) (x = (((ptrt)(x)) | 1))
-#define IS_ENQUEUED(x) (((ptrt)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((ptrt)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((ptrt)(x)) & (~2)))
-#define RESET_MARK_BIT(x) (x = (((ptrt)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
-// alignment we can expect that last 2 bits don't influence address (they
-// should always be zero)
-#define GET_FORWARD_ADDRESS(x) (((ptrt)(x)) & (~3))
-// take the last two bits as they are and make all others zero
-#define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((ptrt)(addr))))
 // if heap is full after gc shows in how many times it has to be extended
 #define EXTRA_ROOM_HEAP_COEFFICIENT 2
 #define MINIMUM_HEAP_CAPACITY (64)
+// objects of at least this size (in words) are allocated in the large object space
+#define LARGE_OBJECT_MIN_WORDS (4096)
+// objects of at most this size (in words) may be bump-allocated inline, it must not
+// exceed neither LARGE_OBJECT_MIN_WORDS nor IMMIX_MAX_OBJECT_WORDS
+#define INLINE_ALLOC_MAX_WORDS (1024)
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-typedef enum { ARRAY, CLOSURE, STRING, SEXP } lama_type;
+typedef enum { GC_LISP2, GC_IMMIX } gc_backend;
 
 typedef struct {
   size_t *current;
@@ -58,7 +62,8 @@ typedef struct {
   void     *cur_field;
 } obj_field_iterator;
 
-// Memory pool for linear memory allocation
+// Memory pool for linear memory allocation, bump pointer of the current heap
+// chunk is kept in the allocation region (see 'alloc_region')
 typedef struct {
   size_t *begin;
   size_t *end;
@@ -66,14 +71,62 @@ typedef struct {
   size_t  size;
 } memory_chunk;
 
+// Region the selected backend bumps through: the free tail of the compacted heap or
+// the current Immix hole. Memory between current and limit is always zeroed.
+typedef struct {
+  size_t *current;
+  size_t *limit;
+} alloc_region;
+
+// Side table of marks for the heap chunk, exists only during GC cycle
+typedef struct {
+  // bit per heap word, set for every word of a live object
+  size_t *bits;
+  // number of live words before each word of bits (i.e. before each block of heap words)
+  size_t *offsets;
+  size_t  blocks;
+} mark_table;
+
+#define MARK_TABLE_BLOCK_WORDS (sizeof(size_t) * 8)
+
+// Objects that are marked but whose fields are not scanned yet
+typedef struct {
+  void **objects;
+  size_t size;
+  size_t capacity;
+} mark_stack;
+
+// Object living in the large object space, begin points to the object header
+typedef struct {
+  size_t *begin;
+  size_t  size;   // size of the mapping in bytes
+  bool    marked;
+} large_object;
+
+// Large object space: separately mapped objects sorted by address
+typedef struct {
+  large_object *objects;
+  size_t        count;
+  size_t        capacity;
+  size_t        allocated;   // bytes allocated since the last GC cycle
+  size_t        live;        // bytes survived the last GC cycle
+} large_object_space;
+
 // the only GC-related function that should be exposed, others are useful for tests and internal implementation
 // allocates object of the given size on the heap
 void *alloc(size_t);
-// takes number of words as a parameter
+// slow path of allocation, called when the object doesn't fit in the allocation region
+// or is too large for it, takes number of words as a parameter
 void *gc_alloc(size_t);
 // takes number of words as a parameter
 void *gc_alloc_on_existing_heap(size_t);
 
+// performs a GC cycle with the selected backend, takes number of words
+// required by the allocation that caused it
+void gc_collect (size_t additional_size);
+// calls visit for every root slot: program stack, extra roots and global area
+void gc_visit_roots (void (*visit) (void **root));
+
 // specific for mark-and-compact_phase gc
 void mark (void *obj);
 void mark_phase (void);
@@ -90,6 +143,13 @@ size_t compute_locations ();
 void   update_references (memory_chunk *);
 void   physically_relocate (memory_chunk *);
 
+// specific for large object space
+// takes number of words, maps a separate region for the object
+void *los_alloc (size_t);
+// unmaps unmarked large objects and unmarks the rest
+void  los_sweep (void);
+bool  is_large_object_pointer (const size_t *);
+
 // ============================================================================
 //                            GC extra roots
 // ============================================================================
@@ -110,6 +170,122 @@ void clear_extra_roots (void);
 void push_extra_root (void **p);
 void pop_extra_root (void **p);
 
+// ============================================================================
+//                            GC stack segments
+// ============================================================================
+// Value stacks of suspended fibers. They are scanned for roots (and fixed
+// after compaction) in addition to the current stack [__gc_stack_top,
+// __gc_stack_bottom). The interpreter owns the array and registers it again
+// whenever it changes.
+typedef struct {
+  size_t *begin, *end;
+} stack_segment;
+
+void gc_set_stack_segments (stack_segment *segments, size_t count);
+
+// ============================================================================
+//                            Survivors hook
+// ============================================================================
+// Lets the interpreter follow objects it keeps track of (e.g. allocation
+// sites for the heap profiler) through collections without keeping them
+// alive. The hook is called on the collecting thread once live objects are
+// known and moved, before the dead ones are freed; in it gc_forward takes the
+// content address an object had before the collection and returns the
+// address it has after it, or NULL if the object is dead. The hook may
+// neither allocate on the Lama heap nor touch its objects.
+void  gc_set_survivors_hook (void (*hook) (void *data), void *data);
+void *gc_forward (void *obj);
+// calls the hook if it is set, for collectors
+void  gc_report_survivors (void);
+
+// ============================================================================
+//                            GC statistics
+// ============================================================================
+// Counters kept by every context whatever the build. With LAMA_GC_STATS set
+// they are written as a line of JSON per context when it is shut down or the
+// process exits: to stderr for the values "1" and "-", appended to the file
+// named by the value otherwise. With it set, SIGUSR1 also makes the next
+// mutator reaching a safepoint (see gc_safepoint) write them for all live
+// contexts.
+// Phases of immix are marking (which also evacuates) and sweeping; sizes in
+// immix blocks are counted by lines.
+
+// pauses of at most 1 << i microseconds are counted in bucket i, the last one takes the rest
+#define GC_PAUSE_BUCKETS (24)
+
+typedef struct {
+  size_t   collections;
+  // time spent in collections including waits for other mutators to park, in nanoseconds
+  uint64_t pause_ns, max_pause_ns;
+  size_t   pauses[GC_PAUSE_BUCKETS];
+  uint64_t mark_ns, compute_locations_ns, relocate_ns, update_references_ns, sweep_ns;
+  // bytes freed by all collections, survived the last one and the most mapped for objects after one
+  size_t   reclaimed_bytes, live_bytes, peak_heap_bytes;
+  // time the context was created at
+  uint64_t start_ns;
+} gc_stats;
+
+// monotonic clock in nanoseconds
+uint64_t gc_clock_ns (void);
+
+// ============================================================================
+//                              Heap dump
+// ============================================================================
+// Writes the objects reachable from the roots to a binary file for
+// `heapanalyser`. With LAMA_HEAP_DUMP set, SIGUSR2 makes the next mutator
+// reaching a safepoint (gc_safepoint, which the interpreter polls at calls and
+// jumps) write the dump of its context to the file named by the value. The
+// file is replaced only when the dump is complete.
+//
+// The file is a sequence of native words:
+//   header:  HEAP_DUMP_MAGIC, HEAP_DUMP_VERSION, number of roots R, number of objects N
+//   roots:   R addresses of objects referenced by roots
+//   objects: N records of address, header word (see data_header), size in
+//            bytes with the header, label (s-expression tag hash or closure
+//            code offset, 0 otherwise), number of references K and K
+//            addresses of objects referenced by its fields
+// Addresses are of object contents, as in values.
+#define HEAP_DUMP_MAGIC "LAMAHEAP"
+#define HEAP_DUMP_VERSION (1)
+
+// returns 0 on success and -1 otherwise (errno is set), the context has to
+// be bound and other mutators, if any, have to be at safepoints or running
+int gc_dump_heap (const char *path);
+
+// ============================================================================
+//                            Parallel mutators
+// ============================================================================
+// Several threads may run one program at once (parallel builtins, see
+// vm.cpp). They share the context, stack bounds and extra roots are kept per
+// thread. While the world is started the allocation region of every thread
+// is its thread-local allocation buffer (TLAB): a chunk of TLAB_WORDS carved
+// from the shared region under the world lock, so the inline fast path stays
+// private and only an exhausted buffer enters gc_alloc. A retired buffer
+// gives its unused tail back to the shared region when they are adjacent and
+// is closed by a dead filler object otherwise, so the heap chunk stays
+// parsable for compaction. A collection first stops the other mutators: they
+// park at a safepoint (gc_alloc or gc_safepoint, which the interpreter polls
+// while '__gc_stop_requested' is set) and publish their stacks, extra roots
+// and buffers; the collector retires the buffers before it starts.
+typedef struct gc_world gc_world;
+struct lama_vm;
+
+// number of worlds waiting for their mutators to park
+extern volatile int __gc_stop_requested;
+
+// called by the thread owning the context before other threads join
+void gc_world_start (void);
+// called by the owner after all other threads have left
+void gc_world_finish (void);
+// makes the context of the owner current on the calling thread and counts it as a mutator
+void gc_world_join (struct lama_vm *vm);
+void gc_world_leave (void);
+void gc_safepoint (void);
+// the calling mutator won't touch the heap until gc_blocking_end (e.g. waits
+// for other mutators), collections may run meanwhile
+void gc_blocking_begin (void);
+void gc_blocking_end (void);
+
 // ============================================================================
 //                   Implemented in GASM: see gc_runtime.s
 // ============================================================================
@@ -158,11 +334,9 @@ void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr);
 // scans it and if it meets a pointer, it should be modified in according to forward address
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end);
 
-// takes a pointer to an object content as an argument, returns forwarding address
-size_t get_forward_address (void *obj);
-
-// takes a pointer to an object content as an argument, sets forwarding address to value 'addr'
-void set_forward_address (void *obj, size_t addr);
+// takes a pointer to a content of a marked heap object, returns the offset (in words) of its header
+// from the heap beginning after compaction
+size_t get_forward_offset (void *obj);
 
 // takes a pointer to an object content as an argument, returns whether this object was marked as live
 bool is_marked (void *obj);
@@ -173,45 +347,11 @@ void mark_object (void *obj);
 // takes a pointer to an object content as an argument, marks the object as dead
 void unmark_object (void *obj);
 
-// takes a pointer to an object content as an argument, returns whether this object was enqueued to the queue (which is used in mark phase)
-bool is_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, marks object as enqueued
-void make_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, unmarks object as enqueued
-void make_dequeued (void *obj);
-
 // returns iterator to an object with the lowest address
 heap_iterator heap_begin_iterator ();
 void          heap_next_obj_iterator (heap_iterator *it);
 bool          heap_is_done_iterator (heap_iterator *it);
 
-// returns correct type when pointer to actual data is passed (header is excluded)
-lama_type get_type_row_ptr (void *ptr);
-// returns correct type when pointer to an object header is passed
-lama_type get_type_header_ptr (void *ptr);
-
-// returns correct object size (together with header) of an object, ptr is pointer to an actual data is passed (header is excluded)
-size_t obj_size_row_ptr (void *ptr);
-// returns correct object size (together with header) of an object, ptr is pointer to an object header
-size_t obj_size_header_ptr (void *ptr);
-
-// returns total padding size that we need to store given object type
-size_t get_header_size (lama_type type);
-
-// returns number of bytes that are required to allocate array with 'sz' elements (header included)
-size_t array_size (size_t sz);
-
-// returns number of bytes that are required to allocate string of length 'l' (header included)
-size_t string_size (size_t len);
-
-// returns number of bytes that are required to allocate closure with 'sz-1' captured values (header included)
-size_t closure_size (size_t sz);
-
-// returns number of bytes that are required to allocate s-expression with 'members' fields (header included)
-size_t sexp_size (size_t members);
-
 // returns an iterator over object fields, obj is ptr to object header
 // (in case of s-exp, it is mandatory that obj ptr is very beginning of the object,
 // considering that now we store two versions of header in there)
@@ -231,15 +371,53 @@ void obj_next_ptr_field_iterator (obj_field_iterator *it);
 // returns if we are done iterating over fields of the object
 bool field_is_done_iterator (obj_field_iterator *it);
 
-// ptr is pointer to the actual object content, returns pointer to the very beginning of the object (header)
-void *get_obj_header_ptr (void *ptr);
-void *get_object_content_ptr (void *header_ptr);
-void *get_end_of_obj (void *header_ptr);
+// ============================================================================
+//                      Inline allocation fast path
+// ============================================================================
+// Shared by the runtime and the interpreter, so that an allocation is a
+// compare-and-bump on the allocation region unless it has to go to gc_alloc.
+extern __thread alloc_region __gc_alloc_region;
+#ifdef DEBUG_VERSION
+extern size_t cur_id;
+#endif
+
+// takes number of words, returns pointer to the zeroed memory
+static inline void *alloc_words (size_t size) {
+#ifdef DEBUG_VERSION
+  ++cur_id;
+#endif
+  size_t *p = __gc_alloc_region.current;
+  if (size <= INLINE_ALLOC_MAX_WORDS && (size_t)(__gc_alloc_region.limit - p) >= size) {
+    __gc_alloc_region.current = p + size;
+    return p;
+  }
+  return gc_alloc(size);
+}
+
+static inline void *alloc_data (auint tag, auint len, size_t bytes) {
+  data *obj        = (data *)alloc_words(BYTES_TO_WORDS(bytes));
+  obj->data_header = tag | (len << 3);
+#ifdef DEBUG_VERSION
+  obj->id = cur_id;
+#endif
+  return obj;
+}
+
+static inline void *alloc_string (auint len) {
+  return alloc_data(STRING_TAG, len, string_size(len));
+}
+
+static inline void *alloc_array (auint len) {
+  return alloc_data(ARRAY_TAG, len, array_size(len));
+}
+
+static inline void *alloc_sexp (auint members) {
+  return alloc_data(SEXP_TAG, members, sexp_size(members));
+}
 
-void *alloc_string (auint len);
-void *alloc_array (auint len);
-void *alloc_sexp (auint members);
-void *alloc_closure (auint captured);
+static inline void *alloc_closure (auint captured) {
+  return alloc_data(CLOSURE_TAG, captured, closure_size(captured));
+}
 
 #ifdef __cplusplus
 }
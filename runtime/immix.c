@@ -0,0 +1,401 @@
+#define _GNU_SOURCE 1
+
+#include "immix.h"
+
+#include "runtime_common.h"
+#include "vm_context.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define BITS_PER_WORD (sizeof(size_t) * 8)
+// a block can't have more holes than every other line free
+#define MAX_HOLES (IMMIX_LINES_PER_BLOCK / 2)
+
+// state of the VM bound to the current thread
+#define chunks (__vm->immix.chunks)
+#define chunks_count (__vm->immix.chunks_count)
+#define chunks_capacity (__vm->immix.chunks_capacity)
+#define free_blocks (__vm->immix.free_blocks)
+#define recyclable_blocks (__vm->immix.recyclable_blocks)
+#define free_blocks_count (__vm->immix.free_blocks_count)
+#define current_block (__vm->immix.current_block)
+#define current_line (__vm->immix.current_line)
+#define overflow_cursor (__vm->immix.overflow_cursor)
+#define overflow_limit (__vm->immix.overflow_limit)
+#define evacuation_block (__vm->immix.evacuation_block)
+#define evacuation_cursor (__vm->immix.evacuation_cursor)
+#define evacuation_limit (__vm->immix.evacuation_limit)
+#define evacuation_exhausted (__vm->immix.evacuation_exhausted)
+#define allocated_lines (__vm->immix.allocated_lines)
+#define budget_lines (__vm->immix.budget_lines)
+#define gray (__vm->immix.gray)
+
+static inline bool test_bit (const size_t *bits, size_t i) {
+  return (bits[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+static inline void set_bit (size_t *bits, size_t i) {
+  bits[i / BITS_PER_WORD] |= (size_t)1 << (i % BITS_PER_WORD);
+}
+
+static void map_chunk (void) {
+  size_t *p = mmap(NULL,
+                   IMMIX_CHUNK_BLOCKS * IMMIX_BLOCK_SIZE,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1,
+                   0);
+  if (p == MAP_FAILED) {
+    perror("ERROR: map_chunk: mmap failed\n");
+    exit(1);
+  }
+  immix_block *blocks = calloc(IMMIX_CHUNK_BLOCKS, sizeof(immix_block));
+  if (blocks == NULL) {
+    perror("ERROR: map_chunk: calloc failed\n");
+    exit(1);
+  }
+
+  if (chunks_count == chunks_capacity) {
+    chunks_capacity = MAX(2 * chunks_capacity, 16);
+    chunks          = realloc(chunks, chunks_capacity * sizeof(immix_chunk));
+    if (chunks == NULL) {
+      perror("ERROR: map_chunk: realloc failed\n");
+      exit(1);
+    }
+  }
+  size_t i = chunks_count;
+  while (i > 0 && chunks[i - 1].begin > p) { --i; }
+  memmove(&chunks[i + 1], &chunks[i], (chunks_count - i) * sizeof(immix_chunk));
+  chunks[i].begin  = p;
+  chunks[i].blocks = blocks;
+  chunks_count++;
+
+  for (size_t j = IMMIX_CHUNK_BLOCKS; j-- > 0;) {
+    blocks[j].begin = p + j * IMMIX_BLOCK_WORDS;
+    blocks[j].state = IMMIX_BLOCK_FREE;
+    blocks[j].next  = free_blocks;
+    free_blocks     = &blocks[j];
+    free_blocks_count++;
+  }
+}
+
+static immix_block *find_block (const void *p) {
+  size_t lo = 0, hi = chunks_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((const void *)chunks[mid].begin <= p) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) { return NULL; }
+  immix_chunk *chunk  = &chunks[lo - 1];
+  size_t       offset = (const char *)p - (const char *)chunk->begin;
+  if (offset >= IMMIX_CHUNK_BLOCKS * IMMIX_BLOCK_SIZE) { return NULL; }
+  return &chunk->blocks[offset / IMMIX_BLOCK_SIZE];
+}
+
+bool is_immix_pointer (const size_t *p) { return find_block(p) != NULL; }
+
+size_t immix_heap_size (void) { return chunks_count * IMMIX_CHUNK_BLOCKS * IMMIX_BLOCK_WORDS; }
+
+size_t immix_used_bytes (void) { return (__vm->immix.live_lines + allocated_lines) * IMMIX_LINE_SIZE; }
+
+// takes a block out of the recyclable or the free list, returns NULL if both are empty
+static immix_block *take_block (bool free_only) {
+  immix_block *b;
+  if (!free_only && recyclable_blocks != NULL) {
+    b                 = recyclable_blocks;
+    recyclable_blocks = b->next;
+  } else if (free_blocks != NULL) {
+    b           = free_blocks;
+    free_blocks = b->next;
+    free_blocks_count--;
+  } else {
+    return NULL;
+  }
+  b->state = IMMIX_BLOCK_UNAVAILABLE;
+  b->next  = NULL;
+  return b;
+}
+
+// takes a block for allocation, performs a collection first if the budget is exhausted
+static immix_block *acquire_block (size_t size, bool free_only) {
+  if (allocated_lines >= budget_lines) { gc_collect(size); }
+  immix_block *b = take_block(free_only);
+  if (b == NULL) {
+    map_chunk();
+    b = take_block(free_only);
+  }
+  allocated_lines += IMMIX_LINES_PER_BLOCK - b->marked_lines;
+  return b;
+}
+
+// looks for the next run of free lines in the current block and makes it the current hole
+static bool next_hole (void) {
+  size_t line = current_line;
+  while (line < IMMIX_LINES_PER_BLOCK && current_block->line_marks[line]) { ++line; }
+  if (line == IMMIX_LINES_PER_BLOCK) { return false; }
+  size_t end = line;
+  while (end < IMMIX_LINES_PER_BLOCK && !current_block->line_marks[end]) { ++end; }
+  current_line = end;
+  __gc_alloc_region.current = current_block->begin + line * IMMIX_LINE_WORDS;
+  __gc_alloc_region.limit   = current_block->begin + end * IMMIX_LINE_WORDS;
+  memset(__gc_alloc_region.current, 0, (end - line) * IMMIX_LINE_SIZE);
+  return true;
+}
+
+void *immix_alloc_slow (size_t size) {
+  void *p;
+  if (WORDS_TO_BYTES(size) > IMMIX_LINE_SIZE) {
+    // medium object doesn't fit in the current hole, the rest of the hole is kept for small ones
+    if ((size_t)(overflow_limit - overflow_cursor) < size) {
+      immix_block *b  = acquire_block(size, true);
+      overflow_cursor = b->begin;
+      overflow_limit  = b->begin + IMMIX_BLOCK_WORDS;
+      memset(overflow_cursor, 0, IMMIX_BLOCK_SIZE);
+    }
+    p = overflow_cursor;
+    overflow_cursor += size;
+    return p;
+  }
+  // small object fits in any hole
+  while (current_block == NULL || !next_hole()) {
+    current_block = acquire_block(size, false);
+    current_line  = 0;
+  }
+  p = __gc_alloc_region.current;
+  __gc_alloc_region.current += size;
+  return p;
+}
+
+// chooses fragmented blocks to evacuate, so that their live lines (estimated by the last
+// collection) fit in free blocks, the most fragmented blocks are chosen first
+static void select_candidates (void) {
+  size_t required[MAX_HOLES + 1] = {0};
+  for (size_t c = 0; c < chunks_count; ++c) {
+    for (size_t i = 0; i < IMMIX_CHUNK_BLOCKS; ++i) {
+      immix_block *b = &chunks[c].blocks[i];
+      b->candidate   = false;
+      if (b->marked_lines > 0) { required[b->holes] += b->marked_lines; }
+    }
+  }
+
+  size_t available = free_blocks_count * IMMIX_LINES_PER_BLOCK, threshold = MAX_HOLES + 1;
+  // blocks with a single hole are not fragmented
+  for (size_t holes = MAX_HOLES; holes >= 2 && required[holes] <= available; --holes) {
+    available -= required[holes];
+    threshold = holes;
+  }
+  if (threshold > MAX_HOLES) { return; }
+
+  for (size_t c = 0; c < chunks_count; ++c) {
+    for (size_t i = 0; i < IMMIX_CHUNK_BLOCKS; ++i) {
+      immix_block *b = &chunks[c].blocks[i];
+      b->candidate   = b->marked_lines > 0 && b->holes >= threshold;
+    }
+  }
+}
+
+static void clear_marks (void) {
+  for (size_t c = 0; c < chunks_count; ++c) {
+    for (size_t i = 0; i < IMMIX_CHUNK_BLOCKS; ++i) {
+      immix_block *b = &chunks[c].blocks[i];
+      memset(b->line_marks, 0, sizeof(b->line_marks));
+      memset(b->object_marks, 0, sizeof(b->object_marks));
+      if (b->candidate) { memset(b->forwarded, 0, sizeof(b->forwarded)); }
+    }
+  }
+}
+
+static void mark_lines (immix_block *b, size_t *header_ptr, size_t size) {
+  size_t first = (header_ptr - b->begin) / IMMIX_LINE_WORDS;
+  size_t last  = (header_ptr + size - 1 - b->begin) / IMMIX_LINE_WORDS;
+  memset(&b->line_marks[first], 1, last - first + 1);
+}
+
+// returns space for the copy of an evacuated object or NULL if free blocks are exhausted
+static size_t *evacuation_alloc (size_t size) {
+  if ((size_t)(evacuation_limit - evacuation_cursor) < size) {
+    evacuation_block = evacuation_exhausted ? NULL : take_block(true);
+    if (evacuation_block == NULL) {
+      evacuation_exhausted = true;
+      return NULL;
+    }
+    evacuation_cursor = evacuation_block->begin;
+    evacuation_limit  = evacuation_block->begin + IMMIX_BLOCK_WORDS;
+  }
+  size_t *p = evacuation_cursor;
+  evacuation_cursor += size;
+  return p;
+}
+
+static void gray_push (void *obj) {
+  if (gray.size == gray.capacity) {
+    gray.capacity = MAX(2 * gray.capacity, 256);
+    gray.objects  = realloc(gray.objects, gray.capacity * sizeof(void *));
+    if (gray.objects == NULL) {
+      perror("ERROR: gray_push: realloc failed\n");
+      exit(1);
+    }
+  }
+  gray.objects[gray.size++] = obj;
+}
+
+// marks the object referenced from slot, updates the slot if the object is evacuated
+static void trace_slot (void **slot) {
+  void *obj = *slot;
+  if (obj == NULL || UNBOXED(obj)) { return; }
+  size_t      *header_ptr = (size_t *)get_obj_header_ptr(obj);
+  immix_block *b          = find_block(header_ptr);
+  if (b == NULL) {
+    if (is_large_object_pointer(obj) && !is_marked(obj)) {
+      mark_object(obj);
+      gray_push(obj);
+    }
+    return;
+  }
+
+  size_t word = header_ptr - b->begin;
+  if (b->candidate && test_bit(b->forwarded, word)) {
+    *slot = (void *)*header_ptr;
+    return;
+  }
+  if (test_bit(b->object_marks, word)) { return; }
+
+  size_t size = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+  if (b->candidate) {
+    size_t *copy = evacuation_alloc(size);
+    if (copy != NULL) {
+      memcpy(copy, header_ptr, WORDS_TO_BYTES(size));
+      set_bit(evacuation_block->object_marks, copy - evacuation_block->begin);
+      mark_lines(evacuation_block, copy, size);
+      obj = (char *)copy + DATA_HEADER_SZ;
+      set_bit(b->forwarded, word);
+      *header_ptr = (size_t)obj;
+      *slot       = obj;
+      gray_push(obj);
+      return;
+    }
+  }
+  set_bit(b->object_marks, word);
+  mark_lines(b, header_ptr, size);
+  gray_push(obj);
+}
+
+static void trace (void) {
+  while (gray.size > 0) {
+    void *obj = gray.objects[--gray.size];
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      trace_slot((void **)it.cur_field);
+    }
+  }
+}
+
+// rebuilds free and recyclable lists from line marks and sets the budget for the next cycle
+static void sweep (void) {
+  size_t live_lines = 0;
+  free_blocks       = NULL;
+  recyclable_blocks = NULL;
+  free_blocks_count = 0;
+  for (size_t c = chunks_count; c-- > 0;) {
+    for (size_t i = IMMIX_CHUNK_BLOCKS; i-- > 0;) {
+      immix_block *b      = &chunks[c].blocks[i];
+      size_t       marked = 0, holes = 0;
+      for (size_t line = 0; line < IMMIX_LINES_PER_BLOCK; ++line) {
+        if (b->line_marks[line]) {
+          ++marked;
+        } else if (line == 0 || b->line_marks[line - 1]) {
+          ++holes;
+        }
+      }
+      b->marked_lines = marked;
+      b->holes        = holes;
+      b->candidate    = false;
+      live_lines += marked;
+      if (marked == 0) {
+        b->state    = IMMIX_BLOCK_FREE;
+        b->next     = free_blocks;
+        free_blocks = b;
+        free_blocks_count++;
+      } else if (marked < IMMIX_LINES_PER_BLOCK) {
+        b->state          = IMMIX_BLOCK_RECYCLABLE;
+        b->next           = recyclable_blocks;
+        recyclable_blocks = b;
+      } else {
+        b->state = IMMIX_BLOCK_UNAVAILABLE;
+        b->next  = NULL;
+      }
+    }
+  }
+  allocated_lines = 0;
+  budget_lines    = MAX(IMMIX_MINIMUM_BUDGET_BLOCKS * IMMIX_LINES_PER_BLOCK,
+                     live_lines * (EXTRA_ROOM_HEAP_COEFFICIENT - 1));
+  __vm->immix.live_lines = live_lines;
+}
+
+void immix_collect (void) {
+  // blocks being allocated into are swept as any other block
+  __gc_alloc_region.current = __gc_alloc_region.limit = NULL;
+  overflow_cursor = overflow_limit = NULL;
+  current_block                    = NULL;
+
+  select_candidates();
+  clear_marks();
+  evacuation_block  = NULL;
+  evacuation_cursor = evacuation_limit = NULL;
+  evacuation_exhausted                 = false;
+
+  uint64_t start = gc_clock_ns();
+  gc_visit_roots(trace_slot);
+  trace();
+  uint64_t traced = gc_clock_ns();
+  __vm->stats.mark_ns += traced - start;
+  gc_report_survivors();
+  sweep();
+  __vm->stats.sweep_ns += gc_clock_ns() - traced;
+}
+
+void *immix_forward (void *obj) {
+  size_t      *header_ptr = (size_t *)get_obj_header_ptr(obj);
+  immix_block *b          = find_block(header_ptr);
+  size_t       word       = header_ptr - b->begin;
+  if (b->candidate && test_bit(b->forwarded, word)) { return (void *)*header_ptr; }
+  return test_bit(b->object_marks, word) ? obj : NULL;
+}
+
+void immix_init (void) {
+  // large object space triggers collections relying on the heap size, so it is never empty
+  if (chunks_count == 0) {
+    budget_lines = IMMIX_MINIMUM_BUDGET_BLOCKS * IMMIX_LINES_PER_BLOCK;
+    map_chunk();
+  }
+}
+
+void immix_shutdown (void) {
+  for (size_t c = 0; c < chunks_count; ++c) {
+    munmap(chunks[c].begin, IMMIX_CHUNK_BLOCKS * IMMIX_BLOCK_SIZE);
+    free(chunks[c].blocks);
+  }
+  free(chunks);
+  free(gray.objects);
+  chunks            = NULL;
+  chunks_count      = 0;
+  chunks_capacity   = 0;
+  free_blocks       = NULL;
+  recyclable_blocks = NULL;
+  free_blocks_count = 0;
+  __gc_alloc_region.current = __gc_alloc_region.limit = NULL;
+  overflow_cursor = overflow_limit = NULL;
+  current_block                    = NULL;
+  allocated_lines                  = 0;
+  __vm->immix.live_lines           = 0;
+  budget_lines                     = IMMIX_MINIMUM_BUDGET_BLOCKS * IMMIX_LINES_PER_BLOCK;
+  memset(&gray, 0, sizeof(gray));
+}
@@ -0,0 +1,120 @@
+// ============================================================================
+//                              Immix GC
+// ============================================================================
+// An alternative to the compacting collector from gc.c, see "Immix: A
+// Mark-Region Garbage Collector with Space Efficiency, Fast Collection, and
+// Mutator Performance" by Blackburn and McKinley.
+// The heap is a set of blocks, each block is divided into lines. Allocation
+// bumps a cursor through a hole, i.e. a run of lines that were free after the
+// last collection. A collection marks live objects and lines they occupy in
+// place, so no heap-wide copying pass is needed. Blocks that were fragmented
+// after the previous collection are chosen as evacuation candidates: objects
+// reached in them are copied to free blocks while there is room and marked in
+// place otherwise (opportunistic evacuation).
+// Objects larger than IMMIX_MAX_OBJECT_WORDS go to the large object space
+// shared with the compacting collector.
+
+#ifndef __LAMA_IMMIX__
+#define __LAMA_IMMIX__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "gc.h"
+
+#include <stdint.h>
+
+#define IMMIX_BLOCK_SIZE (32 * 1024)
+#define IMMIX_LINE_SIZE (256)
+#define IMMIX_BLOCK_WORDS (IMMIX_BLOCK_SIZE / sizeof(size_t))
+#define IMMIX_LINE_WORDS (IMMIX_LINE_SIZE / sizeof(size_t))
+#define IMMIX_LINES_PER_BLOCK (IMMIX_BLOCK_SIZE / IMMIX_LINE_SIZE)
+// objects larger than this (in words) are allocated in the large object space
+#define IMMIX_MAX_OBJECT_WORDS (IMMIX_BLOCK_WORDS / 4)
+// blocks are mapped by chunks of this many blocks
+#define IMMIX_CHUNK_BLOCKS (32)
+// number of blocks that may be allocated into before the first collection
+#define IMMIX_MINIMUM_BUDGET_BLOCKS (8)
+
+typedef enum {
+  IMMIX_BLOCK_FREE,         // no live objects, fully available for allocation
+  IMMIX_BLOCK_RECYCLABLE,   // has some free lines
+  IMMIX_BLOCK_UNAVAILABLE   // has no free lines or is being allocated into
+} immix_block_state;
+
+typedef struct immix_block {
+  size_t             *begin;
+  immix_block_state   state;
+  // set when the block is chosen for evacuation during the current collection
+  bool                candidate;
+  // number of marked lines and holes after the last collection
+  uint16_t            marked_lines;
+  uint16_t            holes;
+  struct immix_block *next;   // link in the free or recyclable list
+  uint8_t             line_marks[IMMIX_LINES_PER_BLOCK];
+  // bit per block word, set for the header word of every marked object
+  size_t              object_marks[IMMIX_BLOCK_WORDS / (sizeof(size_t) * 8)];
+  // bit per block word, set for the header word of every evacuated object,
+  // the header word itself holds the new content address then
+  size_t              forwarded[IMMIX_BLOCK_WORDS / (sizeof(size_t) * 8)];
+} immix_block;
+
+// Continuous group of blocks mapped at once, aligned to IMMIX_BLOCK_SIZE
+typedef struct {
+  size_t      *begin;
+  immix_block *blocks;
+} immix_chunk;
+
+// Allocator and collector state, part of the VM context (see vm_context.h)
+typedef struct {
+  // sorted by address
+  immix_chunk *chunks;
+  size_t       chunks_count, chunks_capacity;
+
+  immix_block *free_blocks, *recyclable_blocks;
+  size_t       free_blocks_count;
+
+  // block the current hole (i.e. the allocation region) belongs to and the line to look for the next hole from
+  immix_block *current_block;
+  size_t       current_line;
+  // free block for objects that don't fit in the current hole
+  size_t      *overflow_cursor, *overflow_limit;
+
+  // free block the evacuated objects are copied to, used only during collection
+  immix_block *evacuation_block;
+  size_t      *evacuation_cursor, *evacuation_limit;
+  bool         evacuation_exhausted;
+
+  // lines handed out for allocation since the last collection and the limit on them
+  size_t allocated_lines, budget_lines;
+  // lines marked by the last collection
+  size_t live_lines;
+
+  // marked objects whose fields are not traced yet
+  mark_stack gray;
+} immix_state;
+
+void immix_init (void);
+void immix_shutdown (void);
+
+// takes number of words of an object that doesn't fit in the current hole, moves
+// the allocation region to the next hole if needed, may perform a collection;
+// returns pointer to the zeroed memory on the immix heap
+void *immix_alloc_slow (size_t size);
+// marks reachable objects (including the large ones) and sweeps immix blocks,
+// large object space has to be swept by the caller
+void  immix_collect (void);
+bool  is_immix_pointer (const size_t *);
+// gc_forward for objects in immix blocks, valid between tracing and sweeping
+void *immix_forward (void *obj);
+// returns number of words in all mapped blocks
+size_t immix_heap_size (void);
+// returns number of bytes in lines marked by the last collection or handed out since
+size_t immix_used_bytes (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
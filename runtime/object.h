@@ -0,0 +1,103 @@
+// ============================================================================
+//                              Object model
+// ============================================================================
+// Every heap object is a single header word (see 'data_header' in
+// runtime_common.h) followed by its content, values point to the content.
+// Functions here are static inline and shared by the runtime, the GC and the
+// interpreter, so that type and length checks are a load and a mask.
+
+#ifndef __LAMA_OBJECT__
+#define __LAMA_OBJECT__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "runtime_common.h"
+
+#include <stddef.h>
+
+// values are equal to header tags, so the type is read directly from the header
+typedef enum { STRING = STRING_TAG, ARRAY = ARRAY_TAG, SEXP = SEXP_TAG, CLOSURE = CLOSURE_TAG } lama_type;
+
+// reports an object with corrupted header and terminates
+size_t invalid_object_header (const void *header_ptr);
+
+// returns total padding size that we need to store given object type
+static inline size_t get_header_size (lama_type type) {
+  (void)type;
+  return DATA_HEADER_SZ;
+}
+
+// returns the length stored in a header, s-expressions keep their tag above it (see SEXP_TAG_SHIFT)
+static inline ptrt LEN (auint header) {
+  return (header & (TAG(header) == SEXP_TAG ? SEXP_LEN_MASK : LEN_MASK)) >> 3;
+}
+
+// ptr is pointer to the actual object content, returns pointer to the very beginning of the object (header)
+static inline void *get_obj_header_ptr (void *ptr) { return (char *)ptr - DATA_HEADER_SZ; }
+
+static inline void *get_object_content_ptr (void *header_ptr) {
+  return (char *)header_ptr + DATA_HEADER_SZ;
+}
+
+// returns correct type when pointer to an object header is passed
+static inline lama_type get_type_header_ptr (const void *ptr) {
+  return (lama_type)TAG(*(const auint *)ptr);
+}
+
+// returns correct type when pointer to actual data is passed (header is excluded)
+static inline lama_type get_type_row_ptr (const void *ptr) {
+  return get_type_header_ptr((const char *)ptr - DATA_HEADER_SZ);
+}
+
+// returns number of elements (characters, fields or captured values including code offset),
+// ptr is pointer to an actual data
+static inline size_t obj_length (const void *ptr) {
+  return LEN(*(const auint *)((const char *)ptr - DATA_HEADER_SZ));
+}
+
+// returns pointer to the i-th field of an array, s-expression or closure
+static inline aint *obj_field (void *ptr, size_t i) { return (aint *)ptr + i; }
+
+// returns number of bytes that are required to allocate array with 'sz' elements (header included)
+static inline size_t array_size (size_t sz) { return DATA_HEADER_SZ + MEMBER_SIZE * sz; }
+
+// returns number of bytes that are required to allocate string of length 'l' (header included)
+static inline size_t string_size (size_t len) {
+  // string should be null terminated
+  return DATA_HEADER_SZ + len + 1;
+}
+
+// returns number of bytes that are required to allocate closure with 'sz-1' captured values (header included)
+static inline size_t closure_size (size_t sz) { return DATA_HEADER_SZ + MEMBER_SIZE * sz; }
+
+// returns number of bytes that are required to allocate s-expression with 'members' fields (header included)
+static inline size_t sexp_size (size_t members) { return DATA_HEADER_SZ + MEMBER_SIZE * members; }
+
+// returns correct object size (together with header) of an object, ptr is pointer to an object header
+static inline size_t obj_size_header_ptr (const void *ptr) {
+  size_t len = LEN(*(const auint *)ptr);
+  switch (get_type_header_ptr(ptr)) {
+    case STRING: return string_size(len);
+    case ARRAY:
+    case SEXP:
+    case CLOSURE: return DATA_HEADER_SZ + MEMBER_SIZE * len;
+    default: return invalid_object_header(ptr);
+  }
+}
+
+// returns correct object size (together with header) of an object, ptr is pointer to an actual data is passed (header is excluded)
+static inline size_t obj_size_row_ptr (const void *ptr) {
+  return obj_size_header_ptr((const char *)ptr - DATA_HEADER_SZ);
+}
+
+static inline void *get_end_of_obj (void *header_ptr) {
+  return (char *)header_ptr + obj_size_header_ptr(header_ptr);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,8 +7,9 @@
 
 #include "gc.h"
 #include "runtime_common.h"
+#include "vm_context.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern __thread size_t __gc_stack_top, __gc_stack_bottom;
 
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
@@ -22,7 +23,14 @@ extern size_t __gc_stack_top, __gc_stack_bottom;
   /*assert(__builtin_frame_address(0) <= (void *)__gc_stack_top);*/                                    \
   if (flag) { __gc_stack_top = 0; }
 
+void (*__failure_handler) (const char *msg) = NULL;
+
 _Noreturn static void vfailure (char *s, va_list args) {
+  if (__failure_handler != NULL) {
+    char msg[1024];
+    vsnprintf(msg, sizeof(msg), s, args);
+    __failure_handler(msg);
+  }
   fprintf(stderr, "*** FAILURE: ");
   vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
   exit(255);
@@ -81,7 +89,7 @@ extern aint LcompareTags (void *p, void *q) {
   qd = TO_DATA(q);
 
   if (TAG(pd->data_header) == SEXP_TAG && TAG(qd->data_header) == SEXP_TAG) {
-    return BOX((TO_SEXP(p)->tag) - (TO_SEXP(q)->tag));
+    return BOX(get_sexp_tag(p) - get_sexp_tag(q));
   } else {
     failure("not a sexpr in compareTags: %ld, %ld\n", TAG(pd->data_header), TAG(qd->data_header));
   }
@@ -207,7 +215,7 @@ aint Ls__Infix_37 (void *p, void *q) {
 
 extern aint Llength (void *p) {
   ASSERT_BOXED(".length", p);
-  return BOX(LEN(TO_DATA(p)->data_header));
+  return BOX(obj_length(p));
 }
 
 static char *chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
@@ -243,7 +251,7 @@ extern aint LtagHash (char *s) {
 }
 
 char *de_hash (aint n) {
-  static char buf[MAX_SEXP_TAGLEN + 1] = {0, 0, 0, 0, 0, 0};
+  static __thread char buf[MAX_SEXP_TAGLEN + 1] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
   p                  = &buf[MAX_SEXP_TAGLEN];
 
@@ -257,13 +265,63 @@ char *de_hash (aint n) {
   return ++p;
 }
 
+// S-expressions store their tags in data_header as indices in the table of interned tag hashes,
+// the table belongs to the VM bound to the current thread
+#define sexp_tags (__vm->tags.hashes)
+#define sexp_tags_count (__vm->tags.count)
+#define sexp_tags_index (__vm->tags.index)
+#define sexp_tags_capacity (__vm->tags.capacity)
+
+static size_t sexp_tags_slot (aint h) {
+  size_t i = ((auint)h * 0x9E3779B97F4A7C15ULL) >> 7;
+  for (;; i++) {
+    i &= sexp_tags_capacity - 1;
+    if (sexp_tags_index[i] == 0 || sexp_tags[sexp_tags_index[i] - 1] == h) { return i; }
+  }
+}
+
+extern auint intern_sexp_tag (aint h) {
+  if (sexp_tags_capacity > 0) {
+    size_t i = sexp_tags_slot(h);
+    if (sexp_tags_index[i] != 0) { return sexp_tags_index[i] - 1; }
+  }
+
+  if (sexp_tags_count >= (((auint)1) << (sizeof(auint) * CHAR_BIT - SEXP_TAG_SHIFT)) - 1) {
+    failure("too many different s-expression tags\n");
+  }
+
+  if (2 * (sexp_tags_count + 1) > sexp_tags_capacity) {
+    sexp_tags_capacity = sexp_tags_capacity ? 2 * sexp_tags_capacity : 64;
+    sexp_tags          = (aint *)realloc(sexp_tags, sexp_tags_capacity / 2 * sizeof(aint));
+    free(sexp_tags_index);
+    sexp_tags_index = (auint *)calloc(sexp_tags_capacity, sizeof(auint));
+    if (sexp_tags == NULL || sexp_tags_index == NULL) { failure("intern_sexp_tag: out of memory\n"); }
+    for (size_t id = 0; id < sexp_tags_count; id++) {
+      sexp_tags_index[sexp_tags_slot(sexp_tags[id])] = id + 1;
+    }
+  }
+
+  sexp_tags[sexp_tags_count] = h;
+  sexp_tags_index[sexp_tags_slot(h)] = ++sexp_tags_count;
+  return sexp_tags_count - 1;
+}
+
+extern aint sexp_tag_hash (auint id) { return sexp_tags[id]; }
+
+extern aint get_sexp_tag (void *p) { return sexp_tags[SEXP_TAG_ID(TO_SEXP(p)->data_header)]; }
+
+extern void set_sexp_tag (void *p, aint h) {
+  sexp *s        = TO_SEXP(p);
+  s->data_header = (s->data_header & (SEXP_TAG_BITS(1) - 1)) | SEXP_TAG_BITS(intern_sexp_tag(h));
+}
+
 typedef struct {
   char *contents;
   aint   ptr;
   aint   len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static __thread StringBuf stringBuf;
 
 #define STRINGBUF_INIT 128
 
@@ -352,7 +410,7 @@ static void printValue (void *p) {
 
       case SEXP_TAG: {
         sexp *sa  = (sexp *)a;
-        char *tag = de_hash((aint)sa->tag);
+        char *tag = de_hash(get_sexp_tag(p));
         if (strcmp(tag, "cons") == 0) {
           sexp *sb = sa;
           printStringBuf("{");
@@ -397,7 +455,7 @@ static void stringcat (void *p) {
       case STRING_TAG: printStringBuf("%s", a->contents); break;
 
       case SEXP_TAG: {
-        char *tag = de_hash(TO_SEXP(p)->tag);
+        char *tag = de_hash(get_sexp_tag(p));
 
         if (strcmp(tag, "cons") == 0) {
           sexp *b = (sexp *)a;
@@ -595,10 +653,9 @@ aint inner_hash (aint depth, auint acc, void *p) {
       case ARRAY_TAG: i = 0; break;
 
       case SEXP_TAG: {
-        aint ta = TO_SEXP(p)->tag;
+        aint ta = get_sexp_tag(p);
         acc    = HASH_APPEND(acc, ta);
-        i      = 1;
-        ++l;
+        i      = 0;
         break;
       }
 
@@ -647,7 +704,6 @@ extern aint Lcompare (void *p, void *q) {
         aint   ta = TAG(a->data_header), tb = TAG(b->data_header);
         aint   la = LEN(a->data_header), lb = LEN(b->data_header);
         aint   i;
-        aint   shift = 0;
 
         COMPARE_AND_RETURN(ta, tb);
 
@@ -666,11 +722,10 @@ extern aint Lcompare (void *p, void *q) {
             break;
 
           case SEXP_TAG: {
-            aint tag_a = TO_SEXP(p)->tag, tag_b = TO_SEXP(q)->tag;
+            aint tag_a = get_sexp_tag(p), tag_b = get_sexp_tag(q);
             COMPARE_AND_RETURN(tag_a, tag_b);
             COMPARE_AND_RETURN(la, lb);
-            i     = 0;
-            shift = 1;
+            i = 0;
             break;
           }
 
@@ -678,7 +733,7 @@ extern aint Lcompare (void *p, void *q) {
         }
 
         for (; i < la; i++) {
-          aint c = Lcompare(((void **)a->contents)[i + shift], ((void **)b->contents)[i + shift]);
+          aint c = Lcompare(((void **)a->contents)[i], ((void **)b->contents)[i]);
           if (c != BOX(0)) return c;
         }
         return BOX(0);
@@ -847,10 +902,6 @@ extern void *Barray (aint* args, aint bn) {
   return r->contents;
 }
 
-#ifdef DEBUG_VERSION
-extern memory_chunk heap;
-#endif
-
 extern void *Bsexp (aint* args, aint bn) {
   sexp   *r;
   aint     n = UNBOX(bn);
@@ -863,14 +914,13 @@ extern void *Bsexp (aint* args, aint bn) {
     push_extra_root((void**)&args[i]);
   }
 
-  r              = alloc_sexp(fields_cnt);
-  r->tag         = 0;
+  r = alloc_sexp(fields_cnt);
 
   for (int i = 0; i < fields_cnt; i++) {
     ((auint *)r->contents)[i] = args[i];
   }
 
-  r->tag = UNBOX(args[fields_cnt]);
+  set_sexp_tag(r->contents, UNBOX(args[fields_cnt]));
 
   for (aint i = fields_cnt - 1; i >= 0; --i) {
     pop_extra_root((void**)&args[i]);
@@ -886,7 +936,7 @@ extern aint Btag (void *d, aint t, aint n) {
   if (UNBOXED(d)) return BOX(0);
   else {
     r = TO_DATA(d);
-    return (aint)BOX(TAG(r->data_header) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t)
+    return (aint)BOX(TAG(r->data_header) == SEXP_TAG && get_sexp_tag(d) == UNBOX(t)
                      && LEN(r->data_header) == UNBOX(n));
   }
 }
@@ -924,7 +974,7 @@ extern aint Bstring_patt (void *x, void *y) {
 extern aint Bclosure_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == CLOSURE_TAG);
+  return BOX(get_type_row_ptr(x) == CLOSURE);
 }
 
 extern aint Bboxed_patt (void *x) { return BOX(UNBOXED(x) ? 0 : 1); }
@@ -934,19 +984,19 @@ extern aint Bunboxed_patt (void *x) { return BOX(UNBOXED(x) ? 1 : 0); }
 extern aint Barray_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == ARRAY_TAG);
+  return BOX(get_type_row_ptr(x) == ARRAY);
 }
 
 extern aint Bstring_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == STRING_TAG);
+  return BOX(get_type_row_ptr(x) == STRING);
 }
 
 extern aint Bsexp_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == SEXP_TAG);
+  return BOX(get_type_row_ptr(x) == SEXP);
 }
 
 extern void *Bsta (void *x, aint i, void *v) {
@@ -17,5 +17,22 @@
 #define WORD_SIZE (CHAR_BIT * sizeof(ptrt))
 
 _Noreturn void failure (char *s, ...);
+// when set, receives the message of a runtime failure instead of the process being
+// terminated; it must not return (the interpreter throws an exception from it)
+extern void (*__failure_handler) (const char *msg);
+
+// s-expression tags are interned, headers keep only their indices
+typedef struct {
+  aint  *hashes;     // index -> tag hash
+  size_t count;
+  auint *index;      // open addressing hash table of (index + 1)
+  size_t capacity;   // capacity of index, power of two
+} sexp_tag_table;
+
+auint intern_sexp_tag (aint h);
+aint  sexp_tag_hash (auint id);
+// p is a pointer to the s-expression contents
+aint  get_sexp_tag (void *p);
+void  set_sexp_tag (void *p, aint h);
 
 #endif
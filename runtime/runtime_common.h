@@ -31,18 +31,24 @@ typedef uint32_t auint;  // adaptive unsigned int
 #define SEXP_TAG 0x00000005
 #define CLOSURE_TAG 0x00000007
 #define UNBOXED_TAG 0x00000009   // Not actually a data_header; used to return from LkindOf
+// s-expressions keep the index of their interned tag in the upper part of data_header,
+// so their number of fields is limited by the lower part
 #ifdef X86_64
 #define LEN_MASK (UINT64_MAX^7)
+#define SEXP_TAG_SHIFT 32
 #else
 #define LEN_MASK (UINT32_MAX^7)
+#define SEXP_TAG_SHIFT 16
 #endif
-#define LEN(x) (ptrt)(((ptrt)x & LEN_MASK) >> 3)
-#define TAG(x) (x & 7)
+#define SEXP_LEN_MASK ((((auint)1) << SEXP_TAG_SHIFT) - 8)
+#define TAG(x) ((x) & 7)
+#define SEXP_TAG_ID(x) ((auint)(x) >> SEXP_TAG_SHIFT)
+#define SEXP_TAG_BITS(id) (((auint)(id)) << SEXP_TAG_SHIFT)
 
 #ifndef DEBUG_VERSION
-#  define DATA_HEADER_SZ (sizeof(auint) + sizeof(ptrt))
+#  define DATA_HEADER_SZ (sizeof(auint))
 #else
-#  define DATA_HEADER_SZ (sizeof(auint) + sizeof(ptrt) + sizeof(auint))
+#  define DATA_HEADER_SZ (sizeof(auint) + sizeof(size_t))
 #endif
 
 #define MEMBER_SIZE sizeof(ptrt)
@@ -61,6 +67,7 @@ typedef uint32_t auint;  // adaptive unsigned int
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+// Mark bits and forwarding addresses are not stored in objects, GC keeps them in side tables
 typedef struct {
   // store tag in the last three bits to understand what structure this is, other bits are filled with
   // other utility info (i.e., size for array, number of fields for s-expression)
@@ -70,25 +77,17 @@ typedef struct {
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
-  ptrt forward_address;
   char   contents[];
 } data;
 
 typedef struct {
-  // store tag in the last three bits to understand what structure this is, other bits are filled with
-  // other utility info (i.e., size for array, number of fields for s-expression)
+  // same as for data, plus index of the interned tag starting from SEXP_TAG_SHIFT bit
   auint data_header;
 
 #ifdef DEBUG_VERSION
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
-  ptrt forward_address;
-  auint   tag;
   char   contents[];
 } sexp;
 
@@ -0,0 +1,62 @@
+// ============================================================================
+//                              VM context
+// ============================================================================
+// Everything the runtime keeps for one running program: the heap of the
+// selected collector, large object space, GC work lists and interned
+// s-expression tags (extra roots are per thread, they are empty between
+// calls into the runtime). Each thread has its own current context '__vm', so
+// independent programs can run concurrently on separate threads of one
+// process. Registers of the mutator (stack bounds and allocation region) are
+// hot, they stay in thread-local variables while the context is bound and are
+// saved in it by 'vm_bind' otherwise.
+
+#ifndef __LAMA_VM_CONTEXT__
+#define __LAMA_VM_CONTEXT__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "gc.h"
+#include "immix.h"
+#include "runtime.h"
+
+typedef struct lama_vm {
+  // mutator registers while the context is not bound
+  size_t       stack_top, stack_bottom;
+  alloc_region alloc_region;
+
+  gc_backend         backend;
+  memory_chunk       heap;
+  large_object_space los;
+  // marks of the heap chunk objects, valid only during GC cycle
+  mark_table         marks;
+  // objects to be scanned during mark phase
+  mark_stack         gray;
+  // stacks of suspended fibers, owned by the interpreter
+  stack_segment     *stack_segments;
+  size_t             stack_segments_count;
+  // set while several threads run the program
+  gc_world          *world;
+  // called after every collection with survivors_data, see gc_set_survivors_hook
+  void (*survivors_hook) (void *data);
+  void              *survivors_data;
+  immix_state        immix;
+  sexp_tag_table     tags;
+  gc_stats           stats;
+  // link in the list of live contexts, whose statistics are written at exit
+  struct lama_vm    *next;
+} lama_vm;
+
+// context bound to the current thread, created by '__init' if there is none
+// and destroyed by '__shutdown'
+extern __thread lama_vm *__vm;
+
+// makes vm (may be NULL) the context of the current thread, returns the previous one
+lama_vm *vm_bind (lama_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
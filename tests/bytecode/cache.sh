@@ -0,0 +1,19 @@
+# a stored entry is used by the next run, one that lists no frames is
+# replaced, even with a matching checksum
+rm -rf cache
+LAMA_CACHE_DIR=cache "$ROOT/interpreter" -v "$BC"
+ENTRY=$(ls cache/*.vbc)
+SIZE=$(stat -c %s "$ENTRY")
+LAMA_CACHE_DIR=cache "$ROOT/interpreter" -v "$BC"
+LAMA_CACHE_DIR=cache "$ROOT/interpreter" "$BC"
+
+# header: magic, version, reserved, key, size, then the number of frames and
+# their checksum (FNV-1a of nothing), followed by the copy of the bytecode file
+{
+    head -c 32 "$ENTRY"
+    printf '\x00\x00\x00\x00\x00\x00\x00\x00\x25\x23\x22\x84\xe4\x9c\xf2\xcb'
+    tail -c +49 "$ENTRY" | head -c "$(stat -c %s "$BC")"
+} > empty.vbc
+mv empty.vbc "$ENTRY"
+LAMA_CACHE_DIR=cache "$ROOT/interpreter" -v "$BC"
+[ "$(stat -c %s "$ENTRY")" = "$SIZE" ] && echo "entry stored again"
@@ -0,0 +1,12 @@
+# statistics are appended at exit, a collection every few allocations fails the bound
+rm -f stats.json
+LAMA_GC_STATS=stats.json "$ROOT/interpreter" "$BC"
+grep -o '"collections":[0-9]*' stats.json | cut -d: -f2 | while read -r N
+do
+    if [ "$N" -lt 2000 ]
+    then
+        echo "fewer than 2000 collections"
+    else
+        echo "$N collections"
+    fi
+done
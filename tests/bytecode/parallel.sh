@@ -0,0 +1,8 @@
+# on 4 threads whatever the number of cores, checked and verified; the
+# collections counted include those stopping the workers
+for MODE in "" -v
+do
+    rm -f stats.json
+    LAMA_THREADS=4 LAMA_GC_STATS=stats.json "$ROOT/interpreter" $MODE "$BC"
+    grep -q '"collections":[1-9]' stats.json && echo "collected"
+done
@@ -0,0 +1,5 @@
+# on 4 threads whatever the number of cores, checked and verified
+for MODE in "" -v
+do
+    LAMA_THREADS=4 "$ROOT/interpreter" $MODE "$BC"
+done
@@ -0,0 +1,32 @@
+# every report has its header lines and only lines of the documented kinds;
+# counts of executions and allocations are exact, times and survivals vary
+check() {
+    grep '^#' "$1" | grep -v '^# clock\|^# collections'
+    echo "unexpected lines: $(grep -v '^#' "$1" | grep -Evc "$2")"
+}
+
+echo 100 | "$ROOT/interpreter" -p "$BC"
+check "$BC.prof" '^(op [A-Za-z_]+|site 0x[0-9a-f]+) [0-9]+ [0-9]+( .+)?$'
+grep '^site .* SEXP' "$BC.prof" | cut -d ' ' -f 3,5-
+
+echo 100 | "$ROOT/interpreter" --heap-profile heap.prof "$BC"
+check heap.prof '^site 0x[0-9a-f]+ [0-9]+ [0-9]+ [0-9]+ [0-9]+ [0-9]+ .+$'
+grep '^site' heap.prof | cut -d ' ' -f 3,4,8-
+
+echo 100 | "$ROOT/interpreter" --ngrams ngrams.txt "$BC"
+check ngrams.txt '^(ops|instrs) [0-9]+ [0-9]+ [0-9]+ .+$'
+grep '^ops 2 .* SEXP;' ngrams.txt
+
+# folded stacks, a line per distinct stack with the number of its samples
+echo 100 | "$ROOT/interpreter" --sample sample.txt "$BC"
+echo "unexpected lines: $(grep -Evc '^[^ ;]+(;[^ ;]+)* [1-9][0-9]*$' sample.txt)"
+[ -s sample.txt ] && echo "sampled"
+
+rm -f stats.json
+echo 100 | LAMA_GC_STATS=stats.json "$ROOT/interpreter" "$BC"
+grep -q '"collections":[1-9]' stats.json && echo "collected"
+sed -e "s/\"$LAMA_GC\"/\"GC\"/" -e 's/"pauses_us":{[^}]*}/"pauses_us":{}/' -e 's/[0-9][0-9.]*/N/g' stats.json
+echo
+
+"$ROOT/analyser" -n 3 "$BC" | head -n 2
+"$ROOT/analyser" -n 3 "$BC" "$BC.prof" | head -n 2
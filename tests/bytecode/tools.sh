@@ -0,0 +1,40 @@
+# a snapshot taken at the first read resumes there with another input, the
+# output printed before it is not repeated
+for MODE in "" -v
+do
+    echo 1 | "$ROOT/interpreter" --snapshot init.snap $MODE "$BC"
+    echo 10 | "$ROOT/interpreter" --restore init.snap $MODE "$BC"
+done
+
+# the fork server runs each request on the client's descriptors, the client
+# exits with the status of the run; requests wait for the socket to listen
+SOCKET="$PWD/lama.sock"
+"$ROOT/interpreter" --fork-server "$SOCKET" "$BC" &
+SERVER=$!
+until grep -q " 00010000 .* $SOCKET$" /proc/net/unix
+do
+    sleep 0.01
+done
+echo 2 | "$ROOT/interpreter" --connect "$SOCKET"
+echo "status $?"
+echo 3 | "$ROOT/interpreter" --connect "$SOCKET"
+echo "status $?"
+kill $SERVER
+wait $SERVER 2> /dev/null
+
+# SIGUSR2 once the handler is installed (SigCgt), while the program waits to
+# read, dumps the heap at the next call; addresses differ from run to run
+rm -f input
+mkfifo input
+LAMA_HEAP_DUMP=heap.dump "$ROOT/interpreter" "$BC" < input &
+PROGRAM=$!
+exec 3> input
+until [ $(( 0x$(sed -n 's/^SigCgt:\t*//p' /proc/$PROGRAM/status) >> 11 & 1 )) = 1 ]
+do
+    sleep 0.01
+done
+kill -USR2 $PROGRAM
+echo 4 >&3
+exec 3>&-
+wait $PROGRAM
+"$ROOT/heapanalyser" heap.dump 2 | sed 's/0x[0-9a-f]*/ADDRESS/'
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <map>
+#include <string>
+#include "../commons.h"
+
+// Assembler of the bytecode tests, for instructions lamac doesn't emit (fibers,
+// parallel builtins) and for programs checked at exact offsets:
+//
+//   lasm SOURCE OUTPUT
+//
+// One instruction per line, named as `interpreter -d` prints them. Labels end
+// with a colon and stand for code offsets, quoted arguments are strings of the
+// string table, captures of CLOSURE are written as G(n), L(n), A(n) and C(n).
+// `globals N` sets the number of globals, `public NAME LABEL` exports a
+// function, the program starts at the public `main`. `;` starts a comment.
+
+struct Assembler
+{
+    std::vector<Pub> pubs;
+    std::string st;
+    std::map<std::string, int32_t> strings;
+    std::vector<char> code;
+    int32_t globals = 0;
+    std::map<std::string, int32_t> labels;
+    // code offsets waiting for the labels named there, with their source lines
+    std::vector<std::pair<int32_t, std::pair<std::string, int>>> fixups;
+    std::map<std::string, instr::Instr> opcodes;
+
+    Assembler()
+    {
+        for (int op = 0; op < 0x100; op++)
+        {
+            const char *name = instr::name(static_cast<instr::Instr>(op));
+            if (std::strcmp(name, "UNK") != 0)
+            {
+                opcodes[name] = static_cast<instr::Instr>(op);
+            }
+        }
+    }
+
+    int32_t intern(const std::string &s)
+    {
+        auto [it, inserted] = strings.try_emplace(s, st.size());
+        if (inserted)
+        {
+            st += s;
+            st += '\0';
+        }
+        return it->second;
+    }
+
+    void emit_i32(int32_t v)
+    {
+        char bytes[sizeof(v)];
+        std::memcpy(bytes, &v, sizeof(v));
+        code.insert(code.end(), bytes, bytes + sizeof(v));
+    }
+
+    // a number, a string or a label
+    void emit_arg(const std::string &arg, int line)
+    {
+        if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"')
+        {
+            emit_i32(intern(arg.substr(1, arg.size() - 2)));
+        }
+        else if (std::isdigit(static_cast<unsigned char>(arg[0])) || arg[0] == '-')
+        {
+            size_t end;
+            emit_i32(std::stol(arg, &end, 0));
+            assert(end == arg.size(), "Bad number " + arg + " at line " + std::to_string(line));
+        }
+        else
+        {
+            fixups.push_back({static_cast<int32_t>(code.size()), {arg, line}});
+            emit_i32(0);
+        }
+    }
+
+    void emit_capture(const std::string &arg, int line)
+    {
+        static const std::string kinds = "GLAC";
+        size_t kind = kinds.find(arg[0]);
+        assert(kind != std::string::npos && arg.size() > 3 && arg[1] == '(' && arg.back() == ')',
+               "Bad capture " + arg + " at line " + std::to_string(line));
+        code.push_back(static_cast<char>(kind));
+        emit_i32(std::stoi(arg.substr(2, arg.size() - 3)));
+    }
+
+    static std::vector<std::string> split(const std::string &line)
+    {
+        std::vector<std::string> words;
+        size_t i = 0;
+        while (i < line.size())
+        {
+            if (std::isspace(static_cast<unsigned char>(line[i])))
+            {
+                i++;
+                continue;
+            }
+            if (line[i] == ';')
+            {
+                break;
+            }
+            size_t end = i + 1;
+            if (line[i] == '"')
+            {
+                end = line.find('"', end);
+                assert(end != std::string::npos, "Unterminated string");
+                end++;
+            }
+            else
+            {
+                while (end < line.size() && !std::isspace(static_cast<unsigned char>(line[end])) && line[end] != ';')
+                {
+                    end++;
+                }
+            }
+            words.push_back(line.substr(i, end - i));
+            i = end;
+        }
+        return words;
+    }
+
+    void assemble_line(const std::string &text, int line)
+    {
+        std::vector<std::string> words = split(text);
+        if (words.empty())
+        {
+            return;
+        }
+        const std::string &head = words[0];
+        const std::string where = " at line " + std::to_string(line);
+        if (head.back() == ':')
+        {
+            assert(words.size() == 1, "Label must be alone" + where);
+            auto [_, inserted] = labels.try_emplace(head.substr(0, head.size() - 1), code.size());
+            assert(inserted, "Duplicate label " + head + where);
+            return;
+        }
+        if (head == "globals")
+        {
+            assert(words.size() == 2, "Expected globals N" + where);
+            globals = std::stoi(words[1]);
+            return;
+        }
+        if (head == "public")
+        {
+            assert(words.size() == 3, "Expected public NAME LABEL" + where);
+            pubs.push_back({intern(words[1]), 0});
+            fixups.push_back({-static_cast<int32_t>(pubs.size()), {words[2], line}});
+            return;
+        }
+
+        auto op = opcodes.find(head);
+        assert(op != opcodes.end(), "Unknown instruction " + head + where);
+        Instruction ins = {};
+        ins.tag = op->second;
+        size_t args = ins.get_args_length();
+        code.push_back(static_cast<char>(ins.tag));
+        if (ins.is_closure())
+        {
+            assert(words.size() >= 2, "Expected CLOSURE LABEL CAPTURES" + where);
+            emit_arg(words[1], line);
+            emit_i32(words.size() - 2);
+            for (size_t k = 2; k < words.size(); k++)
+            {
+                emit_capture(words[k], line);
+            }
+            return;
+        }
+        assert(words.size() == args + 1, head + " takes " + std::to_string(args) + " arguments" + where);
+        for (size_t k = 1; k < words.size(); k++)
+        {
+            emit_arg(words[k], line);
+        }
+    }
+
+    // pubs are fixed up at negative positions, -1 for the first one
+    void resolve()
+    {
+        for (auto &[at, ref] : fixups)
+        {
+            auto label = labels.find(ref.first);
+            assert(label != labels.end(), "Unknown label " + ref.first + " at line " + std::to_string(ref.second));
+            if (at < 0)
+            {
+                pubs[-at - 1].b = label->second;
+            }
+            else
+            {
+                std::memcpy(&code[at], &label->second, sizeof(int32_t));
+            }
+        }
+    }
+
+    void write(std::ostream &out)
+    {
+        Header header = {static_cast<int32_t>(st.size()), globals, static_cast<int32_t>(pubs.size())};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(pubs.data()), pubs.size() * sizeof(Pub));
+        out.write(st.data(), st.size());
+        out.write(code.data(), code.size());
+        // end of code, as lamac writes it
+        out.put(static_cast<char>(0xff));
+    }
+};
+
+int main(int argc, char **argv)
+try
+{
+    assert(argc == 3, "Usage: lasm SOURCE OUTPUT");
+    std::ifstream in(argv[1]);
+    assert(in.good(), std::string("Failed to read ") + argv[1]);
+
+    Assembler a;
+    std::string text;
+    for (int line = 1; std::getline(in, text); line++)
+    {
+        a.assemble_line(text, line);
+    }
+    a.resolve();
+
+    std::ofstream out(argv[2], std::ios::binary);
+    a.write(out);
+    assert(out.good(), std::string("Failed to write ") + argv[2]);
+    return 0;
+}
+catch (const VMError &e)
+{
+    std::cerr << argv[1] << ": " << e.what() << "\n";
+    return 1;
+}
@@ -12,11 +12,15 @@ do
     TEST="${SOURCE%.lama}.t1"
     if $LAMAC -b "$SOURCE"
     then
-        ../interpreter "$BC" > "$OUTPUT" < "$INPUT" 2>&1
-        cmp --silent $TEST $OUTPUT || echo "Different output for $SOURCE"
+        # every program runs on both collectors, see LAMA_GC in README.md
+        for GC in lisp2 immix
+        do
+            LAMA_GC=$GC ../interpreter "$BC" > "$OUTPUT" < "$INPUT" 2>&1
+            cmp --silent $TEST $OUTPUT || echo "Different output for $SOURCE with LAMA_GC=$GC"
+        done
     else
         echo "File $SOURCE failed to compile"
     fi
 done
 
-popd
\ No newline at end of file
+popd
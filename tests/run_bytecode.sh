@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Runs the programs of tests/bytecode, assembled by tests/lasm, with both
+# collectors: NAME.lasm with NAME.input on stdin must print NAME.t1 both checked
+# and with -v. NAME.sh, if present, runs instead of the interpreter from a
+# scratch directory, with ROOT naming the repository and BC the assembled file.
+
+ulimit -Sv 500000
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export ROOT
+
+STATUS=0
+
+pushd "$ROOT/tests/bytecode" > /dev/null
+
+for SOURCE in ./*.lasm
+do
+    NAME=$(basename "$SOURCE" .lasm)
+    BC="$WORK/$NAME.bc"
+    INPUT="$ROOT/tests/bytecode/$NAME.input"
+    SCRIPT="$ROOT/tests/bytecode/$NAME.sh"
+    TEST="$ROOT/tests/bytecode/$NAME.t1"
+    [ -f "$INPUT" ] || INPUT=/dev/null
+    if ! ../lasm "$SOURCE" "$BC"
+    then
+        echo "File $SOURCE failed to assemble"
+        STATUS=1
+        continue
+    fi
+    for GC in lisp2 immix
+    do
+        if [ -f "$SCRIPT" ]
+        then
+            MODES="script"
+        else
+            MODES="checked -v"
+        fi
+        for MODE in $MODES
+        do
+            OUTPUT="$WORK/$NAME.output"
+            case $MODE in
+            script) (cd "$WORK" && LAMA_GC=$GC BC="$BC" bash "$SCRIPT") > "$OUTPUT" < "$INPUT" 2>&1 ;;
+            checked) LAMA_GC=$GC ../../interpreter "$BC" > "$OUTPUT" < "$INPUT" 2>&1 ;;
+            *) LAMA_GC=$GC ../../interpreter $MODE "$BC" > "$OUTPUT" < "$INPUT" 2>&1 ;;
+            esac
+            if ! cmp --silent "$TEST" "$OUTPUT"
+            then
+                echo "Different output for $SOURCE ($MODE) with LAMA_GC=$GC"
+                diff "$TEST" "$OUTPUT" | head -n 10
+                STATUS=1
+            fi
+        done
+    done
+done
+
+popd > /dev/null
+
+exit $STATUS
@@ -0,0 +1,3 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test804.lama < test804.input
+  10
+  9
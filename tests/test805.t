@@ -0,0 +1,2 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test805.lama < test805.input
+  3
@@ -0,0 +1,2 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test806.lama < test806.input
+  40000
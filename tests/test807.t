@@ -0,0 +1,6 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test807.lama < test807.input
+  0
+  11
+  4
+  13
+  19
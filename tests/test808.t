@@ -0,0 +1,12 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test808.lama < test808.input
+  0
+  1
+  2
+  3
+  4
+  4
+  3
+  0
+  4
+  5
+  10
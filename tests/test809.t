@@ -0,0 +1,2 @@
+  $ ../src/Driver.exe -runtime ../runtime -I ../stdlib/x64 -i test809.lama < test809.input
+  5000050000
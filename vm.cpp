@@ -0,0 +1,4550 @@
+#include <iostream>
+#include <vector>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <signal.h>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "runtime/gc.h"
+#include "commons.h"
+#include "vm.h"
+
+extern "C" void *Lstring(aint *args);
+extern "C" aint LtagHash(char *c);
+extern "C" char *de_hash(aint n);
+extern "C" aint get_sexp_tag(void *p);
+extern "C" void set_sexp_tag(void *p, aint h);
+extern "C" auint intern_sexp_tag(aint h);
+extern "C" lama_vm *vm_bind(lama_vm *vm);
+extern "C" __thread lama_vm *__vm;
+extern "C" void (*__failure_handler)(const char *msg);
+
+[[noreturn]] void unknown_instruction(int32_t ip, long name)
+{
+    throw VMError("Unknown instruction: " + std::to_string(name), ip);
+}
+
+[[noreturn]] void not_implemented(int32_t ip, std::string name)
+{
+    throw VMError("Instruction not implemented: " + name, ip);
+}
+
+[[noreturn]] void unreachable(int32_t ip)
+{
+    throw VMError("Unreachable code executed", ip);
+}
+
+extern "C" __thread void *__gc_stack_top;
+extern "C" __thread void *__gc_stack_bottom;
+
+// Stack in a region of address space reserved up front. Pages are committed by
+// the kernel on the first touch, so only the used part costs memory, and the guard
+// page after the region turns a missed overflow check into SIGSEGV. Small stacks
+// may go without one, then neighbouring stacks share a mapping in the kernel.
+template <typename T>
+struct ReservedStack
+{
+    T *region;
+    size_t max_size;
+    size_t reserved;
+
+    explicit ReservedStack(size_t max_size_, bool guard = true) : max_size(max_size_)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t bytes = (max_size * sizeof(T) + page - 1) / page * page;
+        size_t guard_bytes = guard ? page : 0;
+        void *p = mmap(nullptr, bytes + guard_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+        assert(p != MAP_FAILED, "Failed to reserve stack");
+        if (guard && mprotect(static_cast<char *>(p) + bytes, page, PROT_NONE) != 0)
+        {
+            munmap(p, bytes + guard_bytes);
+            assert(false, "Failed to set stack guard page");
+        }
+        region = static_cast<T *>(p);
+        reserved = bytes + guard_bytes;
+    }
+
+    // empty, used to hand stacks over with swap
+    ReservedStack() : region(nullptr), max_size(0), reserved(0) {}
+
+    ReservedStack(const ReservedStack &) = delete;
+    ReservedStack &operator=(const ReservedStack &) = delete;
+
+    ~ReservedStack()
+    {
+        release();
+    }
+
+    void swap(ReservedStack &other)
+    {
+        std::swap(region, other.region);
+        std::swap(max_size, other.max_size);
+        std::swap(reserved, other.reserved);
+    }
+
+    void release()
+    {
+        if (region != nullptr)
+        {
+            munmap(region, reserved);
+        }
+        region = nullptr;
+        max_size = 0;
+        reserved = 0;
+    }
+
+    T *data() { return region; }
+    size_t capacity() const { return max_size; }
+    T &operator[](size_t i) { return region[i]; }
+};
+
+// Frame record pushed by CALL and CALLC on the value stack right after the
+// arguments, 'base' points just past it:
+//   [closure] args... | BOX(ip | fn << 31) | BOX(base << 1 | is_closure) | locals... operands...
+// where ip is the return address, fn is the offset of the caller's BEGIN and base
+// is the caller's base. Both words are boxed so the GC skips them. Number of
+// arguments and locals of the caller is read back from its BEGIN and frame (see
+// set_functions), captured values from its closure.
+const size_t FRAME_WORDS = 2;
+const size_t FRAME_IP_BITS = 31;
+
+void stringify(std::ostream &s, aint v)
+{
+    if (UNBOXED(v))
+    {
+        s << UNBOX(v);
+    }
+    else
+    {
+        switch (get_type_row_ptr(reinterpret_cast<void *>(v)))
+        {
+        case ARRAY:
+        {
+
+            auto n = obj_length(reinterpret_cast<void *>(v));
+            s << "[";
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (i > 0)
+                {
+                    s << ", ";
+                }
+
+                stringify(s, reinterpret_cast<aint *>(v)[i]);
+            }
+
+            s << "]";
+
+            break;
+        }
+
+        case CLOSURE:
+            s << "<function>";
+            break;
+
+        case STRING:
+            s << '"' << TO_DATA(v)->contents << '"';
+            break;
+
+        case SEXP:
+            s << de_hash(get_sexp_tag(reinterpret_cast<void *>(v)));
+            auto n = obj_length(reinterpret_cast<void *>(v));
+
+            if (n > 0)
+            {
+                s << " (";
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    if (i > 0)
+                    {
+                        s << ", ";
+                    }
+
+                    stringify(s, reinterpret_cast<aint *>(TO_SEXP(v)->contents)[i]);
+                }
+
+                s << ")";
+            }
+
+            break;
+        }
+    }
+}
+
+// ============================================================================
+//                              Snapshots
+// ============================================================================
+// With `--snapshot FILE` the program runs up to its first CALL_Lread, where the
+// state (stack with globals, interpreter registers and every reachable object)
+// is written to FILE before reading; `--restore FILE` resumes from this point.
+// Objects are written in discovery order and references between them are
+// replaced by ordinals, so a snapshot is independent of heap addresses and of
+// the collector. Values are boxed integers (odd) or references (even), the
+// only raw word is the code offset of a closure.
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint64_t key;   // content hash of the bytecode file
+    uint64_t ip;
+    uint64_t fn;
+    uint64_t base;
+    uint64_t args;
+    uint64_t locals;
+    uint64_t captured;
+    uint64_t is_closure;
+    uint64_t stack_size;   // in words
+    uint64_t objects;
+    uint64_t object_words;
+};
+
+const char SNAPSHOT_MAGIC[8] = {'L', 'A', 'M', 'A', 'S', 'N', 'P', '1'};
+
+// Object record: header word (sexp tag index cleared), tag hash for s-expressions, content words
+inline size_t snapshot_content_words(auint header)
+{
+    return BYTES_TO_WORDS(obj_size_header_ptr(&header) - DATA_HEADER_SZ);
+}
+
+template <typename I>
+void save_snapshot(I &it, const std::string &path, uint64_t key)
+{
+    assert(it.fibers.all.empty(), "Snapshots of programs with fibers are not supported");
+
+    std::vector<aint> words;
+    std::vector<void *> objects;
+    std::unordered_map<void *, size_t> ordinals;
+
+    auto encode = [&](aint v) -> aint
+    {
+        if (UNBOXED(v))
+        {
+            return v;
+        }
+        assert(is_valid_heap_pointer(reinterpret_cast<size_t *>(v)), "Snapshot: unexpected value on stack or in object");
+        auto [entry, inserted] = ordinals.emplace(reinterpret_cast<void *>(v), objects.size());
+        if (inserted)
+        {
+            objects.push_back(reinterpret_cast<void *>(v));
+        }
+        return static_cast<aint>(entry->second << 1);
+    };
+
+    aint *top = reinterpret_cast<aint *>(__gc_stack_top);
+    size_t stack_size = reinterpret_cast<aint *>(__gc_stack_bottom) - top;
+    for (size_t i = 0; i < stack_size; i++)
+    {
+        words.push_back(encode(top[i]));
+    }
+
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        void *obj = objects[i];
+        auint header = TO_DATA(obj)->data_header;
+        lama_type type = get_type_row_ptr(obj);
+        if (type == SEXP)
+        {
+            header &= SEXP_TAG_BITS(1) - 1;
+        }
+        words.push_back(header);
+        if (type == SEXP)
+        {
+            words.push_back(get_sexp_tag(obj));
+        }
+
+        size_t n = snapshot_content_words(header);
+        aint *content = static_cast<aint *>(obj);
+        for (size_t j = 0; j < n; j++)
+        {
+            bool raw = type == STRING || (type == CLOSURE && j == 0);
+            words.push_back(raw ? content[j] : encode(content[j]));
+        }
+    }
+
+    SnapshotHeader h;
+    std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.key = key;
+    h.ip = it.ip;
+    h.fn = it.fn;
+    h.base = it.base;
+    h.args = it.args;
+    h.locals = it.locals;
+    h.captured = it.captured;
+    h.is_closure = it.is_closure;
+    h.stack_size = stack_size;
+    h.objects = objects.size();
+    h.object_words = words.size() - stack_size;
+
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char *>(words.data()), words.size() * sizeof(aint));
+    assert(out.good(), "Failed to write snapshot " + path);
+}
+
+// Checks every record, reference and frame of a snapshot against the program
+// before anything is restored, so that a corrupted file is an error rather
+// than reads and writes out of bounds
+template <typename I>
+void check_snapshot(I &it, const SnapshotHeader &h, const aint *saved)
+{
+    const Result &result = it.result;
+    const size_t code_size = result.code_size;
+    Code code(result.code, result.code_size);
+    const aint *records = saved + h.stack_size;
+
+    auto ordinal = [](aint v) { return static_cast<size_t>(static_cast<auint>(v) >> 1); };
+    // offset of a verified BEGIN
+    auto is_function = [&](size_t offset)
+    {
+        if (offset >= code_size)
+        {
+            return false;
+        }
+        const Instruction *begin = code.get_by_id(offset);
+        return (begin->tag == instr::BEGIN || begin->tag == instr::CBEGIN) && offset + begin->size() <= code_size &&
+               begin->args[0] >= 0 && begin->args[1] >= 0 &&
+               static_cast<size_t>(begin->args[1]) < result.functions.size();
+    };
+
+    std::vector<lama_type> types(h.objects);
+    std::vector<size_t> lengths(h.objects);
+    size_t pos = 0;
+    for (size_t i = 0; i < h.objects; i++)
+    {
+        assert(pos < h.object_words, "Snapshot: object record out of bounds");
+        auint header = records[pos++];
+        lama_type type = get_type_header_ptr(&header);
+        assert(type == STRING || type == ARRAY || type == SEXP || type == CLOSURE, "Snapshot: invalid object type");
+        if (type == SEXP)
+        {
+            assert((header & ~(SEXP_TAG_BITS(1) - 1)) == 0 && pos < h.object_words, "Snapshot: invalid s-expression");
+            pos++;
+        }
+
+        size_t len = LEN(header);
+        size_t left = h.object_words - pos;
+        assert(type == STRING ? len < left * sizeof(aint) : len <= left, "Snapshot: object record out of bounds");
+        assert(type != CLOSURE || len >= 1, "Snapshot: closure without code");
+        size_t n = snapshot_content_words(header);
+        const aint *content = records + pos;
+        if (type == STRING)
+        {
+            assert(reinterpret_cast<const char *>(content)[len] == '\0', "Snapshot: string is not terminated");
+        }
+        for (size_t j = 0; type != STRING && j < n; j++)
+        {
+            if (type == CLOSURE && j == 0)
+            {
+                assert(is_function(content[0]), "Snapshot: closure outside of code");
+            }
+            else if (!UNBOXED(content[j]))
+            {
+                assert(ordinal(content[j]) < h.objects, "Snapshot: reference out of bounds");
+            }
+        }
+        types[i] = type;
+        lengths[i] = len;
+        pos += n;
+    }
+    assert(pos == h.object_words, "Snapshot: unexpected words after objects");
+
+    for (size_t i = 0; i < h.stack_size; i++)
+    {
+        assert(UNBOXED(saved[i]) || ordinal(saved[i]) < h.objects, "Snapshot: reference out of bounds");
+    }
+
+    // registers describe the frame waiting at CALL_Lread, frame records lead
+    // from it to the outermost frame, every caller waits right after a call
+    assert(h.ip < code_size && code.get_by_id(h.ip)->tag == instr::CALL_Lread, "Snapshot: invalid instruction pointer");
+    assert(h.is_closure <= 1, "Snapshot: invalid registers");
+    size_t ip = h.ip, fn = h.fn, base = h.base;
+    bool closure = h.is_closure;
+    // end of the operands of the current frame
+    size_t end = h.stack_size;
+    for (bool top = true;; top = false)
+    {
+        assert(is_function(fn), "Snapshot: frame of an invalid function");
+        const Instruction *begin = code.get_by_id(fn);
+        size_t args = begin->args[0];
+        const FunctionInfo &frame = result.functions[begin->args[1]];
+
+        const Instruction *prev = nullptr;
+        size_t at = fn;
+        while (at < ip)
+        {
+            const Instruction *cur = code.get_by_id(at);
+            assert(at == fn || (cur->tag != instr::BEGIN && cur->tag != instr::CBEGIN), "Snapshot: invalid return address");
+            prev = cur;
+            at += cur->size();
+        }
+        assert(at == ip && at < code_size &&
+                   (top || (prev != nullptr && (prev->tag == instr::CALL || prev->tag == instr::CALLC))),
+               "Snapshot: invalid return address");
+
+        size_t locals = frame.locals, depth = frame.depth;
+        assert(base >= FRAME_WORDS + args + closure && base <= end && locals <= end - base &&
+                   end - base - locals <= depth && base + locals + depth + FRAME_WORDS <= it.stack.capacity(),
+               "Snapshot: invalid frame");
+        size_t captured = 0;
+        if (closure)
+        {
+            aint c = saved[base - FRAME_WORDS - args - 1];
+            assert(!UNBOXED(c) && types[ordinal(c)] == CLOSURE, "Snapshot: frame of a closure without closure");
+            captured = lengths[ordinal(c)] - 1;
+        }
+        if (top)
+        {
+            assert(h.args == args && h.locals == locals && h.captured == captured, "Snapshot: invalid registers");
+        }
+
+        aint ret = saved[base - FRAME_WORDS], record = saved[base - FRAME_WORDS + 1];
+        assert(UNBOXED(ret) && UNBOXED(record), "Snapshot: invalid frame record");
+        auint caller = static_cast<auint>(UNBOX(ret));
+        ip = caller & ((auint(1) << FRAME_IP_BITS) - 1);
+        if (ip == 0)
+        {
+            assert(base - FRAME_WORDS >= static_cast<size_t>(result.header.globals_length), "Snapshot: no room for globals");
+            break;
+        }
+        fn = caller >> FRAME_IP_BITS;
+        end = base - FRAME_WORDS;
+        base = static_cast<auint>(UNBOX(record)) >> 1;
+        closure = UNBOX(record) & 1;
+    }
+}
+
+template <typename I>
+void restore_snapshot(I &it, const std::string &path, uint64_t key)
+{
+    MappedFile mapped(read_file(path));
+    FileView file = mapped.file;
+    SnapshotHeader h;
+    assert(file.size >= sizeof(h), "Snapshot is too small");
+    std::memcpy(&h, file.data, sizeof(h));
+    assert(std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0, "Not a snapshot");
+    assert(h.key == key, "Snapshot was taken from a different program");
+    const size_t words = (file.size - sizeof(h)) / sizeof(aint);
+    assert(h.stack_size <= words && h.object_words <= words &&
+               file.size == sizeof(h) + (h.stack_size + h.object_words) * sizeof(aint),
+           "Snapshot is truncated");
+    assert(h.stack_size <= I::STACK_MAX_SIZE && h.objects <= I::STACK_MAX_SIZE &&
+               h.stack_size + h.objects <= I::STACK_MAX_SIZE,
+           "Snapshot does not fit in stack");
+
+    const aint *saved = reinterpret_cast<const aint *>(file.data + sizeof(h));
+    check_snapshot(it, h, saved);
+    const aint *records = saved + h.stack_size;
+    aint *top = reinterpret_cast<aint *>(__gc_stack_top);
+
+    // New addresses of objects are kept right above the stack, so that they are
+    // roots and are updated if allocation of the next objects causes a collection
+    aint *table = top + h.stack_size;
+    for (size_t i = 0; i < h.stack_size; i++)
+    {
+        top[i] = UNBOXED(saved[i]) ? saved[i] : BOX(0);
+    }
+    std::fill(table, table + h.objects, BOX(0));
+    __gc_stack_bottom = table + h.objects;
+
+    const aint *r = records;
+    for (size_t i = 0; i < h.objects; i++)
+    {
+        auint header = r[0];
+        lama_type type = get_type_header_ptr(&header);
+        void *obj = get_object_content_ptr(alloc_data(type, LEN(header), obj_size_header_ptr(&header)));
+        table[i] = reinterpret_cast<aint>(obj);
+        r++;
+        if (type == SEXP)
+        {
+            set_sexp_tag(obj, *r++);
+        }
+
+        size_t n = snapshot_content_words(header);
+        aint *content = static_cast<aint *>(obj);
+        if (type == STRING)
+        {
+            std::memcpy(content, r, obj_length(obj) + 1);
+        }
+        else
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                content[j] = (UNBOXED(r[j]) || (type == CLOSURE && j == 0)) ? r[j] : BOX(0);
+            }
+        }
+        r += n;
+    }
+
+    // no allocation below, so addresses in the table are final
+    r = records;
+    for (size_t i = 0; i < h.objects; i++)
+    {
+        auint header = r[0];
+        lama_type type = get_type_header_ptr(&header);
+        r += type == SEXP ? 2 : 1;
+        size_t n = snapshot_content_words(header);
+        aint *content = reinterpret_cast<aint *>(table[i]);
+        for (size_t j = (type == CLOSURE ? 1 : 0); type != STRING && j < n; j++)
+        {
+            if (!UNBOXED(r[j]))
+            {
+                content[j] = table[r[j] >> 1];
+            }
+        }
+        r += n;
+    }
+    for (size_t i = 0; i < h.stack_size; i++)
+    {
+        if (!UNBOXED(saved[i]))
+        {
+            top[i] = table[saved[i] >> 1];
+        }
+    }
+    __gc_stack_bottom = top + h.stack_size;
+
+    it.ip = h.ip;
+    it.fn = h.fn;
+    it.base = h.base;
+    it.args = h.args;
+    it.locals = h.locals;
+    it.captured = h.captured;
+    it.is_closure = h.is_closure;
+}
+
+// ============================================================================
+//                              Fibers
+// ============================================================================
+// Cooperative green threads of one program. CALL_Bspawn takes a closure of no
+// arguments and returns the handle of a new fiber that runs it, CALL_Byield
+// passes control to the next ready fiber in round-robin order and CALL_Bjoin
+// waits until a fiber finishes and returns its result. Every fiber has its own
+// value stack with frame records, the heap and the globals (at the bottom of
+// the main fiber's stack) are shared. Stacks of suspended fibers are GC stack
+// segments. The program ends with its main fiber, other fibers don't run then.
+
+// Initial stack of a spawned fiber: 4 KiB of values and frame records, see grow_stack
+const size_t FIBER_STACK_SIZE = 512;
+// Initial stack of a pool worker: 64 KiB, grows like the stack of a fiber
+const size_t WORKER_STACK_SIZE = 8 * 1024;
+// second word of the outermost frame record of a spawned fiber (no real frame has base 0)
+const aint FIBER_ENTRY = BOX(1);
+
+struct Fiber
+{
+    // empty while the fiber runs, the interpreter owns the stack then
+    ReservedStack<aint> stack;
+
+    // registers while suspended, 'bottom' is the offset of the stack bottom
+    size_t ip, fn, base, args, locals, captured, bottom;
+    bool is_closure;
+
+    // index of the GC segment of the suspended fiber's stack (or of the result once finished)
+    size_t segment;
+
+    bool finished = false;
+    aint result = BOX(0);
+    // handle of the fiber being joined, -1 if none
+    aint joins = -1;
+
+    Fiber() = default;
+    explicit Fiber(size_t stack_size) : stack(stack_size, false) {}
+};
+
+struct Fibers
+{
+    // indexed by handles, the main fiber is 0; empty until the first spawn
+    std::vector<std::unique_ptr<Fiber>> all;
+    size_t current = 0;
+    std::deque<size_t> ready;
+
+    // registered with gc_set_stack_segments, owner of each segment
+    std::vector<stack_segment> segments;
+    std::vector<size_t> owners;
+
+    void add_segment(size_t owner, aint *begin, aint *end)
+    {
+        all[owner]->segment = segments.size();
+        segments.push_back({reinterpret_cast<size_t *>(begin), reinterpret_cast<size_t *>(end)});
+        owners.push_back(owner);
+        gc_set_stack_segments(segments.data(), segments.size());
+    }
+
+    void remove_segment(size_t owner)
+    {
+        size_t i = all[owner]->segment;
+        segments[i] = segments.back();
+        owners[i] = owners.back();
+        all[owners[i]]->segment = i;
+        segments.pop_back();
+        owners.pop_back();
+        gc_set_stack_segments(segments.data(), segments.size());
+    }
+};
+
+// Makes room for 'words' values on the running stack. Spawned fibers and pool
+// workers start with small stacks that move to twice larger ones as needed, up
+// to the size of the main stack. Registers and frame records hold offsets, so only the GC stack
+// bounds move along.
+template <typename I>
+void grow_stack(I &it, size_t words, int32_t ip)
+{
+    assert_with_ip(words <= I::STACK_MAX_SIZE, ip, "Stack overflow");
+    size_t capacity = it.stack.capacity();
+    while (capacity < words)
+    {
+        capacity = std::min(capacity * 2, I::STACK_MAX_SIZE);
+    }
+
+    size_t used = reinterpret_cast<aint *>(__gc_stack_bottom) - it.stack.data();
+    ReservedStack<aint> bigger(capacity, false);
+    std::copy(it.stack.data(), it.stack.data() + used, bigger.data());
+    it.stack.swap(bigger);
+    __gc_stack_top = it.stack.data();
+    __gc_stack_bottom = it.stack.data() + used;
+}
+
+// Suspends the running fiber and resumes the first ready one
+template <typename I>
+void fiber_switch(I &it)
+{
+    Fibers &fs = it.fibers;
+    assert(!fs.ready.empty(), "No fiber to switch to");
+    size_t next = fs.ready.front();
+    fs.ready.pop_front();
+
+    Fiber &from = *fs.all[fs.current];
+    from.ip = it.ip;
+    from.fn = it.fn;
+    from.base = it.base;
+    from.args = it.args;
+    from.locals = it.locals;
+    from.captured = it.captured;
+    from.is_closure = it.is_closure;
+    from.bottom = reinterpret_cast<aint *>(__gc_stack_bottom) - it.stack.data();
+    from.stack.swap(it.stack);
+    if (from.finished)
+    {
+        from.stack.release();
+        fs.add_segment(fs.current, &from.result, &from.result + 1);
+    }
+    else
+    {
+        fs.add_segment(fs.current, from.stack.data(), from.stack.data() + from.bottom);
+    }
+
+    Fiber &to = *fs.all[next];
+    fs.remove_segment(next);
+    it.stack.swap(to.stack);
+    it.ip = to.ip;
+    it.fn = to.fn;
+    it.base = to.base;
+    it.args = to.args;
+    it.locals = to.locals;
+    it.captured = to.captured;
+    it.is_closure = to.is_closure;
+    __gc_stack_top = it.stack.data();
+    __gc_stack_bottom = it.stack.data() + to.bottom;
+    fs.current = next;
+}
+
+template <typename I>
+void fiber_spawn(I &it)
+{
+    assert_with_ip(!it.worker && !it.in_parallel, it.ip, "Fibers are not available in parallel builtins");
+    aint closure = it.pop();
+    assert_with_ip(!UNBOXED(closure) && get_type_row_ptr(reinterpret_cast<void *>(closure)) == CLOSURE,
+                   it.ip, "Try to spawn not closure");
+
+    Fibers &fs = it.fibers;
+    if (fs.all.empty())
+    {
+        fs.all.emplace_back(new Fiber());
+    }
+
+    // the closure and the outermost frame record, as if it was called with CALLC 0
+    Fiber *f = new Fiber(FIBER_STACK_SIZE);
+    f->stack[0] = closure;
+    f->stack[1] = BOX(0);
+    f->stack[2] = FIBER_ENTRY;
+    f->ip = reinterpret_cast<aint *>(closure)[0];
+    f->fn = f->ip;
+    f->base = 1 + FRAME_WORDS;
+    f->args = 0;
+    f->locals = 0;
+    f->captured = obj_length(reinterpret_cast<void *>(closure)) - 1;
+    f->is_closure = true;
+    f->bottom = f->base;
+
+    size_t handle = fs.all.size();
+    fs.all.emplace_back(f);
+    fs.add_segment(handle, f->stack.data(), f->stack.data() + f->bottom);
+    fs.ready.push_back(handle);
+    it.push(BOX(handle));
+}
+
+template <typename I>
+void fiber_yield(I &it)
+{
+    assert_with_ip(!it.worker && !it.in_parallel, it.ip, "Fibers are not available in parallel builtins");
+    Fibers &fs = it.fibers;
+    it.push(BOX(0));
+    if (!fs.ready.empty())
+    {
+        fs.ready.push_back(fs.current);
+        fiber_switch(it);
+    }
+}
+
+template <typename I>
+void fiber_join(I &it)
+{
+    assert_with_ip(!it.worker && !it.in_parallel, it.ip, "Fibers are not available in parallel builtins");
+    Fibers &fs = it.fibers;
+    aint handle = it.pop();
+    assert_with_ip(UNBOXED(handle) && UNBOX(handle) >= 0 && static_cast<size_t>(UNBOX(handle)) < fs.all.size(),
+                   it.ip, "Not a fiber");
+
+    Fiber &target = *fs.all[UNBOX(handle)];
+    if (target.finished)
+    {
+        fs.all[fs.current]->joins = -1;
+        it.push(target.result);
+        return;
+    }
+
+    for (aint f = UNBOX(handle); f >= 0; f = fs.all[f]->joins)
+    {
+        assert_with_ip(static_cast<size_t>(f) != fs.current, it.ip, "Fibers wait for each other");
+    }
+
+    // the join runs again when this fiber gets its turn
+    fs.all[fs.current]->joins = UNBOX(handle);
+    it.push(handle);
+    it.ip -= 1;
+    fs.ready.push_back(fs.current);
+    fiber_switch(it);
+}
+
+// Called at the outermost END with the result on the stack, returns false
+// unless the frame is the entry of a spawned fiber
+template <typename I>
+bool fiber_finish(I &it)
+{
+    Fibers &fs = it.fibers;
+    if (it.stack[it.base - FRAME_WORDS + 1] != FIBER_ENTRY)
+    {
+        return false;
+    }
+
+    Fiber &f = *fs.all[fs.current];
+    f.result = it.pop();
+    f.finished = true;
+    fiber_switch(it);
+    return true;
+}
+
+// Calls a function (or a closure if 'closure' is set) as the outermost frame on
+// top of the current stack of 'it', registers and the stack bottom are restored
+// afterwards, also on errors
+template <typename I>
+aint call_outermost(I &it, int32_t entry, const aint *closure, const aint *args, size_t n)
+{
+    // offsets, the stack of a fiber may move while the function runs
+    const size_t start = reinterpret_cast<aint *>(__gc_stack_bottom) - it.stack.data();
+    const size_t slot = closure != nullptr ? 1 : 0;
+    const size_t base = start + slot + n + FRAME_WORDS;
+    if (base + FRAME_WORDS >= it.stack.capacity())
+    {
+        grow_stack(it, base + FRAME_WORDS + 1, -1);
+    }
+    aint *top = it.stack.data();
+
+    const size_t saved[] = {it.ip, it.fn, it.base, it.args, it.locals, it.captured, it.is_closure};
+    auto restore_registers = [&]
+    {
+        it.ip = saved[0];
+        it.fn = saved[1];
+        it.base = saved[2];
+        it.args = saved[3];
+        it.locals = saved[4];
+        it.captured = saved[5];
+        it.is_closure = saved[6];
+        __gc_stack_bottom = it.stack.data() + start;
+    };
+
+    if (closure != nullptr)
+    {
+        top[start] = *closure;
+    }
+    std::copy(args, args + n, top + start + slot);
+    // return address 0 stops the interpreter at the END of the function
+    top[base - FRAME_WORDS] = BOX(0);
+    top[base - FRAME_WORDS + 1] = BOX(0);
+
+    it.ip = entry;
+    it.fn = entry;
+    it.base = base;
+    it.args = n;
+    it.locals = 0;
+    it.captured = closure != nullptr ? obj_length(reinterpret_cast<void *>(*closure)) - 1 : 0;
+    it.is_closure = closure != nullptr;
+    __gc_stack_bottom = top + base;
+
+    try
+    {
+        it.interpret();
+    }
+    catch (...)
+    {
+        restore_registers();
+        throw;
+    }
+
+    aint result = it.stack[start];
+    restore_registers();
+    return result;
+}
+
+template <typename I>
+aint call_closure(I &it, aint closure, const aint *args, size_t n)
+{
+    return call_outermost(it, reinterpret_cast<aint *>(closure)[0], &closure, args, n);
+}
+
+// ============================================================================
+//                              Parallel builtins
+// ============================================================================
+// CALL_Bpmap (array, f) returns a new array of f applied to every element,
+// CALL_Bpfilter (array, p) returns a new array of the elements for which p
+// returns a non-zero integer, CALL_Bpfold (array, init, f) combines the
+// elements with f, which has to be associative: chunks of the array are
+// folded on their own, then their results are folded into init in order.
+// Chunks are spread over a work-stealing pool of LAMA_THREADS threads (the
+// number of cores by default), the calling thread included. Every worker runs
+// its own interpreter with a separate stack on the shared heap, see "Parallel
+// mutators" in gc.h. Closures must not use fibers, parallel builtins called
+// from them run sequentially.
+
+// Operation in progress. Arguments and the result stay on the stack of the
+// calling interpreter, so values are read from there after every call that
+// may collect garbage.
+struct ParallelJob
+{
+    instr::Instr op;
+    aint *array;
+    aint *closure;
+    // for map and filter element-wise results, for fold a result per chunk
+    aint *result;
+    size_t grain;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    aint element(size_t i) const { return reinterpret_cast<aint *>(*array)[i]; }
+    aint &result_at(size_t i) { return reinterpret_cast<aint *>(*result)[i]; }
+};
+
+// Runs a chunk of the job on the interpreter of the current thread
+template <typename I>
+void parallel_chunk(I &it, ParallelJob &job, size_t chunk, size_t end)
+{
+    size_t begin = chunk * job.grain;
+    for (size_t i = begin; i < end && !job.failed.load(std::memory_order_relaxed); i++)
+    {
+        switch (job.op)
+        {
+        case instr::CALL_Bpmap:
+        {
+            aint x = job.element(i);
+            aint v = call_closure(it, *job.closure, &x, 1);
+            job.result_at(i) = v;
+            break;
+        }
+        case instr::CALL_Bpfilter:
+        {
+            aint x = job.element(i);
+            aint v = call_closure(it, *job.closure, &x, 1);
+            assert(UNBOXED(v), "Filter predicate returned not an integer");
+            job.result_at(i) = BOX(UNBOX(v) != 0);
+            break;
+        }
+        default:
+        {
+            if (i == begin)
+            {
+                job.result_at(chunk) = job.element(i);
+                break;
+            }
+            aint xs[] = {job.result_at(chunk), job.element(i)};
+            aint v = call_closure(it, *job.closure, xs, 2);
+            job.result_at(chunk) = v;
+            break;
+        }
+        }
+    }
+}
+
+template <typename I>
+struct WorkerPool
+{
+    struct Worker
+    {
+        // null for the calling thread, which uses its own interpreter
+        std::unique_ptr<I> it;
+        // chunk indices, the owner takes from the back, thieves from the front
+        std::deque<size_t> chunks;
+        std::mutex lock;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    ParallelJob *job = nullptr;
+    lama_vm *context = nullptr;
+    size_t size = 0;
+    size_t generation = 0;
+    size_t busy = 0;
+    bool quit = false;
+
+    WorkerPool(I &owner, size_t threads)
+    {
+        // s-expression tags are interned up front, the table must not grow while workers read it
+        for (int32_t ip = 0; ip < owner.result.code_size;)
+        {
+            auto *cur = reinterpret_cast<Instruction *>(owner.result.code + ip);
+            if (ip + static_cast<int32_t>(cur->size()) > owner.result.code_size)
+            {
+                break;
+            }
+            if (cur->tag == instr::SEXP)
+            {
+                intern_sexp_tag(UNBOX(LtagHash(owner.result.st + cur->args[0])));
+            }
+            ip += cur->size();
+        }
+
+        // all interpreters are made before any thread starts, the pool runs with
+        // the workers it could get, down to the calling thread alone
+        workers.emplace_back(new Worker());
+        for (size_t k = 1; k < threads; k++)
+        {
+            std::unique_ptr<Worker> w(new Worker());
+            try
+            {
+                w->it.reset(new I(owner.result, owner.globals));
+            }
+            catch (const VMError &)
+            {
+                break;
+            }
+            catch (const std::bad_alloc &)
+            {
+                break;
+            }
+            workers.push_back(std::move(w));
+        }
+        for (size_t k = 1; k < workers.size(); k++)
+        {
+            try
+            {
+                workers[k]->thread = std::thread([this, k, &it = *workers[k]->it] { worker_loop(k, it); });
+            }
+            catch (const std::system_error &)
+            {
+                // started workers wait for a job and don't look at the others
+                workers.resize(k);
+                break;
+            }
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t k = 1; k < workers.size(); k++)
+        {
+            workers[k]->thread.join();
+        }
+    }
+
+    bool take(size_t self, size_t &chunk)
+    {
+        for (size_t d = 0; d < workers.size(); d++)
+        {
+            Worker &w = *workers[(self + d) % workers.size()];
+            std::lock_guard<std::mutex> guard(w.lock);
+            if (!w.chunks.empty())
+            {
+                if (d == 0)
+                {
+                    chunk = w.chunks.back();
+                    w.chunks.pop_back();
+                }
+                else
+                {
+                    chunk = w.chunks.front();
+                    w.chunks.pop_front();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run_chunks(I &it, size_t self)
+    {
+        try
+        {
+            size_t chunk;
+            while (!job->failed.load(std::memory_order_relaxed) && take(self, chunk))
+            {
+                parallel_chunk(it, *job, chunk, std::min((chunk + 1) * job->grain, size));
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(job->error_lock);
+            if (!job->failed.exchange(true))
+            {
+                job->error = std::current_exception();
+            }
+        }
+    }
+
+    void worker_loop(size_t k, I &it)
+    {
+        // samples are taken on the thread running the program
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGPROF);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+        size_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return quit || generation != seen; });
+                if (quit)
+                {
+                    return;
+                }
+                seen = generation;
+            }
+
+            gc_world_join(context);
+            __gc_stack_top = it.stack.data();
+            __gc_stack_bottom = it.stack.data();
+            run_chunks(it, k);
+            gc_world_leave();
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (--busy == 0)
+            {
+                done.notify_all();
+            }
+        }
+    }
+
+    // Runs all chunks of the job, the calling thread takes part in it
+    void run(I &owner, ParallelJob &job_, size_t n)
+    {
+        size_t chunks = (n + job_.grain - 1) / job_.grain;
+        for (size_t c = 0; c < chunks; c++)
+        {
+            workers[c % workers.size()]->chunks.push_back(c);
+        }
+
+        context = __vm;
+        gc_world_start();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job = &job_;
+            size = n;
+            busy = workers.size() - 1;
+            generation++;
+        }
+        wake.notify_all();
+
+        run_chunks(owner, 0);
+
+        gc_blocking_begin();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            done.wait(guard, [&] { return busy == 0; });
+        }
+        gc_blocking_end();
+        gc_world_finish();
+
+        // chunks left after a failure
+        for (auto &w : workers)
+        {
+            w->chunks.clear();
+        }
+    }
+};
+
+inline size_t parallel_threads()
+{
+    const char *threads = getenv("LAMA_THREADS");
+    if (threads != nullptr && atoi(threads) > 0)
+    {
+        return atoi(threads);
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+template <typename I>
+void parallel_builtin(I &it, instr::Instr op)
+{
+    // the job points into the stack, which must not move
+    if (it.stack.capacity() < I::STACK_MAX_SIZE)
+    {
+        grow_stack(it, I::STACK_MAX_SIZE, it.ip);
+    }
+    const size_t nargs = op == instr::CALL_Bpfold ? 3 : 2;
+    aint *args = reinterpret_cast<aint *>(__gc_stack_bottom) - nargs;
+    assert_with_ip(!UNBOXED(args[0]) && get_type_row_ptr(reinterpret_cast<void *>(args[0])) == ARRAY, it.ip, "Not an array");
+    assert_with_ip(!UNBOXED(args[nargs - 1]) && get_type_row_ptr(reinterpret_cast<void *>(args[nargs - 1])) == CLOSURE,
+                   it.ip, "Try to call not closure");
+
+    const size_t n = obj_length(reinterpret_cast<void *>(args[0]));
+    bool parallel = !it.worker && !it.in_parallel && n > 1 && parallel_threads() > 1;
+    if (parallel && it.pool == nullptr)
+    {
+        it.pool.reset(new WorkerPool<I>(it, parallel_threads()));
+    }
+    // without workers the calling thread runs the job alone
+    parallel = parallel && it.pool->workers.size() > 1;
+    const size_t threads = parallel ? it.pool->workers.size() : 1;
+
+    ParallelJob job;
+    job.op = op;
+    job.grain = std::max<size_t>(1, n / (threads * 8));
+    if (!parallel)
+    {
+        job.grain = std::max<size_t>(1, n);
+    }
+    const size_t chunks = n == 0 ? 0 : (n + job.grain - 1) / job.grain;
+
+    // the result slot is right above the arguments
+    assert_with_ip(static_cast<size_t>(reinterpret_cast<aint *>(__gc_stack_bottom) - it.stack.data()) + 1 < it.stack.capacity(),
+                   it.ip, "Stack overflow");
+    it.push(reinterpret_cast<aint>(get_object_content_ptr(alloc_array(op == instr::CALL_Bpfold ? chunks : n))));
+    job.array = &args[0];
+    job.closure = &args[nargs - 1];
+    job.result = &args[nargs];
+
+    if (parallel)
+    {
+        it.in_parallel = true;
+        it.pool->run(it, job, n);
+        it.in_parallel = false;
+        if (job.error)
+        {
+            std::rethrow_exception(job.error);
+        }
+    }
+    else if (chunks > 0)
+    {
+        parallel_chunk(it, job, 0, n);
+    }
+
+    aint result;
+    switch (op)
+    {
+    case instr::CALL_Bpmap:
+        result = *job.result;
+        break;
+    case instr::CALL_Bpfilter:
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            kept += job.result_at(i) == BOX(1);
+        }
+        aint filtered = reinterpret_cast<aint>(get_object_content_ptr(alloc_array(kept)));
+        for (size_t i = 0, j = 0; i < n; i++)
+        {
+            if (job.result_at(i) == BOX(1))
+            {
+                reinterpret_cast<aint *>(filtered)[j++] = job.element(i);
+            }
+        }
+        result = filtered;
+        break;
+    }
+    default:
+        // the accumulator is kept in the slot of init
+        for (size_t c = 0; c < chunks; c++)
+        {
+            aint xs[] = {args[1], job.result_at(c)};
+            aint v = call_closure(it, *job.closure, xs, 2);
+            args[1] = v;
+        }
+        result = args[1];
+        break;
+    }
+
+    __gc_stack_bottom = args;
+    it.push(result);
+}
+
+// ============================================================================
+//                              Profiler
+// ============================================================================
+// `interpreter -p` counts executions of every instruction site and the time
+// spent in it: from its start to the start of the next executed instruction,
+// so builtins and the runtime are charged to the instruction calling them.
+// Time is measured in time stamp counter ticks (nanoseconds where there is no
+// TSC). The report lists totals per opcode, then every executed site;
+// `analyser BYTECODE PROFILE` joins it with the static listing. Only the
+// thread running the program is profiled, not workers of parallel builtins.
+
+inline uint64_t profile_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+struct Profile
+{
+    // per code offset of an instruction
+    std::vector<uint64_t> counts, cycles;
+    size_t last_ip = 0;
+    uint64_t last_clock;
+
+    explicit Profile(int32_t code_size) : counts(code_size), cycles(code_size), last_clock(profile_clock()) {}
+
+    // called before the instruction at 'ip' is executed
+    void tick(size_t ip)
+    {
+        uint64_t now = profile_clock();
+        cycles[last_ip] += now - last_clock;
+        counts[ip]++;
+        last_ip = ip;
+        last_clock = now;
+    }
+
+    void write(std::ostream &out, const Result &result, const LineTable &lines) const
+    {
+        uint64_t op_counts[256] = {}, op_cycles[256] = {};
+        for (size_t ip = 0; ip < counts.size(); ip++)
+        {
+            uint8_t op = result.code[ip];
+            op_counts[op] += counts[ip];
+            op_cycles[op] += cycles[ip];
+        }
+
+        std::vector<int> ops;
+        for (int op = 0; op < 256; op++)
+        {
+            if (op_counts[op] > 0)
+            {
+                ops.push_back(op);
+            }
+        }
+        std::sort(ops.begin(), ops.end(), [&](int a, int b) { return op_cycles[a] > op_cycles[b]; });
+
+#if defined(__x86_64__) || defined(__i386__)
+        out << "# clock tsc\n";
+#else
+        out << "# clock ns\n";
+#endif
+        out << "# op NAME EXECUTIONS CYCLES\n";
+        for (int op : ops)
+        {
+            out << "op " << instr::name(static_cast<instr::Instr>(op)) << " " << op_counts[op] << " " << op_cycles[op] << "\n";
+        }
+        out << "# site IP EXECUTIONS CYCLES INSTRUCTION\n";
+        for (size_t ip = 0; ip < counts.size(); ip++)
+        {
+            if (counts[ip] > 0)
+            {
+                out << "site 0x" << std::hex << lines.origin(ip) << std::dec << " " << counts[ip] << " " << cycles[ip]
+                    << " " << *reinterpret_cast<Instruction *>(result.code + ip) << "\n";
+            }
+        }
+
+        if (lines.entries.empty())
+        {
+            return;
+        }
+        // instructions executed on every source line and time spent in them
+        std::map<int32_t, std::pair<uint64_t, uint64_t>> by_line;
+        for (size_t ip = 0; ip < counts.size(); ip++)
+        {
+            int32_t line = lines.line(ip);
+            if (counts[ip] > 0 && line > 0)
+            {
+                by_line[line].first += counts[ip];
+                by_line[line].second += cycles[ip];
+            }
+        }
+        out << "# line LINE EXECUTIONS CYCLES\n";
+        for (auto &[line, stat] : by_line)
+        {
+            out << "line " << line << " " << stat.first << " " << stat.second << "\n";
+        }
+    }
+};
+
+// ============================================================================
+//                              N-gram profiler
+// ============================================================================
+// `--ngrams FILE` counts executed sequences of 2 to NGRAM_MAX_N instructions
+// within basic blocks, the candidates for superinstructions. A block starts at
+// a function entry and at a jump target, and ends after a jump, a call, a
+// return and a builtin that switches fibers or runs closures. Instructions of
+// a block run one after another, so a sequence is known by its last
+// instruction and length, and counting it is an increment in an array. The
+// report merges sequences of equal instructions, with and without operands,
+// in hash tables and ranks them by executions.
+
+const size_t NGRAM_MAX_N = 4;
+
+struct NGramProfile
+{
+    enum : uint8_t
+    {
+        LEADER = 1,
+        ENDS_BLOCK = 2
+    };
+
+    // counts[n - 2][ip]: executions of the n instructions ending with the one at ip
+    std::vector<uint64_t> counts[NGRAM_MAX_N - 1];
+    std::vector<uint8_t> flags;
+    // offset of the previous instruction in the code
+    std::vector<int32_t> previous;
+    // instructions of the current block executed so far
+    size_t run = 0;
+
+    explicit NGramProfile(const Result &result) : flags(result.code_size), previous(result.code_size, -1)
+    {
+        for (auto &c : counts)
+        {
+            c.assign(result.code_size, 0);
+        }
+
+        const int32_t size = result.code_size;
+        int32_t last = -1;
+        for (int32_t ip = 0; ip < size;)
+        {
+            auto *cur = reinterpret_cast<const Instruction *>(result.code + ip);
+            size_t fixed = sizeof(char) + sizeof(int32_t) * cur->get_args_length();
+            if (ip + fixed > static_cast<size_t>(size) ||
+                (cur->is_closure() && (cur->args[1] < 0 || ip + cur->size() > static_cast<size_t>(size))))
+            {
+                break;
+            }
+            previous[ip] = last;
+            switch (cur->tag)
+            {
+            case instr::JMP:
+            case instr::CJMPZ:
+            case instr::CJMPNZ:
+                if (cur->args[0] >= 0 && cur->args[0] < size)
+                {
+                    flags[cur->args[0]] |= LEADER;
+                }
+                flags[ip] |= ENDS_BLOCK;
+                break;
+            case instr::BEGIN:
+            case instr::CBEGIN:
+                flags[ip] |= LEADER;
+                break;
+            case instr::CALL:
+            case instr::CALLC:
+            case instr::END:
+            case instr::RET:
+            case instr::FAIL:
+            case instr::CALL_Bspawn:
+            case instr::CALL_Byield:
+            case instr::CALL_Bjoin:
+            case instr::CALL_Bpmap:
+            case instr::CALL_Bpfold:
+            case instr::CALL_Bpfilter:
+                flags[ip] |= ENDS_BLOCK;
+                break;
+            default:
+                break;
+            }
+            last = ip;
+            ip += cur->size();
+        }
+    }
+
+    // called before the instruction at 'ip' is executed
+    void tick(size_t ip)
+    {
+        if (flags[ip] & LEADER)
+        {
+            run = 0;
+        }
+        for (size_t n = 2; n <= run + 1 && n <= NGRAM_MAX_N; n++)
+        {
+            counts[n - 2][ip]++;
+        }
+        run = flags[ip] & ENDS_BLOCK ? 0 : run + 1;
+    }
+
+    void write(std::ostream &out, const Result &result) const
+    {
+        struct Pattern
+        {
+            size_t n;
+            size_t start;
+            uint64_t executions = 0;
+            size_t sites = 0;
+        };
+        std::unordered_map<std::string, Pattern> by_instrs, by_ops;
+        auto add = [](Pattern &p, size_t n, size_t start, uint64_t executions)
+        {
+            p.n = n;
+            p.start = p.sites == 0 ? start : p.start;
+            p.executions += executions;
+            p.sites++;
+        };
+        auto next = [&](size_t ip) { return ip + reinterpret_cast<const Instruction *>(result.code + ip)->size(); };
+
+        for (size_t n = 2; n <= NGRAM_MAX_N; n++)
+        {
+            for (size_t ip = 0; ip < counts[n - 2].size(); ip++)
+            {
+                uint64_t executions = counts[n - 2][ip];
+                if (executions == 0)
+                {
+                    continue;
+                }
+                size_t start = ip;
+                for (size_t k = 1; k < n; k++)
+                {
+                    start = previous[start];
+                }
+                std::string ops;
+                for (size_t i = start; i <= ip; i = next(i))
+                {
+                    ops += result.code[i];
+                }
+                add(by_instrs[std::string(result.code + start, result.code + next(ip))], n, start, executions);
+                add(by_ops[ops], n, start, executions);
+            }
+        }
+
+        auto ranked = [](const std::unordered_map<std::string, Pattern> &patterns)
+        {
+            std::vector<Pattern> r;
+            for (auto &[key, p] : patterns)
+            {
+                r.push_back(p);
+            }
+            std::sort(r.begin(), r.end(), [](const Pattern &a, const Pattern &b)
+                      { return a.executions != b.executions ? a.executions > b.executions : a.n > b.n; });
+            return r;
+        };
+
+        out << "# ops N EXECUTIONS SITES OPCODES\n";
+        for (const Pattern &p : ranked(by_ops))
+        {
+            out << "ops " << p.n << " " << p.executions << " " << p.sites << " ";
+            for (size_t i = 0, ip = p.start; i < p.n; i++, ip = next(ip))
+            {
+                out << (i > 0 ? ";" : "") << instr::name(static_cast<instr::Instr>(result.code[ip]));
+            }
+            out << "\n";
+        }
+        out << "# instrs N EXECUTIONS SITES INSTRUCTIONS\n";
+        for (const Pattern &p : ranked(by_instrs))
+        {
+            out << "instrs " << p.n << " " << p.executions << " " << p.sites << " ";
+            for (size_t i = 0, ip = p.start; i < p.n; i++, ip = next(ip))
+            {
+                out << (i > 0 ? "; " : "") << *reinterpret_cast<Instruction *>(result.code + ip);
+            }
+            out << "\n";
+        }
+    }
+};
+
+// ============================================================================
+//                              Sampling profiler
+// ============================================================================
+// `--sample FILE` runs the program under a SIGPROF interval timer. The signal
+// handler records the offsets of the functions on the Lama call stack, read
+// from the registers and the frame records, into a buffer allocated up front;
+// when the run is over the stacks are written in the folded format of
+// flamegraph tools ("main;f;g COUNT"), functions are named after public
+// symbols or by the offset of their BEGIN. The handler may see a frame half
+// pushed, so every word it reads is checked against the bounds of the stack
+// and of the code. Samples that don't fit in the buffer are counted as
+// "[dropped]".
+
+const long SAMPLE_INTERVAL_US = 1000;
+// frames closer to the root are cut off
+const size_t SAMPLE_MAX_DEPTH = 128;
+// offsets of functions and stack depths, 16 MiB
+const size_t SAMPLE_BUFFER_SIZE = 4 * 1024 * 1024;
+
+struct Sampler
+{
+    // every sample is its depth followed by offsets of functions, the innermost first
+    std::vector<int32_t> buffer;
+    size_t used = 0;
+    size_t dropped = 0;
+    // interpreter being sampled and the walker for its type
+    void *owner;
+    void (*walk)(void *owner, Sampler &sampler);
+
+    Sampler(void *owner_, void (*walk_)(void *, Sampler &)) : buffer(SAMPLE_BUFFER_SIZE), owner(owner_), walk(walk_) {}
+
+    void write(std::ostream &out, const Result &result, const LineTable &lines) const
+    {
+        std::unordered_map<int32_t, std::string> names;
+        for (int32_t i = 0; i < result.header.pubs_length; i++)
+        {
+            names[result.pubs[i].b] = result.st + result.pubs[i].a;
+        }
+        auto name = [&](int32_t fn)
+        {
+            auto it = names.find(fn);
+            if (it != names.end())
+            {
+                return it->second;
+            }
+            std::ostringstream s;
+            s << "0x" << std::hex << lines.origin(fn);
+            return s.str();
+        };
+
+        std::map<std::string, uint64_t> stacks;
+        for (size_t i = 0; i < used; i += buffer[i] + 1)
+        {
+            std::string stack;
+            for (int32_t k = buffer[i]; k > 0; k--)
+            {
+                stack += name(buffer[i + k]);
+                stack += k > 1 ? ";" : "";
+            }
+            stacks[stack]++;
+        }
+        for (auto &[stack, count] : stacks)
+        {
+            out << stack << " " << count << "\n";
+        }
+        if (dropped > 0)
+        {
+            out << "[dropped] " << dropped << "\n";
+        }
+    }
+};
+
+template <typename I>
+void sample_stack(void *owner, Sampler &s)
+{
+    I &it = *static_cast<I *>(owner);
+    if (s.used + 1 + SAMPLE_MAX_DEPTH > s.buffer.size())
+    {
+        s.dropped++;
+        return;
+    }
+
+    const aint *stack = it.stack.data();
+    const size_t capacity = it.stack.capacity();
+    const size_t code_size = it.result.code_size;
+    int32_t *out = &s.buffer[s.used + 1];
+    size_t depth = 0;
+    size_t fn = it.fn;
+    size_t base = it.base;
+    while (depth < SAMPLE_MAX_DEPTH && fn < code_size)
+    {
+        out[depth++] = fn;
+        if (stack == nullptr || base < FRAME_WORDS || base > capacity)
+        {
+            break;
+        }
+        aint ret = UNBOX(stack[base - FRAME_WORDS]);
+        if ((ret & ((aint(1) << FRAME_IP_BITS) - 1)) == 0)
+        {
+            // the outermost frame
+            break;
+        }
+        fn = ret >> FRAME_IP_BITS;
+        base = UNBOX(stack[base - FRAME_WORDS + 1]) >> 1;
+    }
+    s.buffer[s.used] = depth;
+    s.used += depth + 1;
+}
+
+// glibc before 2.35 names the target thread of a timer only by the union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// only one program is sampled at a time
+static std::atomic<Sampler *> active_sampler{nullptr};
+// The timer counts CPU time of the thread running the program and signals only
+// that thread: other threads of an embedding host don't block SIGPROF, and a
+// sample taken on one of them would race with the interpreter moving its stack
+static std::atomic<pid_t> sampled_thread{0};
+static timer_t sample_timer;
+
+static void sigprof_handler(int)
+{
+    Sampler *s = active_sampler.load(std::memory_order_relaxed);
+    if (s != nullptr && sampled_thread.load(std::memory_order_relaxed) == static_cast<pid_t>(syscall(SYS_gettid)))
+    {
+        s->walk(s->owner, *s);
+    }
+}
+
+// Arms the timer for the sampler on the calling thread, returns the sampler
+// that is already active instead if there is one
+static Sampler *set_sampler(Sampler *sampler)
+{
+    Sampler *prev = nullptr;
+    if (!active_sampler.compare_exchange_strong(prev, sampler))
+    {
+        return prev;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = sigprof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+
+    sampled_thread = syscall(SYS_gettid);
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = sampled_thread;
+    itimerspec timer = {};
+    timer.it_interval.tv_nsec = SAMPLE_INTERVAL_US * 1000;
+    timer.it_value.tv_nsec = SAMPLE_INTERVAL_US * 1000;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sample_timer) != 0)
+    {
+        sampled_thread = 0;
+        active_sampler = nullptr;
+        assert(false, "Failed to create the sampling timer");
+    }
+    timer_settime(sample_timer, 0, &timer, nullptr);
+    return nullptr;
+}
+
+// Stops the timer of the sampler if it is the active one
+static void reset_sampler(Sampler *sampler)
+{
+    if (active_sampler.load() != sampler)
+    {
+        return;
+    }
+    timer_delete(sample_timer);
+    sampled_thread = 0;
+    active_sampler = nullptr;
+}
+
+// ============================================================================
+//                              Allocation profiler
+// ============================================================================
+// `--heap-profile FILE` tags every object made by SEXP, CALL_Barray, CLOSURE,
+// STRING and CALL_Lstring with the instruction that made it. Tagged objects
+// are kept in a side table keyed by their address; the survivors hook of the
+// runtime moves the table through every collection and drops the objects
+// that died, counting the ones that survived. The report lists allocations,
+// bytes and survivals per site, sorted by bytes; objects not collected by the
+// end of the run are counted as live. Like the profiler, it sees
+// only the thread running the program, not workers of parallel builtins.
+
+struct AllocationProfile
+{
+    struct Site
+    {
+        uint64_t allocations = 0, bytes = 0;
+        // objects that survived at least one collection, collections survived by all of them
+        uint64_t survived = 0, survivals = 0;
+    };
+    struct Tracked
+    {
+        int32_t site;
+        uint32_t age;
+    };
+
+    // per code offset of an instruction
+    std::vector<Site> sites;
+    std::unordered_map<void *, Tracked> objects;
+    uint64_t collections = 0;
+
+    explicit AllocationProfile(int32_t code_size) : sites(code_size) {}
+
+    void record(size_t site, void *obj)
+    {
+        sites[site].allocations++;
+        sites[site].bytes += obj_size_row_ptr(obj);
+        objects[obj] = Tracked{static_cast<int32_t>(site), 0};
+    }
+
+    // survivors hook, see gc.h
+    static void survivors(void *data)
+    {
+        AllocationProfile &p = *static_cast<AllocationProfile *>(data);
+        std::unordered_map<void *, Tracked> moved;
+        moved.reserve(p.objects.size());
+        for (auto &[obj, tracked] : p.objects)
+        {
+            void *to = gc_forward(obj);
+            if (to == nullptr)
+            {
+                continue;
+            }
+            Site &site = p.sites[tracked.site];
+            site.survived += tracked.age == 0 ? 1 : 0;
+            site.survivals++;
+            moved[to] = Tracked{tracked.site, tracked.age + 1};
+        }
+        p.objects.swap(moved);
+        p.collections++;
+    }
+
+    void write(std::ostream &out, const Result &result, const LineTable &lines) const
+    {
+        std::vector<uint64_t> live(sites.size());
+        for (auto &[obj, tracked] : objects)
+        {
+            live[tracked.site]++;
+        }
+
+        std::vector<size_t> order;
+        for (size_t ip = 0; ip < sites.size(); ip++)
+        {
+            if (sites[ip].allocations > 0)
+            {
+                order.push_back(ip);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sites[a].bytes > sites[b].bytes; });
+
+        out << "# collections " << collections << "\n";
+        out << "# site IP ALLOCATIONS BYTES SURVIVED SURVIVALS LIVE INSTRUCTION\n";
+        for (size_t ip : order)
+        {
+            const Site &site = sites[ip];
+            out << "site 0x" << std::hex << lines.origin(ip) << std::dec << " " << site.allocations << " " << site.bytes
+                << " " << site.survived << " " << site.survivals << " " << live[ip] << " "
+                << *reinterpret_cast<Instruction *>(result.code + ip) << "\n";
+        }
+    }
+};
+
+struct Interpreter
+{
+    // Reserved, not committed: 64 MiB of values and frame records
+    static constexpr size_t STACK_MAX_SIZE = 8 * 1024 * 1024;
+
+    Result result;
+    ReservedStack<aint> stack{STACK_MAX_SIZE};
+    // at the bottom of the main fiber's stack
+    aint *globals;
+    Fibers fibers;
+    // set on interpreters of pool workers, they share the runtime of the owner
+    bool worker = false;
+    // set while a parallel builtin runs
+    bool in_parallel = false;
+    std::unique_ptr<WorkerPool<Interpreter>> pool;
+    // set by `-p`
+    Profile *profile = nullptr;
+    // set by `--heap-profile`
+    AllocationProfile *allocations = nullptr;
+    // set by `--ngrams`
+    NGramProfile *ngrams = nullptr;
+
+    size_t ip;
+    size_t fn;
+    size_t base;
+    size_t args;
+    size_t locals;
+    size_t captured;
+    bool is_closure;
+
+    // taken at the first CALL_Lread when set
+    std::string snapshot;
+    uint64_t program_key = 0;
+
+    int32_t get_code_size()
+    {
+        return result.code_size;
+    }
+
+    int32_t read_i32()
+    {
+        assert(get_code_size() >= ip + sizeof(int32_t), "Unexpected file end while reading instruction arg");
+
+        int32_t res;
+        std::memcpy(&res, &result.code[ip], sizeof(int32_t));
+        ip += 4;
+        return res;
+    }
+
+    int32_t code_i32(size_t offset)
+    {
+        int32_t res;
+        std::memcpy(&res, &result.code[offset], sizeof(int32_t));
+        return res;
+    }
+
+    // Pushes the frame record of the current function before a call
+    void push_frame()
+    {
+        push(BOX(ip | fn << FRAME_IP_BITS));
+        push(BOX(base << 1 | (is_closure ? 1 : 0)));
+    }
+
+    // Restores the caller from the frame record below 'base', returns false for the outermost frame
+    bool pop_frame()
+    {
+        aint ret = UNBOX(stack[base - FRAME_WORDS]);
+        aint saved = UNBOX(stack[base - FRAME_WORDS + 1]);
+
+        ip = ret & ((aint(1) << FRAME_IP_BITS) - 1);
+        if (ip == 0)
+        {
+            return false;
+        }
+
+        fn = ret >> FRAME_IP_BITS;
+        base = saved >> 1;
+        is_closure = saved & 1;
+        args = code_i32(fn + 1);
+        locals = result.functions[code_i32(fn + 1 + sizeof(int32_t))].locals;
+        captured = is_closure ? obj_length(reinterpret_cast<void *>(stack[base - FRAME_WORDS - args - 1])) - 1 : 0;
+        return true;
+    }
+
+    aint pop()
+    {
+        assert_with_ip(__gc_stack_bottom != __gc_stack_top, ip, "Failed to pop value: stack empty");
+        __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_bottom) - 1;
+        return *reinterpret_cast<aint *>(__gc_stack_bottom);
+    }
+
+    // Headroom is checked once at BEGIN against the depth computed by the verifier
+    void push(aint v)
+    {
+        *reinterpret_cast<aint *>(__gc_stack_bottom) = v;
+        __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_bottom) + 1;
+    }
+
+    int interpret()
+    {
+        bool profiled = profile != nullptr || allocations != nullptr || ngrams != nullptr;
+        return profiled ? dispatch<true>() : dispatch<false>();
+    }
+
+    // Records the object on top of the stack made by the instruction at 'site'
+    template <bool PROFILE>
+    void allocated(size_t site)
+    {
+        if constexpr (PROFILE)
+        {
+            if (allocations != nullptr)
+            {
+                allocations->record(site, *reinterpret_cast<void **>(reinterpret_cast<aint *>(__gc_stack_bottom) - 1));
+            }
+        }
+    }
+
+    // the profiling loop is a separate instance, so that the usual one doesn't check for it
+    template <bool PROFILE>
+    int dispatch()
+    {
+        auto code = result.code;
+
+        while (true)
+        {
+            assert(ip < get_code_size() && ip >= 0, "Tried to read instruction outside of bytecode");
+            if constexpr (PROFILE)
+            {
+                if (profile != nullptr)
+                {
+                    profile->tick(ip);
+                }
+                if (ngrams != nullptr)
+                {
+                    ngrams->tick(ip);
+                }
+            }
+            char instr = code[ip];
+            ip++;
+            switch (instr)
+            {
+            case instr::ADD:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) + UNBOX(rhs)));
+                break;
+            }
+            case instr::SUB:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) - UNBOX(rhs)));
+                break;
+            }
+            case instr::MUL:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) * UNBOX(rhs)));
+                break;
+            }
+            case instr::DIV:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                assert_with_ip(UNBOX(rhs) != 0, ip, "Division by zero");
+                push(BOX(UNBOX(lhs) / UNBOX(rhs)));
+                break;
+            }
+            case instr::REM:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                assert_with_ip(UNBOX(rhs) != 0, ip, "Remainder zero");
+                push(BOX(UNBOX(lhs) % UNBOX(rhs)));
+                break;
+            }
+            case instr::LSS:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) < UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::LEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) <= UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::GRE:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) > UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::GEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) >= UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::EQU:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                push(BOX(lhs == rhs ? 1 : 0));
+                break;
+            }
+            case instr::NEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::AND:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != 0 && UNBOX(rhs) != 0) ? 1 : 0));
+                break;
+            }
+            case instr::OR:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != 0 || UNBOX(rhs) != 0) ? 1 : 0));
+                break;
+            }
+            case instr::CONST:
+            {
+                auto v = read_i32();
+                push(BOX(v));
+                break;
+            }
+            case instr::STRING:
+            {
+                size_t site = ip - 1;
+                auto v = read_i32();
+                assert_with_ip(v < result.header.st_length, ip, "String index out of table");
+                std::string_view sv = &result.st[v];
+                void *v_ = get_object_content_ptr(alloc_string(sv.length()));
+                push(reinterpret_cast<aint>(v_));
+                strcpy(TO_DATA(v_)->contents, sv.data());
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::SEXP:
+            {
+                size_t site = ip - 1;
+                int32_t s = read_i32();
+                int32_t n = read_i32();
+                assert_with_ip(s < result.header.st_length, ip, "String index out of table");
+                char *tag = &result.st[s];
+                auto *v = get_object_content_ptr(alloc_sexp(n));
+
+                set_sexp_tag(v, UNBOX(LtagHash(tag)));
+
+                for (int32_t i = n - 1; i >= 0; i--)
+                {
+                    auto vv = pop();
+                    auto sexp_ = TO_SEXP(v);
+                    reinterpret_cast<auint *>(sexp_->contents)[i] = vv;
+                }
+
+                push(reinterpret_cast<aint>(v));
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::STI:
+            {
+                not_implemented(ip, "STI");
+            }
+            case instr::STA:
+            {
+                auto v = pop();
+                auto idx_v = pop();
+                auto agg = pop();
+
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+                assert_with_ip(UNBOXED(idx_v), ip, "Index not integer");
+
+                auto idx = UNBOX(idx_v);
+                auto agg_ = TO_DATA(agg);
+                aint len = static_cast<aint>(obj_length(reinterpret_cast<void *>(agg)));
+                assert_with_ip(idx >= 0 && idx < len, ip, "Index outside of range");
+                switch (tag)
+                {
+                case ARRAY:
+                case SEXP:
+                    reinterpret_cast<aint *>(agg_->contents)[idx] = v;
+                    break;
+                case STRING:
+                    assert_with_ip(UNBOXED(v) && v >= 0 && v <= 0xff, ip, "Can't assign value to string");
+                    agg_->contents[idx] = UNBOX(v);
+                    break;
+                default:
+                    unreachable(ip);
+                }
+                push(v);
+                break;
+            }
+            case instr::JMP:
+            {
+                int32_t offset = read_i32();
+                if (__gc_stop_requested)
+                {
+                    gc_safepoint();
+                }
+                assert_with_ip(offset >= 0 && offset < get_code_size(), ip, "Tried to jump outside of code");
+                ip = offset;
+                break;
+            }
+            case instr::END:
+            case instr::RET:
+            {
+                aint v = pop();
+                size_t bottom = base - FRAME_WORDS - args - (is_closure ? 1 : 0);
+                bool outermost = !pop_frame();
+
+                __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_top) + bottom;
+                push(v);
+
+                if (outermost && !fiber_finish(*this))
+                {
+                    return 0;
+                }
+
+                break;
+            }
+            case instr::DROP:
+            {
+                pop();
+                break;
+            }
+            case instr::DUP:
+            {
+                aint v = pop();
+                push(v);
+                push(v);
+
+                break;
+            }
+            case instr::SWAP:
+            {
+                aint top = pop();
+                aint second = pop();
+
+                push(top);
+                push(second);
+
+                break;
+            }
+            case instr::ELEM:
+            {
+                aint idx_v = pop();
+                aint agg = pop();
+
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+                assert_with_ip(UNBOXED(idx_v), ip, "Index not integer");
+
+                auto idx = UNBOX(idx_v);
+                auto agg_ = TO_DATA(agg);
+                aint len = static_cast<aint>(obj_length(reinterpret_cast<void *>(agg)));
+                if (idx < 0 || idx >= len)
+                {
+                    throw VMError("Index outside of range");
+                }
+                switch (tag)
+                {
+                case ARRAY:
+                    push(reinterpret_cast<aint *>(agg_->contents)[idx]);
+                    break;
+                case STRING:
+                    push(BOX(agg_->contents[idx]));
+                    break;
+                case SEXP:
+                {
+                    auto sexp_ = TO_SEXP(agg);
+                    push(reinterpret_cast<auint *>(sexp_->contents)[idx]);
+                    break;
+                }
+                default:
+                    unreachable(ip);
+                }
+
+                break;
+            }
+            case instr::LDG:
+            {
+                auto g = read_i32();
+                assert_with_ip(g >= 0 && g < result.header.globals_length, ip, "Tried to get invalid global");
+                push(globals[g]);
+
+                break;
+            }
+            case instr::LDL:
+            {
+                auto l = read_i32();
+                assert_with_ip(l >= 0 && l < locals, ip, "Tried to get invalid local");
+                push(stack[base + l]);
+                break;
+            }
+            case instr::LDA:
+            {
+                auto a = read_i32();
+                assert_with_ip(a >= 0 && a < args, ip, "Tried to get invalid arg");
+                push(stack[base - FRAME_WORDS - args + a]);
+
+                break;
+            }
+            case instr::LDC:
+            {
+                auto c = read_i32();
+                assert_with_ip(is_closure, ip, "Tried to captured variable in non closure context");
+                auto cc = stack[base - FRAME_WORDS - args - 1];
+                assert_with_ip(c >= 0 && c < captured, ip, "Tried to get invalid captured");
+                auto cc_ = (aint *)cc;
+                push(cc_[c + 1]);
+                break;
+            }
+
+            case instr::LDGR:
+            {
+                not_implemented(ip, "LDGR");
+            }
+            case instr::LDLR:
+            {
+                not_implemented(ip, "LDLR");
+            }
+            case instr::LDAR:
+            {
+                not_implemented(ip, "LDAR");
+            }
+            case instr::LDCR:
+            {
+                not_implemented(ip, "LDCR");
+            }
+            case instr::STG:
+            {
+                auto g = read_i32();
+                auto v = pop();
+
+                assert_with_ip(g >= 0 && g < result.header.globals_length, ip, "Tried to get invalid global");
+                globals[g] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STL:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                assert_with_ip(l >= 0 && l < locals, ip, "Tried to get invalid local");
+                stack[base + l] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STA_:
+            {
+                auto a = read_i32();
+                auto v = pop();
+
+                assert_with_ip(a >= 0 && a < args, ip, "Tried to get invalid argument");
+                stack[base - FRAME_WORDS - args + a] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STC:
+            {
+                auto c = read_i32();
+                assert_with_ip(is_closure, ip, "Tried to get captured variable in non closure context");
+                auto cc = stack[base - FRAME_WORDS - args - 1];
+                assert_with_ip(c >= 0 && c < captured, ip, "Tried to get invalid captured");
+                auto cc_ = (aint *)cc;
+                auto v = pop();
+
+                cc_[c + 1] = v;
+                push(v);
+
+                break;
+            }
+            case instr::CJMPZ:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                if (UNBOX(v) == 0)
+                {
+                    assert_with_ip(l >= 0 && l < get_code_size(), ip, "Tried to jump outside of code");
+                    ip = l;
+                }
+
+                break;
+            }
+            case instr::CJMPNZ:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                if (UNBOX(v) != 0)
+                {
+                    assert_with_ip(l >= 0 && l < get_code_size(), ip, "Tried to jump outside of code");
+                    ip = l;
+                }
+
+                break;
+            }
+            case instr::BEGIN:
+            case instr::CBEGIN:
+            {
+                if (__gc_stop_requested)
+                {
+                    gc_safepoint();
+                }
+
+                auto a = read_i32();
+                auto index = static_cast<uint32_t>(read_i32());
+                assert_with_ip(index < result.functions.size(), ip, "Function has no frame");
+                auto &frame = result.functions[index];
+                auto m = frame.depth;
+                auto locs = frame.locals;
+
+                assert_with_ip(static_cast<size_t>(a) == args, ip, "Wrong number of arguments");
+
+                locals = locs;
+
+                // room for the frame record of a call made at the maximum depth as well
+                if (base + locs + m + FRAME_WORDS > stack.capacity())
+                {
+                    grow_stack(*this, base + locs + m + FRAME_WORDS, ip);
+                }
+
+                for (int32_t i = 0; i < locs; i++)
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::CLOSURE:
+            {
+                size_t site = ip - 1;
+                auto l = read_i32();
+                auto n = read_i32();
+                auto *closure = get_object_content_ptr(alloc_closure(n + 1));
+                push(reinterpret_cast<aint>(closure));
+                static_cast<aint *>(closure)[0] = l;
+
+                assert_with_ip(l >= 0 && l < get_code_size(), ip, "Try to create closure outside of code");
+
+                for (int32_t i = 0; i < n; ++i)
+                {
+                    auto kind = static_cast<char>(code[this->ip]);
+                    ip++;
+                    auto m = read_i32();
+
+                    switch (kind)
+                    {
+                    case 0:
+                        static_cast<aint *>(closure)[i + 1] = globals[m];
+                        break;
+
+                    case 1:
+                        static_cast<aint *>(closure)[i + 1] = stack[base + m];
+                        break;
+
+                    case 2:
+                        static_cast<aint *>(closure)[i + 1] = stack[base - FRAME_WORDS - args + m];
+                        break;
+
+                    case 3:
+                        static_cast<aint *>(closure)[i + 1] = ((aint *)stack[base - FRAME_WORDS - args - 1])[m + 1];
+                        break;
+
+                    default:
+                        throw VMError("Not implemented");
+                    }
+                }
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALLC:
+            {
+                auto n = read_i32();
+                auto closure = *(reinterpret_cast<aint *>(__gc_stack_bottom) - n - 1);
+
+                assert_with_ip(!UNBOXED(closure) && get_type_row_ptr(reinterpret_cast<void *>(closure)) == CLOSURE,
+                               ip, "Try to call not closure");
+
+                push_frame();
+
+                ip = reinterpret_cast<aint *>(closure)[0];
+                fn = ip;
+                is_closure = true;
+                base = reinterpret_cast<aint *>(__gc_stack_bottom) - reinterpret_cast<aint *>(__gc_stack_top);
+                args = n;
+                locals = 0;
+                captured = obj_length(reinterpret_cast<void *>(closure)) - 1;
+
+                break;
+            }
+            case instr::CALL:
+            {
+                auto l = read_i32();
+                auto n = read_i32();
+
+                push_frame();
+
+                ip = l;
+                fn = l;
+                is_closure = false;
+                base = reinterpret_cast<aint *>(__gc_stack_bottom) - reinterpret_cast<aint *>(__gc_stack_top);
+                args = n;
+                captured = 0;
+                locals = 0;
+
+                break;
+            }
+            case instr::TAG:
+            {
+                auto s = read_i32();
+                auto n = read_i32();
+                auto v = pop();
+
+                assert_with_ip(s < result.header.st_length, ip, "String index out of table");
+                char *exp = &result.st[s];
+                aint exp_ = UNBOX(LtagHash(exp));
+
+                if (!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == SEXP)
+                {
+                    auto sexp_ = TO_SEXP(v);
+                    auto tag = get_sexp_tag(reinterpret_cast<void *>(v));
+
+                    push((LEN(sexp_->data_header) == n && exp_ == tag) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::ARRAY:
+            {
+                auto n = read_i32();
+                auto v = pop();
+
+                if (!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == ARRAY)
+                {
+                    auto data_ = TO_DATA(v);
+                    push((LEN(data_->data_header) == n) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::FAIL:
+            {
+                auto ln = read_i32();
+                auto col = read_i32();
+                pop();
+
+                throw VMError("Match failure at " + std::to_string(ln) + ":" + std::to_string(col));
+            }
+            case instr::LINE:
+            {
+                read_i32();
+                break;
+            }
+            case instr::PATT_eq:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+
+                if (!UNBOXED(lhs) && get_type_row_ptr(reinterpret_cast<void *>(lhs)) == STRING &&
+                    !UNBOXED(rhs) && get_type_row_ptr(reinterpret_cast<void *>(rhs)) == STRING)
+                {
+                    push((strcmp(TO_DATA(lhs)->contents, TO_DATA(rhs)->contents) == 0) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::PATT_is_string:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == STRING)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_array:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == ARRAY)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_sexp:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == SEXP)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_ref:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v))
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_val:
+            {
+                auto v = pop();
+
+                push((UNBOXED(v))
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_fun:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == CLOSURE)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::CALL_Lread:
+            {
+                if (!snapshot.empty())
+                {
+                    ip--;
+                    save_snapshot(*this, snapshot, program_key);
+                    ip++;
+                    snapshot.clear();
+                }
+
+                aint v = 0;
+                std::cout << " > " << std::flush;
+                std::cin >> v;
+
+                push(BOX(v));
+
+                break;
+            }
+            case instr::CALL_Lwrite:
+            {
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                std::cout << UNBOX(v) << "\n";
+
+                push(BOX(0));
+
+                break;
+            }
+            case instr::CALL_Llength:
+            {
+                auto agg = pop();
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+
+                push(BOX(obj_length(reinterpret_cast<void *>(agg))));
+                break;
+            }
+            case instr::CALL_Lstring:
+            {
+                size_t site = ip - 1;
+                auto v = pop();
+
+                push(reinterpret_cast<aint>(Lstring(&v)));
+
+                // std::ostringstream s_;
+                // stringify(s_, v);
+
+                // std::string s = s_.str();
+                // auto *r = get_object_content_ptr(alloc_string(s.size()));
+
+                // push(reinterpret_cast<aint>(r));
+                // strcpy(TO_DATA(r)->contents, s.data());
+
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALL_Barray:
+            {
+                size_t site = ip - 1;
+                auto n = read_i32();
+                auto *v = get_object_content_ptr(alloc_array(n));
+
+                for (int32_t i = n - 1; i >= 0; i--)
+                {
+                    static_cast<aint *>(v)[i] = pop();
+                }
+
+                push(reinterpret_cast<aint>(v));
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALL_Bspawn:
+            {
+                fiber_spawn(*this);
+                break;
+            }
+            case instr::CALL_Byield:
+            {
+                fiber_yield(*this);
+                break;
+            }
+            case instr::CALL_Bjoin:
+            {
+                fiber_join(*this);
+                break;
+            }
+            case instr::CALL_Bpmap:
+            case instr::CALL_Bpfold:
+            case instr::CALL_Bpfilter:
+            {
+                parallel_builtin(*this, static_cast<instr::Instr>(instr));
+                break;
+            }
+
+            default:
+                assert(false, "Unsupported instruction");
+                break;
+            }
+        }
+        return 0;
+    }
+
+    Interpreter(Result result_)
+    {
+        // Globals + dummy main arguments + outermost frame record
+        const size_t base_ = result_.header.globals_length + 2 + FRAME_WORDS;
+
+        result = result_;
+        std::fill(stack.data(), stack.data() + base_, BOX(0));
+        ip = 0;
+        fn = 0;
+        base = base_;
+        args = 2;
+        is_closure = false;
+
+        globals = stack.data();
+        __gc_stack_top = stack.data();
+        __gc_stack_bottom = stack.data() + base_;
+
+        __init();
+    }
+
+    // Interpreter of a pool worker: shares the program, the globals and the runtime of its owner
+    Interpreter(const Result &result_, aint *globals_) : stack(WORKER_STACK_SIZE, false)
+    {
+        result = result_;
+        globals = globals_;
+        worker = true;
+        ip = 0;
+        fn = 0;
+        base = 0;
+        args = 0;
+        locals = 0;
+        captured = 0;
+        is_closure = false;
+    }
+
+    ~Interpreter()
+    {
+        pool.reset();
+        if (!worker)
+        {
+            __shutdown();
+        }
+    }
+};
+
+struct Block
+{
+    uint32_t offset_start;
+    uint32_t offset_end;
+
+    uint32_t get_start()
+    {
+        return offset_start >> 1;
+    }
+
+    void set_start(uint32_t start)
+    {
+        offset_start = start << 1 | (offset_start & 1);
+    }
+
+    uint32_t get_end()
+    {
+        return offset_end >> 1;
+    }
+
+    void set_end(uint32_t end)
+    {
+        offset_end = end << 1 | (offset_end & 1);
+    }
+
+    bool get_reachable()
+    {
+        return (offset_start & 1U) == 1;
+    }
+
+    void set_reachable(bool reachable)
+    {
+        if (reachable)
+        {
+            offset_start |= 1U;
+        }
+        else
+        {
+            offset_start &= ~1U;
+        }
+    }
+
+    bool get_visited()
+    {
+        return (offset_end & 1U) == 1;
+    }
+
+    void set_visited(bool visited)
+    {
+        if (visited)
+        {
+            offset_end |= 1U;
+        }
+        else
+        {
+            offset_end &= ~1U;
+        }
+    }
+
+    Block(uint32_t start = 0, uint32_t end = 0)
+        : offset_start(start << 1), offset_end(end << 1) {}
+};
+
+// Replaces the number of locals in the BEGIN of every function with the index of its frame
+void set_functions(Result &result, std::vector<FunctionInfo> functions)
+{
+    Code code(result.code, result.code_size);
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        int32_t offset = functions[i].offset;
+        assert(offset >= 0 && offset < result.code_size, "Frame of a function outside of code");
+        Instruction *begin = code.get_by_id(offset);
+        assert(begin->tag == instr::BEGIN || begin->tag == instr::CBEGIN, "Frame of a function without BEGIN");
+        begin->args[1] = i;
+    }
+    result.functions = std::move(functions);
+}
+
+// Part of the key of cached frames, to be bumped with every change of what the
+// verifier accepts or of the frames it finds
+const uint32_t VERIFIER_VERSION = 1;
+
+struct Verifier
+{
+    Result &res;
+    Code code;
+    // frames of the functions found, in the order of discovery, to be set with set_functions
+    std::vector<FunctionInfo> functions;
+
+    Verifier(Result &res_) : res(res_), code(res.code, res.code_size) {}
+
+    void verify()
+    {
+        struct State
+        {
+            int32_t cur_id;
+            int32_t cur_stack_size;
+            Instruction *cur_header;
+            // index in 'functions', set by the BEGIN every function starts with
+            int32_t function;
+        };
+
+        std::unordered_map<int32_t, int32_t> function_index;
+        int32_t function = -1;
+
+        std::vector<int32_t> stack_sizes;
+        stack_sizes.resize(code.code_size, -1);
+
+        Instruction *cur_header;
+        int32_t cur_stack_size = 0;
+
+        std::string entry_point = "main";
+        Instruction *cur = nullptr;
+        for (int32_t i = 0; i < res.header.pubs_length; i++) {
+            if (entry_point == res.st + res.pubs[i].a) {
+                cur = code.get_by_id(res.pubs[i].b);
+                break;
+            }
+        }
+        assert(cur != nullptr, "Can't find entry point");
+        assert(cur->tag == instr::BEGIN || cur->tag == instr::CBEGIN, "Entry point is not a function");
+
+        std::vector<State> stack;
+        stack_sizes[code.to_id(cur)] = 0;
+        stack.push_back({
+            .cur_id = code.to_id(cur),
+            .cur_stack_size = 0,
+            .cur_header = cur,
+            .function = -1,
+        });
+
+        // other public functions may be called through LamaVM::call
+        for (int32_t i = 0; i < res.header.pubs_length; i++)
+        {
+            auto l = res.pubs[i].b;
+            if (l < 0 || l >= code.code_size || stack_sizes[l] >= 0)
+            {
+                continue;
+            }
+            auto header = code.get_by_id(l);
+            if (header->tag == instr::BEGIN || header->tag == instr::CBEGIN)
+            {
+                stack_sizes[l] = 0;
+                stack.push_back({
+                    .cur_id = l,
+                    .cur_stack_size = 0,
+                    .cur_header = header,
+                    .function = -1,
+                });
+            }
+        }
+
+        for (; stack.size() != 0;)
+        {
+            auto cur = code.get_by_id(stack.back().cur_id);
+            cur_stack_size = stack.back().cur_stack_size;
+            cur_header = stack.back().cur_header;
+            function = stack.back().function;
+            stack.pop_back();
+            while (cur != nullptr)
+            {
+                auto cur_id = code.to_id(cur);
+                assert_with_ip(stack_sizes[cur_id] < 0 || cur_stack_size == stack_sizes[cur_id] || cur->tag == instr::END || cur->tag == instr::RET, cur_id, "Stack sizes don't match");
+                stack_sizes[cur_id] = cur_stack_size;
+
+                assert_with_ip(cur_stack_size >= cur->get_popped(), cur_id, "Insufficient stack size for operation");
+                cur_stack_size += cur->get_diff();
+
+                if (cur->tag == instr::BEGIN || cur->tag == instr::CBEGIN)
+                {
+                    auto [it, added] = function_index.try_emplace(cur_id, functions.size());
+                    if (added)
+                    {
+                        functions.push_back({cur_id, cur->args[1], 0});
+                    }
+                    cur_header = cur;
+                    function = it->second;
+                }
+                assert_with_ip(function >= 0, cur_id, "Function doesn't start with BEGIN");
+                auto locs = cur_header->args[1];
+                functions[function].depth = std::max(functions[function].depth, cur_stack_size);
+
+                auto check_next_jump = [&](int32_t l)
+                {
+                    assert_with_ip(l >= 0 && l <= code.code_size, cur_id, "Tried to jump outside of function block");
+                    if (stack_sizes[l] >= 0)
+                    {
+                        auto then = code.get_by_id(l);
+                        assert_with_ip(stack_sizes[l] == cur_stack_size || then->tag == instr::END || then->tag == instr::RET, cur_id, "Stack sizes don't match");
+                        cur = nullptr;
+                    }
+                    else
+                    {
+                        stack_sizes[l] = cur_stack_size;
+                        cur = code.get_by_id(l);
+                    }
+                };
+
+                auto check_push_jump = [&](int32_t l)
+                {
+                    assert_with_ip(l >= 0 && l <= code.code_size, cur_id, "Tried to jump outside of function block");
+                    if (stack_sizes[l] >= 0)
+                    {
+                        auto then = code.get_by_id(l);
+                        assert_with_ip(stack_sizes[l] == cur_stack_size || then->tag == instr::END || then->tag == instr::RET, cur_id, "Stack sizes don't match");
+                    }
+                    else
+                    {
+                        stack_sizes[l] = cur_stack_size;
+                        stack.push_back({
+                            .cur_id = l,
+                            .cur_stack_size = cur_stack_size,
+                            .cur_header = cur_header,
+                            .function = function,
+                        });
+                    }
+                };
+
+                auto check_push_call = [&](int32_t l)
+                {
+                    assert_with_ip(l >= 0 && l < code.code_size, cur_id, "Tried to call function outside of code");
+                    auto header = code.get_by_id(l);
+                    assert_with_ip(header->tag == instr::BEGIN || header->tag == instr::CBEGIN, cur_id, "Tried to call not a function");
+                    if (stack_sizes[l] < 0) {
+                        stack_sizes[l] = 0;
+                        stack.push_back({
+                            .cur_id = l,
+                            .cur_stack_size = 0,
+                            .cur_header = header,
+                            .function = -1,
+                        });
+                    }
+                };
+
+                auto check_access = [&](Instruction::CArg::CArgType typ, int32_t a)
+                {
+                    switch (typ)
+                    {
+                    case Instruction::CArg::G:
+                        assert_with_ip(a >= 0 && a < res.header.globals_length, cur_id, "Trying to access invalid global");
+                        return;
+                    case Instruction::CArg::L:
+                        assert_with_ip(a >= 0 && a < locs, cur_id, "Trying to access invalid local");
+                        return;
+                    case Instruction::CArg::A:
+                        assert_with_ip(a >= 0 && a < cur_header->args[0], cur_id, "Trying to access invalid argument");
+                        return;
+                    case Instruction::CArg::C:
+                        // NOTE: We can't check closure args _now_
+                        return;
+                    }
+                };
+
+                // NOTE: Not very reliable, but almost all instructions _now_ require their arguments be non-negative
+                if (cur->tag != instr::CONST)
+                {
+                    for (int32_t i = 0; i < cur->get_args_length(); i++)
+                    {
+                        assert_with_ip(cur->args[i] >= 0, cur_id, "Argument should be positive");
+                    }
+                }
+
+                switch (cur->tag)
+                {
+                case instr::BEGIN:
+                case instr::CBEGIN:
+                    cur_stack_size = 0;
+                    break;
+                case instr::JMP:
+                    check_next_jump(cur->args[0]);
+                    // Skip default next iter
+                    continue;
+                case instr::END:
+                case instr::RET:
+                case instr::FAIL:
+                    cur = nullptr;
+                    continue;
+                case instr::CALL:
+                    check_push_call(cur->args[0]);
+                    break;
+                case instr::CJMPZ:
+                case instr::CJMPNZ:
+                    check_push_jump(cur->args[0]);
+                    break;
+                case instr::CLOSURE:
+                    check_push_call(cur->args[0]);
+                    for (int32_t i = 0; i < cur->args[1]; i++)
+                    {
+                        check_access(cur->cargs[i].tag, cur->cargs[i].arg);
+                    }
+                    break;
+                case instr::LDG:
+                case instr::STG:
+                    check_access(Instruction::CArg::CArgType::G, cur->args[0]);
+                    break;
+                case instr::LDL:
+                case instr::STL:
+                    check_access(Instruction::CArg::CArgType::L, cur->args[0]);
+                    break;
+                case instr::LDA:
+                case instr::STA_:
+                    check_access(Instruction::CArg::CArgType::A, cur->args[0]);
+                    break;
+                case instr::LDC:
+                case instr::STC:
+                    check_access(Instruction::CArg::CArgType::C, cur->args[0]);
+                    break;
+                case instr::SEXP:
+                case instr::TAG:
+                    assert_with_ip(cur->args[0] >= 0 && cur->args[0] < res.header.st_length, cur_id, "String index outside of range");
+                    break;
+                default:
+                    break;
+                }
+                cur = code.get_next(cur);
+
+                if (cur != nullptr) {
+                    cur_id = code.to_id(cur);
+                    assert_with_ip(stack_sizes[cur_id] < 0 || cur_stack_size == stack_sizes[cur_id] || cur->tag == instr::END || cur->tag == instr::RET, cur_id, "Stack sizes don't match");
+                    if (stack_sizes[cur_id] >= 0)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+};
+
+struct Interpreter2
+{
+    // Reserved, not committed: 64 MiB of values and frame records
+    static constexpr size_t STACK_MAX_SIZE = 8 * 1024 * 1024;
+
+    Result result;
+    ReservedStack<aint> stack{STACK_MAX_SIZE};
+    // at the bottom of the main fiber's stack
+    aint *globals;
+    Fibers fibers;
+    // set on interpreters of pool workers, they share the runtime of the owner
+    bool worker = false;
+    // set while a parallel builtin runs
+    bool in_parallel = false;
+    std::unique_ptr<WorkerPool<Interpreter2>> pool;
+    // set by `-p`
+    Profile *profile = nullptr;
+    // set by `--heap-profile`
+    AllocationProfile *allocations = nullptr;
+    // set by `--ngrams`
+    NGramProfile *ngrams = nullptr;
+
+    size_t ip;
+    size_t fn;
+    size_t base;
+    size_t args;
+    size_t locals;
+    size_t captured;
+    bool is_closure;
+
+    // taken at the first CALL_Lread when set
+    std::string snapshot;
+    uint64_t program_key = 0;
+
+    int32_t get_code_size()
+    {
+        return result.code_size;
+    }
+
+    int32_t read_i32()
+    {
+        assert(get_code_size() >= ip + sizeof(int32_t), "Unexpected file end while reading instruction arg");
+
+        int32_t res;
+        std::memcpy(&res, &result.code[ip], sizeof(int32_t));
+        ip += sizeof(int32_t);
+        return res;
+    }
+
+    int32_t code_i32(size_t offset)
+    {
+        int32_t res;
+        std::memcpy(&res, &result.code[offset], sizeof(int32_t));
+        return res;
+    }
+
+    // Pushes the frame record of the current function before a call
+    void push_frame()
+    {
+        push(BOX(ip | fn << FRAME_IP_BITS));
+        push(BOX(base << 1 | (is_closure ? 1 : 0)));
+    }
+
+    // Restores the caller from the frame record below 'base', returns false for the outermost frame
+    bool pop_frame()
+    {
+        aint ret = UNBOX(stack[base - FRAME_WORDS]);
+        aint saved = UNBOX(stack[base - FRAME_WORDS + 1]);
+
+        ip = ret & ((aint(1) << FRAME_IP_BITS) - 1);
+        if (ip == 0)
+        {
+            return false;
+        }
+
+        fn = ret >> FRAME_IP_BITS;
+        base = saved >> 1;
+        is_closure = saved & 1;
+        args = code_i32(fn + 1);
+        locals = result.functions[code_i32(fn + 1 + sizeof(int32_t))].locals;
+        captured = is_closure ? obj_length(reinterpret_cast<void *>(stack[base - FRAME_WORDS - args - 1])) - 1 : 0;
+        return true;
+    }
+
+    aint pop()
+    {
+        __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_bottom) - 1;
+        return *reinterpret_cast<aint *>(__gc_stack_bottom);
+    }
+
+    void push(aint v)
+    {
+        *reinterpret_cast<aint *>(__gc_stack_bottom) = v;
+        __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_bottom) + 1;
+    }
+
+    int interpret()
+    {
+        bool profiled = profile != nullptr || allocations != nullptr || ngrams != nullptr;
+        return profiled ? dispatch<true>() : dispatch<false>();
+    }
+
+    // Records the object on top of the stack made by the instruction at 'site'
+    template <bool PROFILE>
+    void allocated(size_t site)
+    {
+        if constexpr (PROFILE)
+        {
+            if (allocations != nullptr)
+            {
+                allocations->record(site, *reinterpret_cast<void **>(reinterpret_cast<aint *>(__gc_stack_bottom) - 1));
+            }
+        }
+    }
+
+    // the profiling loop is a separate instance, so that the usual one doesn't check for it
+    template <bool PROFILE>
+    int dispatch()
+    {
+        auto code = result.code;
+
+        while (true)
+        {
+            assert(ip < get_code_size() && ip >= 0, "Tried to read instruction outside of bytecode");
+            if constexpr (PROFILE)
+            {
+                if (profile != nullptr)
+                {
+                    profile->tick(ip);
+                }
+                if (ngrams != nullptr)
+                {
+                    ngrams->tick(ip);
+                }
+            }
+            char instr = code[ip];
+            ip++;
+            switch (instr)
+            {
+            case instr::ADD:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) + UNBOX(rhs)));
+                break;
+            }
+            case instr::SUB:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) - UNBOX(rhs)));
+                break;
+            }
+            case instr::MUL:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX(UNBOX(lhs) * UNBOX(rhs)));
+                break;
+            }
+            case instr::DIV:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                assert_with_ip(UNBOX(rhs) != 0, ip, "Division by zero");
+                push(BOX(UNBOX(lhs) / UNBOX(rhs)));
+                break;
+            }
+            case instr::REM:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                assert_with_ip(UNBOX(rhs) != 0, ip, "Remainder zero");
+                push(BOX(UNBOX(lhs) % UNBOX(rhs)));
+                break;
+            }
+            case instr::LSS:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) < UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::LEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) <= UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::GRE:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) > UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::GEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) >= UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::EQU:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                push(BOX(lhs == rhs ? 1 : 0));
+                break;
+            }
+            case instr::NEQ:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != UNBOX(rhs)) ? 1 : 0));
+                break;
+            }
+            case instr::AND:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != 0 && UNBOX(rhs) != 0) ? 1 : 0));
+                break;
+            }
+            case instr::OR:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+                assert_with_ip(UNBOXED(rhs) && UNBOXED(lhs), ip, "Arguments not integers");
+                push(BOX((UNBOX(lhs) != 0 || UNBOX(rhs) != 0) ? 1 : 0));
+                break;
+            }
+            case instr::CONST:
+            {
+                auto v = read_i32();
+                push(BOX(v));
+                break;
+            }
+            case instr::STRING:
+            {
+                size_t site = ip - 1;
+                auto v = read_i32();
+                std::string_view sv = &result.st[v];
+                void *v_ = get_object_content_ptr(alloc_string(sv.length()));
+                push(reinterpret_cast<aint>(v_));
+                strcpy(TO_DATA(v_)->contents, sv.data());
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::SEXP:
+            {
+                size_t site = ip - 1;
+                int32_t s = read_i32();
+                int32_t n = read_i32();
+                char *tag = &result.st[s];
+                auto *v = get_object_content_ptr(alloc_sexp(n));
+
+                set_sexp_tag(v, UNBOX(LtagHash(tag)));
+
+                for (int32_t i = n - 1; i >= 0; i--)
+                {
+                    auto vv = pop();
+                    auto sexp_ = TO_SEXP(v);
+                    reinterpret_cast<auint *>(sexp_->contents)[i] = vv;
+                }
+
+                push(reinterpret_cast<aint>(v));
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::STI:
+            {
+                not_implemented(ip, "STI");
+            }
+            case instr::STA:
+            {
+                auto v = pop();
+                auto idx_v = pop();
+                auto agg = pop();
+
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+                assert_with_ip(UNBOXED(idx_v), ip, "Index not integer");
+
+                auto idx = UNBOX(idx_v);
+                auto agg_ = TO_DATA(agg);
+                aint len = static_cast<aint>(obj_length(reinterpret_cast<void *>(agg)));
+                assert_with_ip(idx >= 0 && idx < len, ip, "Index outside of range");
+                switch (tag)
+                {
+                case ARRAY:
+                case SEXP:
+                    reinterpret_cast<aint *>(agg_->contents)[idx] = v;
+                    break;
+                case STRING:
+                    assert_with_ip(UNBOXED(v) && v >= 0 && v <= 0xff, ip, "Can't assign value to string");
+                    agg_->contents[idx] = UNBOX(v);
+                    break;
+                default:
+                    unreachable(ip);
+                }
+                push(v);
+                break;
+            }
+            case instr::JMP:
+            {
+                int32_t offset = read_i32();
+                if (__gc_stop_requested)
+                {
+                    gc_safepoint();
+                }
+                ip = offset;
+                break;
+            }
+            case instr::END:
+            case instr::RET:
+            {
+                aint v = pop();
+                size_t bottom = base - FRAME_WORDS - args - (is_closure ? 1 : 0);
+                bool outermost = !pop_frame();
+
+                __gc_stack_bottom = reinterpret_cast<aint *>(__gc_stack_top) + bottom;
+                push(v);
+
+                if (outermost && !fiber_finish(*this))
+                {
+                    return 0;
+                }
+
+                break;
+            }
+            case instr::DROP:
+            {
+                pop();
+                break;
+            }
+            case instr::DUP:
+            {
+                aint v = pop();
+                push(v);
+                push(v);
+
+                break;
+            }
+            case instr::SWAP:
+            {
+                aint top = pop();
+                aint second = pop();
+
+                push(top);
+                push(second);
+
+                break;
+            }
+            case instr::ELEM:
+            {
+                aint idx_v = pop();
+                aint agg = pop();
+
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+                assert_with_ip(UNBOXED(idx_v), ip, "Index not integer");
+
+                auto idx = UNBOX(idx_v);
+                auto agg_ = TO_DATA(agg);
+                aint len = static_cast<aint>(obj_length(reinterpret_cast<void *>(agg)));
+                if (idx < 0 || idx >= len)
+                {
+                    throw VMError("Index outside of range");
+                }
+                switch (tag)
+                {
+                case ARRAY:
+                    push(reinterpret_cast<aint *>(agg_->contents)[idx]);
+                    break;
+                case STRING:
+                    push(BOX(agg_->contents[idx]));
+                    break;
+                case SEXP:
+                {
+                    auto sexp_ = TO_SEXP(agg);
+                    push(reinterpret_cast<auint *>(sexp_->contents)[idx]);
+                    break;
+                }
+                default:
+                    unreachable(ip);
+                }
+
+                break;
+            }
+            case instr::LDG:
+            {
+                auto g = read_i32();
+                push(globals[g]);
+
+                break;
+            }
+            case instr::LDL:
+            {
+                auto l = read_i32();
+                push(stack[base + l]);
+                break;
+            }
+            case instr::LDA:
+            {
+                auto a = read_i32();
+                push(stack[base - FRAME_WORDS - args + a]);
+
+                break;
+            }
+            case instr::LDC:
+            {
+                auto c = read_i32();
+                auto cc = stack[base - FRAME_WORDS - args - 1];
+                assert_with_ip(c >= 0 && c < captured, ip, "Tried to get invalid captured");
+                auto cc_ = (aint *)cc;
+                push(cc_[c + 1]);
+                break;
+            }
+
+            case instr::LDGR:
+            {
+                not_implemented(ip, "LDGR");
+            }
+            case instr::LDLR:
+            {
+                not_implemented(ip, "LDLR");
+            }
+            case instr::LDAR:
+            {
+                not_implemented(ip, "LDAR");
+            }
+            case instr::LDCR:
+            {
+                not_implemented(ip, "LDCR");
+            }
+            case instr::STG:
+            {
+                auto g = read_i32();
+                auto v = pop();
+
+                globals[g] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STL:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                stack[base + l] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STA_:
+            {
+                auto a = read_i32();
+                auto v = pop();
+
+                stack[base - FRAME_WORDS - args + a] = v;
+                push(v);
+
+                break;
+            }
+            case instr::STC:
+            {
+                auto c = read_i32();
+                auto cc = stack[base - FRAME_WORDS - args - 1];
+                assert_with_ip(c >= 0 && c < captured, ip, "Tried to get invalid captured");
+                auto cc_ = (aint *)cc;
+                auto v = pop();
+
+                cc_[c + 1] = v;
+                push(v);
+
+                break;
+            }
+            case instr::CJMPZ:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                if (UNBOX(v) == 0)
+                {
+                    ip = l;
+                }
+
+                break;
+            }
+            case instr::CJMPNZ:
+            {
+                auto l = read_i32();
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                if (UNBOX(v) != 0)
+                {
+                    ip = l;
+                }
+
+                break;
+            }
+            case instr::BEGIN:
+            case instr::CBEGIN:
+            {
+                if (__gc_stop_requested)
+                {
+                    gc_safepoint();
+                }
+
+                auto a = read_i32();
+                auto index = static_cast<uint32_t>(read_i32());
+                assert_with_ip(index < result.functions.size(), ip, "Function has no frame");
+                auto &frame = result.functions[index];
+                auto m = frame.depth;
+                auto locs = frame.locals;
+
+                assert_with_ip(static_cast<size_t>(a) == args, ip, "Wrong number of arguments");
+
+                locals = locs;
+
+                // room for the frame record of a call made at the maximum depth as well
+                if (base + locs + m + FRAME_WORDS > stack.capacity())
+                {
+                    grow_stack(*this, base + locs + m + FRAME_WORDS, ip);
+                }
+
+                for (int32_t i = 0; i < locs; i++)
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::CLOSURE:
+            {
+                size_t site = ip - 1;
+                auto l = read_i32();
+                auto n = read_i32();
+                auto *closure = get_object_content_ptr(alloc_closure(n + 1));
+                push(reinterpret_cast<aint>(closure));
+                static_cast<aint *>(closure)[0] = l;
+
+                for (int32_t i = 0; i < n; ++i)
+                {
+                    auto kind = static_cast<char>(code[this->ip]);
+                    ip++;
+                    auto m = read_i32();
+
+                    switch (kind)
+                    {
+                    case 0:
+                        static_cast<aint *>(closure)[i + 1] = globals[m];
+                        break;
+
+                    case 1:
+                        static_cast<aint *>(closure)[i + 1] = stack[base + m];
+                        break;
+
+                    case 2:
+                        static_cast<aint *>(closure)[i + 1] = stack[base - FRAME_WORDS - args + m];
+                        break;
+
+                    case 3:
+                        static_cast<aint *>(closure)[i + 1] = ((aint *)stack[base - FRAME_WORDS - args - 1])[m + 1];
+                        break;
+
+                    default:
+                        throw VMError("Not implemented");
+                    }
+                }
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALLC:
+            {
+                auto n = read_i32();
+                auto closure = *(reinterpret_cast<aint *>(__gc_stack_bottom) - n - 1);
+
+                assert_with_ip(!UNBOXED(closure) && get_type_row_ptr(reinterpret_cast<void *>(closure)) == CLOSURE,
+                               ip, "Try to call not closure");
+
+                push_frame();
+
+                ip = reinterpret_cast<aint *>(closure)[0];
+                fn = ip;
+                is_closure = true;
+                base = reinterpret_cast<aint *>(__gc_stack_bottom) - reinterpret_cast<aint *>(__gc_stack_top);
+                args = n;
+                locals = 0;
+                captured = obj_length(reinterpret_cast<void *>(closure)) - 1;
+
+                break;
+            }
+            case instr::CALL:
+            {
+                auto l = read_i32();
+                auto n = read_i32();
+
+                push_frame();
+
+                ip = l;
+                fn = l;
+                is_closure = false;
+                base = reinterpret_cast<aint *>(__gc_stack_bottom) - reinterpret_cast<aint *>(__gc_stack_top);
+                args = n;
+                captured = 0;
+                locals = 0;
+
+                break;
+            }
+            case instr::TAG:
+            {
+                auto s = read_i32();
+                auto n = read_i32();
+                auto v = pop();
+
+                char *exp = &result.st[s];
+                aint exp_ = UNBOX(LtagHash(exp));
+
+                if (!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == SEXP)
+                {
+                    auto sexp_ = TO_SEXP(v);
+                    auto tag = get_sexp_tag(reinterpret_cast<void *>(v));
+
+                    push((LEN(sexp_->data_header) == n && exp_ == tag) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::ARRAY:
+            {
+                auto n = read_i32();
+                auto v = pop();
+
+                if (!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == ARRAY)
+                {
+                    auto data_ = TO_DATA(v);
+                    push((LEN(data_->data_header) == n) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::FAIL:
+            {
+                auto ln = read_i32();
+                auto col = read_i32();
+                pop();
+
+                throw VMError("Match failure at " + std::to_string(ln) + ":" + std::to_string(col));
+            }
+            case instr::LINE:
+            {
+                read_i32();
+                break;
+            }
+            case instr::PATT_eq:
+            {
+                auto rhs = pop();
+                auto lhs = pop();
+
+                if (!UNBOXED(lhs) && get_type_row_ptr(reinterpret_cast<void *>(lhs)) == STRING &&
+                    !UNBOXED(rhs) && get_type_row_ptr(reinterpret_cast<void *>(rhs)) == STRING)
+                {
+                    push((strcmp(TO_DATA(lhs)->contents, TO_DATA(rhs)->contents) == 0) ? BOX(1) : BOX(0));
+                }
+                else
+                {
+                    push(BOX(0));
+                }
+
+                break;
+            }
+            case instr::PATT_is_string:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == STRING)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_array:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == ARRAY)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_sexp:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == SEXP)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_ref:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v))
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_val:
+            {
+                auto v = pop();
+
+                push((UNBOXED(v))
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::PATT_is_fun:
+            {
+                auto v = pop();
+
+                push((!UNBOXED(v) && get_type_row_ptr(reinterpret_cast<void *>(v)) == CLOSURE)
+                         ? BOX(1)
+                         : BOX(0));
+                break;
+            }
+            case instr::CALL_Lread:
+            {
+                if (!snapshot.empty())
+                {
+                    ip--;
+                    save_snapshot(*this, snapshot, program_key);
+                    ip++;
+                    snapshot.clear();
+                }
+
+                aint v = 0;
+                std::cout << " > " << std::flush;
+                std::cin >> v;
+
+                push(BOX(v));
+
+                break;
+            }
+            case instr::CALL_Lwrite:
+            {
+                auto v = pop();
+
+                assert_with_ip(UNBOXED(v), ip, "Value is not integer");
+
+                std::cout << UNBOX(v) << "\n";
+
+                push(BOX(0));
+
+                break;
+            }
+            case instr::CALL_Llength:
+            {
+                auto agg = pop();
+                assert_with_ip(!UNBOXED(agg), ip, "Not aggregate");
+                auto tag = get_type_row_ptr(reinterpret_cast<void *>(agg));
+                assert_with_ip(tag == ARRAY || tag == STRING || tag == SEXP, ip, "Not aggregate");
+
+                push(BOX(obj_length(reinterpret_cast<void *>(agg))));
+                break;
+            }
+            case instr::CALL_Lstring:
+            {
+                size_t site = ip - 1;
+                auto v = pop();
+
+                push(reinterpret_cast<aint>(Lstring(&v)));
+
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALL_Barray:
+            {
+                size_t site = ip - 1;
+                auto n = read_i32();
+                auto *v = get_object_content_ptr(alloc_array(n));
+
+                for (int32_t i = n - 1; i >= 0; i--)
+                {
+                    static_cast<aint *>(v)[i] = pop();
+                }
+
+                push(reinterpret_cast<aint>(v));
+                allocated<PROFILE>(site);
+                break;
+            }
+            case instr::CALL_Bspawn:
+            {
+                fiber_spawn(*this);
+                break;
+            }
+            case instr::CALL_Byield:
+            {
+                fiber_yield(*this);
+                break;
+            }
+            case instr::CALL_Bjoin:
+            {
+                fiber_join(*this);
+                break;
+            }
+            case instr::CALL_Bpmap:
+            case instr::CALL_Bpfold:
+            case instr::CALL_Bpfilter:
+            {
+                parallel_builtin(*this, static_cast<instr::Instr>(instr));
+                break;
+            }
+
+            default:
+                assert(false, "Unsupported instruction");
+                break;
+            }
+        }
+        return 0;
+    }
+
+    Interpreter2(Result result_)
+    {
+        // Globals + dummy main arguments + outermost frame record
+        const size_t base_ = result_.header.globals_length + 2 + FRAME_WORDS;
+
+        result = result_;
+        std::fill(stack.data(), stack.data() + base_, BOX(0));
+        ip = 0;
+        fn = 0;
+        base = base_;
+        args = 2;
+        is_closure = false;
+
+        globals = stack.data();
+        __gc_stack_top = stack.data();
+        __gc_stack_bottom = stack.data() + base_;
+
+        __init();
+    }
+
+    // Interpreter of a pool worker: shares the program, the globals and the runtime of its owner
+    Interpreter2(const Result &result_, aint *globals_) : stack(WORKER_STACK_SIZE, false)
+    {
+        result = result_;
+        globals = globals_;
+        worker = true;
+        ip = 0;
+        fn = 0;
+        base = 0;
+        args = 0;
+        locals = 0;
+        captured = 0;
+        is_closure = false;
+    }
+
+    ~Interpreter2()
+    {
+        pool.reset();
+        if (!worker)
+        {
+            __shutdown();
+        }
+    }
+};
+
+std::string to_hex_string(const std::vector<char> &vec)
+{
+    std::ostringstream oss;
+    oss << std::hex << std::uppercase << std::setfill('0');
+    for (size_t i = 0; i < vec.size(); ++i)
+    {
+        if (i > 0)
+            oss << ' ';
+        oss << std::setw(2) << static_cast<int>(static_cast<unsigned char>(vec[i]));
+    }
+    return oss.str();
+}
+
+// ============================================================================
+//                        Cache of verified programs
+// ============================================================================
+// Verification only finds the frames of functions (see set_functions), so they
+// are stored under $LAMA_CACHE_DIR, when it is set, and applied on the next
+// launch instead of verifying again. An entry is named by the hash of the
+// bytecode file and keeps a copy of the file, which has to match exactly, and
+// the version of the verifier.
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t size;
+    uint64_t functions;
+    // content_hash of the frames
+    uint64_t checksum;
+};
+
+const char CACHE_MAGIC[8] = {'L', 'A', 'M', 'A', 'V', 'B', 'C', '4'};
+
+// FNV-1a
+uint64_t content_hash(FileView file)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < file.size; i++)
+    {
+        h = (h ^ static_cast<unsigned char>(file.data[i])) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string cache_dir()
+{
+    const char *dir = getenv("LAMA_CACHE_DIR");
+    if (dir == nullptr || *dir == '\0')
+    {
+        return "";
+    }
+    mkdir(dir, 0755);
+    return dir;
+}
+
+std::string cache_path(const std::string &dir, uint64_t key)
+{
+    std::ostringstream s;
+    s << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".vbc";
+    return s.str();
+}
+
+// Offsets of the BEGINs reached from the public functions by jumps, calls and
+// closures, which are the functions the verifier finds frames for. False if
+// the code can't be followed.
+bool reached_functions(const Result &result, std::vector<int32_t> &offsets)
+{
+    Code code(result.code, result.code_size);
+    const size_t size = result.code_size;
+    std::vector<bool> visited(size, false);
+    std::vector<int32_t> stack;
+    auto push = [&](int64_t target)
+    {
+        if (target < 0 || static_cast<size_t>(target) >= size)
+        {
+            return false;
+        }
+        if (!visited[target])
+        {
+            visited[target] = true;
+            stack.push_back(target);
+        }
+        return true;
+    };
+
+    for (int32_t i = 0; i < result.header.pubs_length; i++)
+    {
+        int32_t l = result.pubs[i].b;
+        if (l >= 0 && l < result.code_size &&
+            (code.get_by_id(l)->tag == instr::BEGIN || code.get_by_id(l)->tag == instr::CBEGIN))
+        {
+            push(l);
+        }
+    }
+
+    while (!stack.empty())
+    {
+        size_t at = stack.back();
+        stack.pop_back();
+        while (true)
+        {
+            const Instruction *cur = code.get_by_id(at);
+            if (at + sizeof(char) + sizeof(int32_t) * cur->get_args_length() > size ||
+                (cur->is_closure() && (cur->args[1] < 0 || at + cur->size() > size)))
+            {
+                return false;
+            }
+            if (cur->tag == instr::BEGIN || cur->tag == instr::CBEGIN)
+            {
+                offsets.push_back(at);
+            }
+
+            bool next = true;
+            switch (cur->tag)
+            {
+            case instr::JMP:
+                next = false;
+                if (!push(cur->args[0]))
+                {
+                    return false;
+                }
+                break;
+            case instr::CJMPZ:
+            case instr::CJMPNZ:
+            case instr::CALL:
+            case instr::CLOSURE:
+                if (!push(cur->args[0]))
+                {
+                    return false;
+                }
+                break;
+            case instr::END:
+            case instr::RET:
+            case instr::FAIL:
+                next = false;
+                break;
+            default:
+                break;
+            }
+
+            at += cur->size();
+            if (!next || at >= size || visited[at])
+            {
+                break;
+            }
+            visited[at] = true;
+        }
+    }
+    std::sort(offsets.begin(), offsets.end());
+    return true;
+}
+
+// Reads the frames of functions of the program from the entry for its file,
+// returns false if there is no entry for exactly this file and verifier or
+// the frames don't fit the program: there has to be exactly one for every
+// function the verifier would find. Depths can't be checked without verifying
+// again, so the cache directory is trusted as much as the program itself.
+bool cache_lookup(const std::string &dir, uint64_t key, const Result &result, std::vector<FunctionInfo> &functions)
+{
+    FileView file = result.file;
+    int fd = open(cache_path(dir, key).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(CacheHeader))
+    {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const char *entry = static_cast<const char *>(data);
+    CacheHeader header;
+    std::memcpy(&header, entry, sizeof(header));
+    bool ok = std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+              header.version == VERIFIER_VERSION && header.key == key && header.size == file.size &&
+              header.functions <= static_cast<uint64_t>(result.code_size) &&
+              static_cast<size_t>(st.st_size) == sizeof(CacheHeader) + file.size + header.functions * sizeof(FunctionInfo) &&
+              std::memcmp(entry + sizeof(CacheHeader), file.data, file.size) == 0;
+    if (ok)
+    {
+        functions.resize(header.functions);
+        std::memcpy(functions.data(), entry + sizeof(CacheHeader) + file.size, functions.size() * sizeof(FunctionInfo));
+        ok = content_hash(FileView{reinterpret_cast<char *>(functions.data()), functions.size() * sizeof(FunctionInfo)}) ==
+             header.checksum;
+    }
+    munmap(data, st.st_size);
+
+    // every frame has to belong to a BEGIN with its number of locals
+    Code code(result.code, result.code_size);
+    for (size_t i = 0; ok && i < functions.size(); i++)
+    {
+        const FunctionInfo &f = functions[i];
+        ok = f.offset >= 0 && f.offset < result.code_size && f.locals >= 0 && f.depth >= 0;
+        if (ok)
+        {
+            const Instruction *begin = code.get_by_id(f.offset);
+            ok = (begin->tag == instr::BEGIN || begin->tag == instr::CBEGIN) &&
+                 f.offset + begin->size() <= static_cast<size_t>(result.code_size) && begin->args[1] == f.locals;
+        }
+    }
+    if (ok)
+    {
+        std::vector<int32_t> reached, cached;
+        for (const FunctionInfo &f : functions)
+        {
+            cached.push_back(f.offset);
+        }
+        std::sort(cached.begin(), cached.end());
+        ok = reached_functions(result, reached) && reached == cached;
+    }
+    if (!ok)
+    {
+        functions.clear();
+    }
+    return ok;
+}
+
+// Best effort, the entry is written to a temporary file and renamed so that
+// concurrent launches never see a partial entry
+void cache_store(const std::string &dir, uint64_t key, FileView file, const std::vector<FunctionInfo> &functions)
+{
+    std::string path = cache_path(dir, key);
+    std::string tmp = path + "." + std::to_string(getpid());
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    CacheHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = VERIFIER_VERSION;
+    header.key = key;
+    header.size = file.size;
+    header.functions = functions.size();
+    size_t bytes = functions.size() * sizeof(FunctionInfo);
+    header.checksum = content_hash(FileView{reinterpret_cast<char *>(const_cast<FunctionInfo *>(functions.data())), bytes});
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+              write(fd, file.data, file.size) == static_cast<ssize_t>(file.size) &&
+              write(fd, functions.data(), bytes) == static_cast<ssize_t>(bytes);
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+    }
+}
+
+// Returns the verified program, taking the frames of its functions from the
+// cache when possible; 'key' receives the content hash of the bytecode
+Result load_verified(FileView file, uint64_t &key)
+{
+    key = content_hash(file);
+    std::string dir = cache_dir();
+    Result result = parse_and_validate(file);
+    Verifier verifier(result);
+    if (dir.empty())
+    {
+        verifier.verify();
+        // the file is mapped read-only
+        copy_code(result);
+        set_functions(result, std::move(verifier.functions));
+        return result;
+    }
+
+    if (!cache_lookup(dir, key, result, verifier.functions))
+    {
+        verifier.verify();
+        cache_store(dir, key, file, verifier.functions);
+    }
+    copy_code(result);
+    set_functions(result, std::move(verifier.functions));
+    return result;
+}
+
+// ============================================================================
+//                              Embedding API
+// ============================================================================
+
+struct LamaVM::Machine
+{
+    virtual ~Machine() = default;
+    virtual int run() = 0;
+    virtual aint call(int32_t entry, const std::vector<aint> &args) = 0;
+    virtual void snapshot_at_read(const std::string &path, uint64_t key) = 0;
+    virtual void restore(const std::string &path, uint64_t key) = 0;
+    virtual size_t current_ip() = 0;
+    virtual void start_profile() = 0;
+    virtual void write_profile(std::ostream &out, const LineTable &lines) = 0;
+    virtual void start_sampling() = 0;
+    virtual void stop_sampling() = 0;
+    virtual void write_samples(std::ostream &out, const LineTable &lines) = 0;
+    // the context of the VM has to be bound
+    virtual void start_heap_profile() = 0;
+    virtual void write_heap_profile(std::ostream &out, const LineTable &lines) = 0;
+    virtual void start_ngrams() = 0;
+    virtual void write_ngrams(std::ostream &out) = 0;
+};
+
+template <typename I>
+struct MachineOf : LamaVM::Machine
+{
+    I it;
+    std::unique_ptr<Profile> prof;
+    std::unique_ptr<Sampler> sampler;
+    std::unique_ptr<AllocationProfile> heap_prof;
+    std::unique_ptr<NGramProfile> ngram_prof;
+
+    explicit MachineOf(Result result) : it(result) {}
+
+    int run() override
+    {
+        return it.interpret();
+    }
+
+    aint call(int32_t entry, const std::vector<aint> &args) override
+    {
+        return call_outermost(it, entry, nullptr, args.data(), args.size());
+    }
+
+    void snapshot_at_read(const std::string &path, uint64_t key) override
+    {
+        it.snapshot = path;
+        it.program_key = key;
+    }
+
+    void restore(const std::string &path, uint64_t key) override
+    {
+        restore_snapshot(it, path, key);
+    }
+
+    void start_profile() override
+    {
+        prof.reset(new Profile(it.result.code_size));
+        it.profile = prof.get();
+    }
+
+    size_t current_ip() override
+    {
+        return it.ip;
+    }
+
+    void write_profile(std::ostream &out, const LineTable &lines) override
+    {
+        prof->write(out, it.result, lines);
+    }
+
+    void start_sampling() override
+    {
+        sampler.reset(new Sampler(&it, sample_stack<I>));
+        assert(set_sampler(sampler.get()) == nullptr, "Another program is being sampled");
+    }
+
+    void stop_sampling() override
+    {
+        reset_sampler(sampler.get());
+    }
+
+    void write_samples(std::ostream &out, const LineTable &lines) override
+    {
+        sampler->write(out, it.result, lines);
+    }
+
+    void start_heap_profile() override
+    {
+        heap_prof.reset(new AllocationProfile(it.result.code_size));
+        it.allocations = heap_prof.get();
+        gc_set_survivors_hook(AllocationProfile::survivors, heap_prof.get());
+    }
+
+    void write_heap_profile(std::ostream &out, const LineTable &lines) override
+    {
+        heap_prof->write(out, it.result, lines);
+    }
+
+    void start_ngrams() override
+    {
+        ngram_prof.reset(new NGramProfile(it.result));
+        it.ngrams = ngram_prof.get();
+    }
+
+    void write_ngrams(std::ostream &out) override
+    {
+        ngram_prof->write(out, it.result);
+    }
+};
+
+[[noreturn]] static void throw_failure(const char *msg)
+{
+    std::string s = msg;
+    if (!s.empty() && s.back() == '\n')
+    {
+        s.pop_back();
+    }
+    throw RuntimeFailure(s);
+}
+
+// Makes the context of a VM current on this thread for the lifetime of the guard
+struct ContextGuard
+{
+    lama_vm *prev;
+
+    explicit ContextGuard(lama_vm *context) : prev(vm_bind(context)) {}
+    ~ContextGuard() { vm_bind(prev); }
+};
+
+// Reports an error of execution by the offset of its instruction in the bytecode
+// file and by the source line if it is known
+static VMError locate_error(const VMError &e, const LineTable &lines, size_t current_ip)
+{
+    size_t ip = e.ip >= 0 ? e.ip : current_ip;
+    int32_t line = lines.line(ip);
+    std::string msg = e.message;
+    if (line > 0)
+    {
+        msg += " at line " + std::to_string(line);
+    }
+    return VMError(msg, e.ip >= 0 ? lines.origin(e.ip) : -1);
+}
+
+LamaVM::LamaVM(const std::string &fname, Mode mode_) : mode(mode_)
+{
+    __failure_handler = throw_failure;
+    // unmapped if the program is rejected, owned by 'result' once the VM is created
+    MappedFile file(read_file(fname));
+    result = load_verified(file.file, key);
+    lines.reset(new LineTable(strip_lines(result)));
+    start();
+    file.release();
+}
+
+LamaVM::~LamaVM()
+{
+    // the interpreter shuts the runtime down, which frees the context and unbinds it
+    lama_vm *prev = vm_bind(context);
+    machine.reset();
+    vm_bind(prev == context ? nullptr : prev);
+    unmap_file(result.file);
+}
+
+// Creates the interpreter with a fresh context, keeping the caller's context current
+void LamaVM::start()
+{
+    lama_vm *prev = vm_bind(nullptr);
+    try
+    {
+        if (mode == VERIFIED)
+        {
+            machine.reset(new MachineOf<Interpreter2>(result));
+        }
+        else
+        {
+            machine.reset(new MachineOf<Interpreter>(result));
+        }
+    }
+    catch (...)
+    {
+        vm_bind(prev);
+        throw;
+    }
+    context = vm_bind(prev);
+    finished = false;
+    if (!profile_path.empty())
+    {
+        machine->start_profile();
+    }
+    if (!heap_profile_path.empty())
+    {
+        ContextGuard guard(context);
+        machine->start_heap_profile();
+    }
+    if (!ngrams_path.empty())
+    {
+        machine->start_ngrams();
+    }
+}
+
+int LamaVM::run()
+{
+    assert(!finished, "Program has already run, reset the VM to run it again");
+    ContextGuard guard(context);
+    finished = true;
+    if (!sample_path.empty())
+    {
+        machine->start_sampling();
+    }
+
+    int code;
+    try
+    {
+        code = machine->run();
+    }
+    catch (const RuntimeFailure &)
+    {
+        write_reports();
+        throw;
+    }
+    catch (const VMError &e)
+    {
+        write_reports();
+        throw locate_error(e, *lines, machine->current_ip());
+    }
+    catch (...)
+    {
+        write_reports();
+        throw;
+    }
+    write_reports();
+    return code;
+}
+
+// Writes the profiles and the samples of a run
+void LamaVM::write_reports()
+{
+    if (!sample_path.empty())
+    {
+        machine->stop_sampling();
+        std::ofstream out(sample_path);
+        machine->write_samples(out, *lines);
+        assert(out.good(), "Failed to write samples " + sample_path);
+    }
+    if (!profile_path.empty())
+    {
+        std::ofstream out(profile_path);
+        machine->write_profile(out, *lines);
+        assert(out.good(), "Failed to write profile " + profile_path);
+    }
+    if (!heap_profile_path.empty())
+    {
+        std::ofstream out(heap_profile_path);
+        machine->write_heap_profile(out, *lines);
+        assert(out.good(), "Failed to write heap profile " + heap_profile_path);
+    }
+    if (!ngrams_path.empty())
+    {
+        std::ofstream out(ngrams_path);
+        machine->write_ngrams(out);
+        assert(out.good(), "Failed to write n-grams " + ngrams_path);
+    }
+}
+
+aint LamaVM::call(const std::string &function, const std::vector<aint> &args)
+{
+    for (int32_t i = 0; i < result.header.pubs_length; i++)
+    {
+        if (function == result.st + result.pubs[i].a)
+        {
+            int32_t entry = result.pubs[i].b;
+            assert(entry >= 0 && entry < result.code_size &&
+                       (result.code[entry] == instr::BEGIN || result.code[entry] == instr::CBEGIN),
+                   "Public symbol " + function + " is not a function");
+
+            ContextGuard guard(context);
+            try
+            {
+                return machine->call(entry, args);
+            }
+            catch (const RuntimeFailure &)
+            {
+                throw;
+            }
+            catch (const VMError &e)
+            {
+                // registers are restored already, the error is located only by its own offset
+                throw locate_error(e, *lines, -1);
+            }
+        }
+    }
+    throw VMError("Unknown public function " + function);
+}
+
+void LamaVM::reset()
+{
+    lama_vm *prev = vm_bind(context);
+    machine.reset();
+    vm_bind(prev == context ? nullptr : prev);
+    start();
+}
+
+void LamaVM::profile(const std::string &path)
+{
+    profile_path = path;
+    machine->start_profile();
+}
+
+void LamaVM::sample(const std::string &path)
+{
+    sample_path = path;
+}
+
+void LamaVM::heap_profile(const std::string &path)
+{
+    heap_profile_path = path;
+    ContextGuard guard(context);
+    machine->start_heap_profile();
+}
+
+void LamaVM::count_ngrams(const std::string &path)
+{
+    ngrams_path = path;
+    machine->start_ngrams();
+}
+
+void LamaVM::dump_heap(const std::string &path)
+{
+    ContextGuard guard(context);
+    assert(gc_dump_heap(path.c_str()) == 0, "Failed to write heap dump " + path);
+}
+
+void LamaVM::snapshot_at_read(const std::string &path)
+{
+    machine->snapshot_at_read(path, key);
+}
+
+void LamaVM::restore(const std::string &path)
+{
+    ContextGuard guard(context);
+    machine->restore(path, key);
+    finished = false;
+}
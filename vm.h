@@ -0,0 +1,99 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "commons.h"
+#include "runtime/runtime_common.h"
+
+struct lama_vm;
+struct LineTable;
+
+// Failure reported by the runtime (e.g. a wrong argument of a builtin), the
+// message is the one the standalone interpreter prints after "*** FAILURE: "
+struct RuntimeFailure : VMError
+{
+    using VMError::VMError;
+};
+
+// Embeddable virtual machine running one Lama program. Errors of loading,
+// verification and execution are thrown as VMError (RuntimeFailure for
+// failures of the runtime), the process is never terminated. Every VM has its
+// own heap, so several of them may be used on one thread or on separate
+// threads, but a VM must not be used by two threads at once. After an error
+// the VM should be reset before running the program again.
+class LamaVM
+{
+public:
+    enum Mode
+    {
+        // every instruction checks its operands
+        CHECKED,
+        // relies on the verifier, same as `interpreter -v`
+        VERIFIED,
+    };
+
+    // loads and verifies the bytecode file, initialises the heap
+    explicit LamaVM(const std::string &fname, Mode mode = CHECKED);
+    ~LamaVM();
+
+    LamaVM(const LamaVM &) = delete;
+    LamaVM &operator=(const LamaVM &) = delete;
+
+    // runs the program from the beginning of main (or from the restored snapshot)
+    // till its end, returns the exit code
+    int run();
+
+    // calls a public function, arguments and result are Lama values (integers are
+    // boxed with BOX), a returned reference is valid until the next call into this VM
+    aint call(const std::string &function, const std::vector<aint> &args);
+
+    // drops the heap and the globals, so that the program can run again
+    void reset();
+
+    // makes run take a snapshot at the first CALL_Lread (see `--snapshot`)
+    void snapshot_at_read(const std::string &path);
+
+    // restores state of a snapshot, the next run continues from it
+    void restore(const std::string &path);
+
+    // profiles execution of instructions (see `interpreter -p`), the report is
+    // written to the file when run returns or throws
+    void profile(const std::string &path);
+
+    // samples Lama call stacks of run with SIGPROF (see `--sample`), folded
+    // stacks are written to the file when run returns or throws
+    void sample(const std::string &path);
+
+    // tracks objects by the instruction allocating them and counts their
+    // survivals (see `--heap-profile`), the report is written when run returns
+    // or throws
+    void heap_profile(const std::string &path);
+
+    // counts executed instruction sequences within basic blocks (see
+    // `--ngrams`), the report is written when run returns or throws
+    void count_ngrams(const std::string &path);
+
+    // writes objects reachable from the globals and the stack of the VM for
+    // `heapanalyser`, may be called between runs and calls
+    void dump_heap(const std::string &path);
+
+    // Virtual machine of the selected mode, defined in vm.cpp
+    struct Machine;
+
+private:
+    Result result;
+    Mode mode;
+    uint64_t key;
+    std::unique_ptr<Machine> machine;
+    // LINE instructions stripped from the code
+    std::unique_ptr<LineTable> lines;
+    lama_vm *context;
+    bool finished = false;
+    std::string profile_path;
+    std::string sample_path;
+    std::string heap_profile_path;
+    std::string ngrams_path;
+
+    void start();
+    void write_reports();
+};